@@ -0,0 +1,61 @@
+// vim: ts=4:sw=4:et
+
+#ifndef CAN_CLASSIFIER_H
+#define CAN_CLASSIFIER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// What the stages after the receive path should do with a frame. A frame can
+// go to several stages, one with no bits set is dropped before it is buffered.
+#define CAN_ACTION_DROP    0x00
+#define CAN_ACTION_RESPOND 0x01
+#define CAN_ACTION_FORWARD 0x02
+#define CAN_ACTION_LOG     0x04
+#define CAN_ACTION_ALL     (CAN_ACTION_RESPOND | CAN_ACTION_FORWARD | CAN_ACTION_LOG)
+
+#define CAN_CLASSIFIER_STANDARD_IDS 2048
+#define CAN_CLASSIFIER_MAX_RANGES 16
+
+// Inclusive range of 29-bit extended ids
+struct CANIdRange {
+    uint32_t first;
+    uint32_t last;
+    uint8_t actions;
+};
+
+// Tags received frames with CAN_ACTION_* bits. Standard ids are one byte each
+// in a directly indexed table, extended ids are a sorted, binary searched
+// range table. classify() runs on the receive path, the setters on one other
+// thread, and reception never has to stop while the tables change: standard
+// entries are single byte stores, extended tables are built in a spare bank
+// and swapped in.
+class CANClassifier {
+public:
+    CANClassifier(uint8_t default_actions = CAN_ACTION_ALL);
+
+    // Standard ids first through last, inclusive. Returns 1, -2 for a bad range.
+    int setStandard(uint32_t first, uint32_t last, uint8_t actions);
+
+    // Replaces every extended range, ids outside them get extended_default.
+    // Returns 1, -1 for too many ranges, -2 for a reversed or overlapping range.
+    int setExtended(const CANIdRange* ranges, size_t count, uint8_t extended_default);
+
+    // Receive path only
+    uint8_t classify(uint32_t id, bool is_extended) const;
+
+private:
+    struct RangeBank {
+        CANIdRange ranges[CAN_CLASSIFIER_MAX_RANGES];
+        size_t count;
+        uint8_t fallback;
+    };
+
+    std::atomic<uint8_t> _standard[CAN_CLASSIFIER_STANDARD_IDS];
+    RangeBank _banks[2];
+    std::atomic<uint8_t> _active;
+    mutable std::atomic<uint8_t> _searching; // Bank classify() is in, plus one, 0 = none
+};
+
+#endif // CAN_CLASSIFIER_H
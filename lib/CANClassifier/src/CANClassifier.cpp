@@ -0,0 +1,94 @@
+// vim: ts=4:sw=4:et
+
+#include <CANClassifier.h>
+
+CANClassifier::CANClassifier(uint8_t default_actions) : _active(0), _searching(0) {
+    for (size_t i = 0; i < CAN_CLASSIFIER_STANDARD_IDS; i++) {
+        _standard[i].store(default_actions, std::memory_order_relaxed);
+    }
+    for (int bank = 0; bank < 2; bank++) {
+        _banks[bank].count = 0;
+        _banks[bank].fallback = default_actions;
+    }
+}
+
+int CANClassifier::setStandard(uint32_t first, uint32_t last, uint8_t actions) {
+    if (first > last || last >= CAN_CLASSIFIER_STANDARD_IDS) {
+        return -2;
+    }
+
+    // Each id changes on its own, a frame sees either the old or the new action
+    for (uint32_t id = first; id <= last; id++) {
+        _standard[id].store(actions, std::memory_order_relaxed);
+    }
+    return 1;
+}
+
+int CANClassifier::setExtended(const CANIdRange* ranges, size_t count, uint8_t extended_default) {
+    if (count > CAN_CLASSIFIER_MAX_RANGES) {
+        return -1;
+    }
+
+    uint8_t next = 1 - _active.load();
+
+    // classify() may still be in the spare bank from before the last swap
+    while (_searching.load() == next + 1) { }
+
+    RangeBank& bank = _banks[next];
+    bank.count = 0;
+    bank.fallback = extended_default;
+
+    // Insertion sort by first id, there are only a handful
+    for (size_t i = 0; i < count; i++) {
+        if (ranges[i].first > ranges[i].last) {
+            return -2;
+        }
+        size_t slot = bank.count++;
+        while (slot > 0 && bank.ranges[slot - 1].first > ranges[i].first) {
+            bank.ranges[slot] = bank.ranges[slot - 1];
+            slot--;
+        }
+        bank.ranges[slot] = ranges[i];
+    }
+
+    for (size_t i = 1; i < bank.count; i++) {
+        if (bank.ranges[i].first <= bank.ranges[i - 1].last) {
+            return -2;
+        }
+    }
+
+    _active.store(next);
+    return 1;
+}
+
+uint8_t CANClassifier::classify(uint32_t id, bool is_extended) const {
+    if (!is_extended) {
+        return _standard[id & (CAN_CLASSIFIER_STANDARD_IDS - 1)].load(std::memory_order_relaxed);
+    }
+
+    // Claim the active bank, and make sure it was still active once claimed
+    uint8_t active;
+    do {
+        active = _active.load();
+        _searching.store(active + 1);
+    } while (_active.load() != active);
+
+    const RangeBank& bank = _banks[active];
+    uint8_t actions = bank.fallback;
+    size_t low = 0;
+    size_t high = bank.count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (id < bank.ranges[mid].first) {
+            high = mid;
+        } else if (id > bank.ranges[mid].last) {
+            low = mid + 1;
+        } else {
+            actions = bank.ranges[mid].actions;
+            break;
+        }
+    }
+
+    _searching.store(0);
+    return actions;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <assert.h>
+#include <thread>
+#include <atomic>
+#include <CANClassifier.h>
+
+void testStandard() {
+    CANClassifier classifier;
+
+    // Everything gets the default until told otherwise
+    assert(classifier.classify(0x123, false) == CAN_ACTION_ALL);
+    assert(classifier.classify(0x123, true) == CAN_ACTION_ALL);
+
+    assert(classifier.setStandard(0, 0x7FF, CAN_ACTION_DROP) == 1);
+    assert(classifier.setStandard(0x7DF, 0x7DF, CAN_ACTION_RESPOND | CAN_ACTION_FORWARD) == 1);
+    assert(classifier.setStandard(0x7E0, 0x7EF, CAN_ACTION_FORWARD) == 1);
+
+    assert(classifier.classify(0x123, false) == CAN_ACTION_DROP);
+    assert(classifier.classify(0x7DF, false) == (CAN_ACTION_RESPOND | CAN_ACTION_FORWARD));
+    assert(classifier.classify(0x7E8, false) == CAN_ACTION_FORWARD);
+    assert(classifier.classify(0x7F0, false) == CAN_ACTION_DROP);
+
+    // Standard entries leave extended ids alone
+    assert(classifier.classify(0x7DF, true) == CAN_ACTION_ALL);
+
+    assert(classifier.setStandard(0x800, 0x800, CAN_ACTION_LOG) == -2);
+    assert(classifier.setStandard(0x10, 0x0F, CAN_ACTION_LOG) == -2);
+}
+
+void testExtended() {
+    CANClassifier classifier;
+
+    // Given out of order, looked up sorted
+    const CANIdRange ranges[] = {
+        { 0x18DAF100, 0x18DAF1FF, CAN_ACTION_FORWARD },
+        { 0x18DB33F1, 0x18DB33F1, CAN_ACTION_RESPOND | CAN_ACTION_FORWARD },
+        { 0x00000000, 0x000000FF, CAN_ACTION_LOG },
+    };
+    assert(classifier.setExtended(ranges, 3, CAN_ACTION_DROP) == 1);
+
+    assert(classifier.classify(0x18DAF110, true) == CAN_ACTION_FORWARD);
+    assert(classifier.classify(0x18DAF1FF, true) == CAN_ACTION_FORWARD);
+    assert(classifier.classify(0x18DAF200, true) == CAN_ACTION_DROP);
+    assert(classifier.classify(0x18DB33F1, true) == (CAN_ACTION_RESPOND | CAN_ACTION_FORWARD));
+    assert(classifier.classify(0x80, true) == CAN_ACTION_LOG);
+    assert(classifier.classify(0x80, false) == CAN_ACTION_ALL);
+
+    // A rejected table leaves the current one in place
+    const CANIdRange overlapping[] = {
+        { 0x100, 0x1FF, CAN_ACTION_LOG },
+        { 0x1FF, 0x2FF, CAN_ACTION_FORWARD },
+    };
+    assert(classifier.setExtended(overlapping, 2, CAN_ACTION_ALL) == -2);
+    const CANIdRange reversed = { 0x200, 0x100, CAN_ACTION_LOG };
+    assert(classifier.setExtended(&reversed, 1, CAN_ACTION_ALL) == -2);
+    CANIdRange too_many[CAN_CLASSIFIER_MAX_RANGES + 1] = {};
+    assert(classifier.setExtended(too_many, CAN_CLASSIFIER_MAX_RANGES + 1, CAN_ACTION_ALL) == -1);
+    assert(classifier.classify(0x18DAF110, true) == CAN_ACTION_FORWARD);
+
+    assert(classifier.setExtended(nullptr, 0, CAN_ACTION_ALL) == 1);
+    assert(classifier.classify(0x18DAF110, true) == CAN_ACTION_ALL);
+}
+
+// The receive path classifies nonstop while the loop swaps between two
+// extended tables. Every lookup must match one table or the other, never a
+// half written one.
+void testSwapUnderLoad(uint32_t swaps) {
+    static CANClassifier classifier;
+    std::atomic<bool> done(false);
+    uint32_t lookups = 0;
+    uint32_t wrong = 0;
+
+    CANIdRange tables[2][CAN_CLASSIFIER_MAX_RANGES];
+    for (uint32_t i = 0; i < CAN_CLASSIFIER_MAX_RANGES; i++) {
+        tables[0][i] = { i * 0x100, i * 0x100 + 0x7F, CAN_ACTION_FORWARD };
+        tables[1][i] = { i * 0x100, i * 0x100 + 0x7F, CAN_ACTION_LOG };
+    }
+    classifier.setExtended(tables[0], CAN_CLASSIFIER_MAX_RANGES, CAN_ACTION_DROP);
+
+    std::thread receiver([&]() {
+        uint32_t id = 0;
+        while (!done.load()) {
+            uint8_t actions = classifier.classify(id, true);
+            bool inside = (id & 0xFF) < 0x80 && id < CAN_CLASSIFIER_MAX_RANGES * 0x100;
+            if (inside ? (actions != CAN_ACTION_FORWARD && actions != CAN_ACTION_LOG) : actions != CAN_ACTION_DROP) {
+                wrong++;
+            }
+            id = (id + 0x31) % (CAN_CLASSIFIER_MAX_RANGES * 0x100 + 0x200);
+            lookups++;
+        }
+    });
+
+    for (uint32_t i = 0; i < swaps; i++) {
+        assert(classifier.setExtended(tables[i % 2], CAN_CLASSIFIER_MAX_RANGES, CAN_ACTION_DROP) == 1);
+    }
+    done.store(true);
+    receiver.join();
+
+    printf("%u swaps: %u lookups ", swaps, lookups);
+    assert(wrong == 0);
+}
+
+int main(int argc, char *argv[]) {
+    printf("Running testStandard()... ");
+    testStandard();
+    printf("Passed\n");
+    printf("Running testExtended()... ");
+    testExtended();
+    printf("Passed\n");
+    printf("Running testSwapUnderLoad()... ");
+    testSwapUnderLoad(1000000);
+    printf("Passed\n");
+}
@@ -0,0 +1,87 @@
+// vim: ts=4:sw=4:et
+
+#ifndef CAN_CORRELATOR_H
+#define CAN_CORRELATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAN_CORRELATOR_MAX_PENDING 16
+
+// ISO 15765-4 / ISO 14229 response times. A request that hasn't been
+// answered in P2 has timed out, unless the ECU said response pending
+// (NRC 0x78), which moves the deadline out to P2*.
+#define CAN_CORRELATOR_P2_US      50000
+#define CAN_CORRELATOR_P2_STAR_US 5000000
+
+#define CAN_CORRELATOR_NO_PID 0xFFFFFFFF
+
+struct CANCorrelatorStats {
+    unsigned long requests;         // Tracked
+    unsigned long untracked;        // Table was full
+    unsigned long answered;         // At least one response before the deadline
+    unsigned long responses;        // Matched, a functional request can get one per ECU
+    unsigned long negative;         // Negative responses other than response pending
+    unsigned long response_pending; // NRC 0x78, deadline extended
+    unsigned long timeouts;         // No response before the deadline
+    unsigned long orphans;          // Responses that matched no pending request
+    size_t max_in_flight;
+    uint32_t latency_min_us;        // Request to first response
+    uint32_t latency_max_us;
+    uint64_t latency_total_us;      // Over answered requests
+};
+
+// Pairs diagnostic requests with their responses without waiting for them.
+// Each request the proxy forwards to the ECUs is entered with a deadline,
+// keyed by its id and service (plus PID, DID or subfunction where the
+// response echoes it). A response is matched to the oldest pending request
+// it answers: 0x7DF and 29-bit 0x18DB requests take one response from every
+// ECU until their deadline, physical ones complete on their response. So
+// several transactions can be in flight and pipelined requests are timed
+// separately. Not thread safe, the forwarding task is the only caller.
+class CANCorrelator {
+public:
+    CANCorrelator();
+
+    // A request forwarded towards the ECUs, sent_at when it was queued
+    void request(uint32_t id, bool is_extended, const uint8_t* data, uint8_t length, int64_t sent_at);
+
+    // A response forwarded back to the scanner, received_at its receive timestamp
+    void response(uint32_t id, bool is_extended, const uint8_t* data, uint8_t length, int64_t received_at);
+
+    // Retires requests past their deadline. Cheap enough for every pass.
+    void expire(int64_t now);
+
+    size_t inFlight() const { return _in_flight; }
+    const CANCorrelatorStats& getStats() const { return _stats; }
+
+    // Service and the id its response echoes, false if the frame isn't the
+    // start of a diagnostic message. Responses give the service requested.
+    static bool parse(const uint8_t* data, uint8_t length, bool is_response,
+                      uint8_t& service, uint32_t& pid, uint8_t& nrc);
+
+    // Whether response_id can answer a request sent to request_id
+    static bool answers(uint32_t request_id, uint32_t response_id, bool is_extended);
+
+private:
+    struct Pending {
+        bool used;
+        bool functional;
+        bool is_extended;
+        uint8_t service;
+        uint32_t id;
+        uint32_t pid;
+        int64_t sent_at;
+        int64_t deadline;
+        unsigned long responses;
+        uint32_t answered_by[8]; // Bit per responder, 0x7E8-0x7EF or the 0x18DA source byte
+    };
+
+    void _retire(Pending& pending);
+
+    Pending _pending[CAN_CORRELATOR_MAX_PENDING];
+    size_t _in_flight;
+    CANCorrelatorStats _stats;
+};
+
+#endif // CAN_CORRELATOR_H
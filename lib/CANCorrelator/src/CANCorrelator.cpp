@@ -0,0 +1,273 @@
+// vim: ts=4:sw=4:et
+
+#include <CANCorrelator.h>
+#include <string.h>
+
+#define CAN_CORRELATOR_NEGATIVE_RESPONSE 0x7F
+#define CAN_CORRELATOR_POSITIVE_OFFSET   0x40
+#define CAN_CORRELATOR_RESPONSE_PENDING  0x78
+
+// Bit 7 of a UDS subfunction asks the ECU not to send a positive response
+#define CAN_CORRELATOR_SUPPRESS_POSITIVE 0x80
+
+CANCorrelator::CANCorrelator() : _in_flight(0) {
+    memset(_pending, 0, sizeof(_pending));
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+// UDS services whose first parameter is a subfunction the response echoes
+static bool hasSubfunction(uint8_t service) {
+    switch (service) {
+        case 0x10: case 0x11: case 0x19: case 0x27: case 0x28: case 0x3E: case 0x85:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isRequestId(uint32_t id, bool is_extended) {
+    if (is_extended) {
+        uint32_t format = id >> 16;
+        return format == 0x18DA || format == 0x18DB;
+    }
+    return id == 0x7DF || (id >= 0x7E0 && id <= 0x7E7);
+}
+
+static bool isResponseId(uint32_t id, bool is_extended) {
+    if (is_extended) {
+        return (id >> 16) == 0x18DA;
+    }
+    return id >= 0x7E8 && id <= 0x7EF;
+}
+
+// 0-7 for 0x7E8-0x7EF, the source address for 0x18DA<target><source>
+static uint8_t responderIndex(uint32_t id, bool is_extended) {
+    return is_extended ? (id & 0xFF) : (uint8_t)(id - 0x7E8);
+}
+
+static bool isFunctional(uint32_t id, bool is_extended) {
+    return is_extended ? (id >> 16) == 0x18DB : id == 0x7DF;
+}
+
+bool CANCorrelator::parse(const uint8_t* data, uint8_t length, bool is_response,
+                          uint8_t& service, uint32_t& pid, uint8_t& nrc) {
+    if (length < 2) {
+        return false;
+    }
+
+    // Only single frames and first frames carry the service
+    const uint8_t* payload;
+    size_t payload_length;
+    uint8_t type = data[0] >> 4;
+    if (type == 0x0) {
+        payload_length = data[0] & 0x0F;
+        if (payload_length == 0 || payload_length > (size_t)length - 1) {
+            return false;
+        }
+        payload = data + 1;
+    } else if (type == 0x1) {
+        // Escaped first frames put the service at data[6]
+        if (length < 3 || ((data[0] & 0x0F) == 0 && data[1] == 0)) {
+            return false;
+        }
+        payload = data + 2;
+        payload_length = length - 2;
+    } else {
+        return false;
+    }
+
+    nrc = 0;
+    pid = CAN_CORRELATOR_NO_PID;
+    uint8_t sid = payload[0];
+    if (is_response) {
+        if (sid == CAN_CORRELATOR_NEGATIVE_RESPONSE) {
+            // 0x7F, service, NRC. The PID isn't echoed.
+            if (payload_length < 3) {
+                return false;
+            }
+            service = payload[1];
+            nrc = payload[2];
+            return true;
+        }
+        if (sid < CAN_CORRELATOR_POSITIVE_OFFSET) {
+            return false;
+        }
+        sid -= CAN_CORRELATOR_POSITIVE_OFFSET;
+    }
+    service = sid;
+
+    const uint8_t* body = payload + 1;
+    size_t body_length = payload_length - 1;
+    switch (service) {
+        // OBD-II modes with a PID, the first one when several are asked for
+        case 0x01: case 0x02: case 0x05: case 0x06: case 0x08: case 0x09:
+            if (body_length >= 1) {
+                pid = body[0];
+            }
+            break;
+        // Data identifiers
+        case 0x22: case 0x2E: case 0x2F:
+            if (body_length >= 2) {
+                pid = ((uint32_t)body[0] << 8) | body[1];
+            }
+            break;
+        // Routine control, subfunction and routine id
+        case 0x31:
+            if (body_length >= 3) {
+                pid = ((uint32_t)(body[0] & 0x7F) << 16) | ((uint32_t)body[1] << 8) | body[2];
+            }
+            break;
+        default:
+            if (hasSubfunction(service) && body_length >= 1) {
+                pid = body[0] & 0x7F;
+            }
+            break;
+    }
+    return true;
+}
+
+bool CANCorrelator::answers(uint32_t request_id, uint32_t response_id, bool is_extended) {
+    if (!is_extended) {
+        if (request_id == 0x7DF) {
+            return response_id >= 0x7E8 && response_id <= 0x7EF;
+        }
+        return request_id >= 0x7E0 && request_id <= 0x7E7 && response_id == request_id + 8;
+    }
+
+    // 0x18DB<target><source> goes to every ECU, each answers to the source
+    if ((request_id >> 16) == 0x18DB) {
+        return (response_id >> 16) == 0x18DA && ((response_id >> 8) & 0xFF) == (request_id & 0xFF);
+    }
+    // Physical requests are answered with target and source swapped
+    return response_id == ((request_id & 0xFFFF0000) | ((request_id & 0xFF) << 8) | ((request_id >> 8) & 0xFF));
+}
+
+void CANCorrelator::request(uint32_t id, bool is_extended, const uint8_t* data, uint8_t length, int64_t sent_at) {
+    uint8_t service, nrc;
+    uint32_t pid;
+    if (!isRequestId(id, is_extended) || !parse(data, length, false, service, pid, nrc)) {
+        return;
+    }
+
+    // Nothing comes back for a suppressed positive response, unless it fails
+    bool first_frame = (data[0] >> 4) == 0x1;
+    uint8_t subfunction = first_frame ? 3 : 2;
+    bool has_subfunction = first_frame ? length > subfunction : (data[0] & 0x0F) >= 2;
+    if (hasSubfunction(service) && has_subfunction && (data[subfunction] & CAN_CORRELATOR_SUPPRESS_POSITIVE)) {
+        return;
+    }
+
+    Pending* pending = nullptr;
+    for (size_t i = 0; i < CAN_CORRELATOR_MAX_PENDING; i++) {
+        if (!_pending[i].used) {
+            pending = &_pending[i];
+            break;
+        }
+    }
+    if (!pending) {
+        _stats.untracked++;
+        return;
+    }
+
+    pending->used = true;
+    pending->functional = isFunctional(id, is_extended);
+    pending->is_extended = is_extended;
+    pending->service = service;
+    pending->id = id;
+    pending->pid = pid;
+    pending->sent_at = sent_at;
+    pending->deadline = sent_at + CAN_CORRELATOR_P2_US;
+    pending->responses = 0;
+    memset(pending->answered_by, 0, sizeof(pending->answered_by));
+
+    _stats.requests++;
+    _in_flight++;
+    if (_in_flight > _stats.max_in_flight) {
+        _stats.max_in_flight = _in_flight;
+    }
+}
+
+void CANCorrelator::response(uint32_t id, bool is_extended, const uint8_t* data, uint8_t length, int64_t received_at) {
+    uint8_t service, nrc;
+    uint32_t pid;
+    if (!isResponseId(id, is_extended) || !parse(data, length, true, service, pid, nrc)) {
+        return;
+    }
+
+    // Pipelined requests for the same thing are answered in order. An ECU answers
+    // a functional request once, its next response is for the next request.
+    uint8_t responder = responderIndex(id, is_extended);
+    uint32_t responder_bit = 1UL << (responder & 31);
+    Pending* match = nullptr;
+    for (size_t i = 0; i < CAN_CORRELATOR_MAX_PENDING; i++) {
+        Pending& pending = _pending[i];
+        if (!pending.used || pending.is_extended != is_extended || pending.service != service ||
+                !answers(pending.id, id, is_extended)) {
+            continue;
+        }
+        if (pid != CAN_CORRELATOR_NO_PID && pending.pid != CAN_CORRELATOR_NO_PID && pid != pending.pid) {
+            continue;
+        }
+        if (pending.answered_by[responder >> 5] & responder_bit) {
+            continue;
+        }
+        if (!match || pending.sent_at < match->sent_at) {
+            match = &pending;
+        }
+    }
+
+    if (!match) {
+        _stats.orphans++;
+        return;
+    }
+
+    if (nrc == CAN_CORRELATOR_RESPONSE_PENDING) {
+        _stats.response_pending++;
+        match->deadline = received_at + CAN_CORRELATOR_P2_STAR_US;
+        return;
+    }
+
+    _stats.responses++;
+    match->answered_by[responder >> 5] |= responder_bit;
+    if (nrc) {
+        _stats.negative++;
+    }
+
+    if (match->responses++ == 0) {
+        uint32_t latency = received_at > match->sent_at ? (uint32_t)(received_at - match->sent_at) : 0;
+        if (_stats.answered == 0 || latency < _stats.latency_min_us) {
+            _stats.latency_min_us = latency;
+        }
+        if (latency > _stats.latency_max_us) {
+            _stats.latency_max_us = latency;
+        }
+        _stats.latency_total_us += latency;
+        _stats.answered++;
+    }
+
+    // Functional requests stay open for the other ECUs until their deadline
+    if (!match->functional) {
+        _retire(*match);
+    }
+}
+
+void CANCorrelator::expire(int64_t now) {
+    if (_in_flight == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < CAN_CORRELATOR_MAX_PENDING; i++) {
+        Pending& pending = _pending[i];
+        if (pending.used && now >= pending.deadline) {
+            if (pending.responses == 0) {
+                _stats.timeouts++;
+            }
+            _retire(pending);
+        }
+    }
+}
+
+void CANCorrelator::_retire(Pending& pending) {
+    pending.used = false;
+    _in_flight--;
+}
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <CANCorrelator.h>
+
+void testParse() {
+    uint8_t service, nrc;
+    uint32_t pid;
+
+    const uint8_t rpm[8] = { 0x02, 0x01, 0x0C, 0x55, 0x55, 0x55, 0x55, 0x55 };
+    assert(CANCorrelator::parse(rpm, 8, false, service, pid, nrc));
+    assert(service == 0x01 && pid == 0x0C && nrc == 0);
+
+    const uint8_t rpm_response[8] = { 0x04, 0x41, 0x0C, 0x1A, 0xF8 };
+    assert(CANCorrelator::parse(rpm_response, 8, true, service, pid, nrc));
+    assert(service == 0x01 && pid == 0x0C);
+
+    // The service of a multi-frame response is in its first frame
+    const uint8_t vin[8] = { 0x10, 0x14, 0x49, 0x02, 0x01, 0x31, 0x47, 0x31 };
+    assert(CANCorrelator::parse(vin, 8, true, service, pid, nrc));
+    assert(service == 0x09 && pid == 0x02);
+    const uint8_t consecutive[8] = { 0x21, 0x4A };
+    assert(!CANCorrelator::parse(consecutive, 8, true, service, pid, nrc));
+
+    const uint8_t did[8] = { 0x03, 0x22, 0xF1, 0x90 };
+    assert(CANCorrelator::parse(did, 8, false, service, pid, nrc));
+    assert(service == 0x22 && pid == 0xF190);
+
+    const uint8_t session[8] = { 0x02, 0x10, 0x83 };
+    assert(CANCorrelator::parse(session, 8, false, service, pid, nrc));
+    assert(service == 0x10 && pid == 0x03);
+
+    const uint8_t negative[8] = { 0x03, 0x7F, 0x22, 0x31 };
+    assert(CANCorrelator::parse(negative, 8, true, service, pid, nrc));
+    assert(service == 0x22 && pid == CAN_CORRELATOR_NO_PID && nrc == 0x31);
+
+    const uint8_t dtcs[8] = { 0x01, 0x03 };
+    assert(CANCorrelator::parse(dtcs, 8, false, service, pid, nrc));
+    assert(service == 0x03 && pid == CAN_CORRELATOR_NO_PID);
+
+    // A request isn't a response
+    assert(!CANCorrelator::parse(rpm, 8, true, service, pid, nrc));
+    const uint8_t empty[8] = { 0x00 };
+    assert(!CANCorrelator::parse(empty, 8, false, service, pid, nrc));
+}
+
+void testAnswers() {
+    assert(CANCorrelator::answers(0x7DF, 0x7E8, false));
+    assert(CANCorrelator::answers(0x7DF, 0x7EF, false));
+    assert(CANCorrelator::answers(0x7E0, 0x7E8, false));
+    assert(!CANCorrelator::answers(0x7E0, 0x7E9, false));
+    assert(CANCorrelator::answers(0x18DB33F1, 0x18DAF110, true));
+    assert(!CANCorrelator::answers(0x18DB33F1, 0x18DAF210, true));
+    assert(CANCorrelator::answers(0x18DA10F1, 0x18DAF110, true));
+    assert(!CANCorrelator::answers(0x18DA10F1, 0x18DAF111, true));
+}
+
+// A functional request answered by three ECUs, and one that is too late
+void testFunctional() {
+    CANCorrelator correlator;
+    const uint8_t request[8] = { 0x02, 0x01, 0x00 };
+    const uint8_t response[8] = { 0x06, 0x41, 0x00, 0xBE, 0x3F, 0xA8, 0x13 };
+
+    correlator.request(0x7DF, false, request, 8, 1000);
+    assert(correlator.inFlight() == 1);
+
+    correlator.response(0x7E8, false, response, 8, 3000);
+    correlator.response(0x7E9, false, response, 8, 5000);
+    correlator.response(0x7EA, false, response, 8, 40000);
+    assert(correlator.inFlight() == 1);
+
+    correlator.expire(1000 + CAN_CORRELATOR_P2_US);
+    assert(correlator.inFlight() == 0);
+    correlator.response(0x7EB, false, response, 8, 60000);
+
+    const CANCorrelatorStats& stats = correlator.getStats();
+    assert(stats.requests == 1);
+    assert(stats.answered == 1);
+    assert(stats.responses == 3);
+    assert(stats.timeouts == 0);
+    assert(stats.orphans == 1);
+    assert(stats.latency_min_us == 2000);
+    assert(stats.latency_max_us == 2000);
+}
+
+// Several requests in flight at once, answered out of order
+void testPipelined() {
+    CANCorrelator correlator;
+    const uint8_t rpm[8] = { 0x02, 0x01, 0x0C };
+    const uint8_t speed[8] = { 0x02, 0x01, 0x0D };
+    const uint8_t vin[8] = { 0x02, 0x09, 0x02 };
+    const uint8_t rpm_response[8] = { 0x04, 0x41, 0x0C, 0x1A, 0xF8 };
+    const uint8_t speed_response[8] = { 0x03, 0x41, 0x0D, 0x32 };
+    const uint8_t vin_response[8] = { 0x10, 0x14, 0x49, 0x02, 0x01, 0x31, 0x47, 0x31 };
+
+    correlator.request(0x7E0, false, rpm, 8, 0);
+    correlator.request(0x7E0, false, speed, 8, 100);
+    correlator.request(0x7E0, false, rpm, 8, 200);
+    correlator.request(0x7E1, false, vin, 8, 300);
+    assert(correlator.inFlight() == 4);
+
+    // Physical requests complete on their response, the oldest match first
+    correlator.response(0x7E9, false, vin_response, 8, 1300);
+    correlator.response(0x7E8, false, speed_response, 8, 2100);
+    correlator.response(0x7E8, false, rpm_response, 8, 3000);
+    assert(correlator.inFlight() == 1);
+
+    const CANCorrelatorStats& stats = correlator.getStats();
+    assert(stats.answered == 3);
+    assert(stats.latency_min_us == 1000);
+    assert(stats.latency_max_us == 3000);
+
+    // The second rpm request never gets its answer
+    correlator.expire(200 + CAN_CORRELATOR_P2_US - 1);
+    assert(correlator.inFlight() == 1);
+    correlator.expire(200 + CAN_CORRELATOR_P2_US);
+    assert(stats.timeouts == 1);
+    assert(stats.max_in_flight == 4);
+
+    // Responses from the wrong ECU, or for something else, match nothing
+    correlator.request(0x7E0, false, rpm, 8, 100000);
+    correlator.response(0x7E9, false, rpm_response, 8, 101000);
+    correlator.response(0x7E8, false, speed_response, 8, 101000);
+    assert(stats.orphans == 2);
+    assert(correlator.inFlight() == 1);
+}
+
+// Back to back functional requests, each ECU answers both in order
+void testPipelinedFunctional() {
+    CANCorrelator correlator;
+    const uint8_t rpm[8] = { 0x02, 0x01, 0x0C };
+    const uint8_t rpm_response[8] = { 0x04, 0x41, 0x0C, 0x1A, 0xF8 };
+
+    correlator.request(0x7DF, false, rpm, 8, 0);
+    correlator.request(0x7DF, false, rpm, 8, 1000);
+    correlator.response(0x7E8, false, rpm_response, 8, 2000);
+    correlator.response(0x7E9, false, rpm_response, 8, 2500);
+    correlator.response(0x7E8, false, rpm_response, 8, 3000);
+    correlator.response(0x7E9, false, rpm_response, 8, 3500);
+
+    // A third answer from the same ECU has nothing left to answer
+    correlator.response(0x7E8, false, rpm_response, 8, 4000);
+
+    correlator.expire(1000 + CAN_CORRELATOR_P2_US);
+    const CANCorrelatorStats& stats = correlator.getStats();
+    assert(correlator.inFlight() == 0);
+    assert(stats.answered == 2);
+    assert(stats.responses == 4);
+    assert(stats.timeouts == 0);
+    assert(stats.orphans == 1);
+    assert(stats.latency_min_us == 2000);
+    assert(stats.latency_max_us == 2000);
+
+    // 29-bit responders are told apart by their source address
+    const uint8_t rpm_extended[8] = { 0x02, 0x01, 0x0C };
+    correlator.request(0x18DB33F1, true, rpm_extended, 8, 100000);
+    correlator.request(0x18DB33F1, true, rpm_extended, 8, 101000);
+    correlator.response(0x18DAF110, true, rpm_response, 8, 102000);
+    correlator.response(0x18DAF118, true, rpm_response, 8, 102000);
+    correlator.response(0x18DAF110, true, rpm_response, 8, 103000);
+    correlator.expire(101000 + CAN_CORRELATOR_P2_US);
+    assert(stats.answered == 4);
+    assert(stats.responses == 7);
+    assert(stats.timeouts == 0);
+}
+
+void testResponsePending() {
+    CANCorrelator correlator;
+    const uint8_t routine[8] = { 0x04, 0x31, 0x01, 0xFF, 0x00 };
+    const uint8_t pending[8] = { 0x03, 0x7F, 0x31, 0x78 };
+    const uint8_t done[8] = { 0x05, 0x71, 0x01, 0xFF, 0x00, 0x00 };
+    const uint8_t refused[8] = { 0x03, 0x7F, 0x31, 0x22 };
+
+    correlator.request(0x18DA10F1, true, routine, 8, 0);
+    correlator.response(0x18DAF110, true, pending, 8, 20000);
+
+    // The deadline moved out to P2*
+    correlator.expire(CAN_CORRELATOR_P2_US * 2);
+    assert(correlator.inFlight() == 1);
+    correlator.response(0x18DAF110, true, done, 8, 1000000);
+    assert(correlator.inFlight() == 0);
+
+    const CANCorrelatorStats& stats = correlator.getStats();
+    assert(stats.response_pending == 1);
+    assert(stats.answered == 1);
+    assert(stats.timeouts == 0);
+
+    // A negative response answers the request too
+    correlator.request(0x18DA10F1, true, routine, 8, 2000000);
+    correlator.response(0x18DAF110, true, refused, 8, 2001000);
+    assert(stats.negative == 1);
+    assert(stats.answered == 2);
+    assert(correlator.inFlight() == 0);
+}
+
+void testUntracked() {
+    CANCorrelator correlator;
+    const uint8_t request[8] = { 0x02, 0x01, 0x0C };
+    const uint8_t tester_present[8] = { 0x02, 0x3E, 0x80 };
+    const uint8_t other[8] = { 0x02, 0x01, 0x0C };
+
+    // Suppressed positive responses and ordinary traffic aren't tracked
+    correlator.request(0x7E0, false, tester_present, 8, 0);
+    correlator.request(0x123, false, other, 8, 0);
+    assert(correlator.inFlight() == 0);
+
+    for (int i = 0; i < CAN_CORRELATOR_MAX_PENDING + 2; i++) {
+        correlator.request(0x7E0, false, request, 8, i);
+    }
+    const CANCorrelatorStats& stats = correlator.getStats();
+    assert(correlator.inFlight() == CAN_CORRELATOR_MAX_PENDING);
+    assert(stats.requests == CAN_CORRELATOR_MAX_PENDING);
+    assert(stats.untracked == 2);
+
+    correlator.expire(CAN_CORRELATOR_P2_STAR_US);
+    assert(correlator.inFlight() == 0);
+    assert(stats.timeouts == CAN_CORRELATOR_MAX_PENDING);
+}
+
+int main(int argc, char *argv[]) {
+    printf("Running testParse()... ");
+    testParse();
+    printf("Passed\n");
+    printf("Running testAnswers()... ");
+    testAnswers();
+    printf("Passed\n");
+    printf("Running testFunctional()... ");
+    testFunctional();
+    printf("Passed\n");
+    printf("Running testPipelined()... ");
+    testPipelined();
+    printf("Passed\n");
+    printf("Running testPipelinedFunctional()... ");
+    testPipelinedFunctional();
+    printf("Passed\n");
+    printf("Running testResponsePending()... ");
+    testResponsePending();
+    printf("Passed\n");
+    printf("Running testUntracked()... ");
+    testUntracked();
+    printf("Passed\n");
+}
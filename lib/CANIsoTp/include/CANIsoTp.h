@@ -0,0 +1,110 @@
+// vim: ts=4:sw=4:et
+
+#ifndef CAN_ISOTP_H
+#define CAN_ISOTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Protocol control information, the high nibble of the first data byte
+#define CAN_ISOTP_SINGLE        0x0
+#define CAN_ISOTP_FIRST         0x1
+#define CAN_ISOTP_CONSECUTIVE   0x2
+#define CAN_ISOTP_FLOW_CONTROL  0x3
+#define CAN_ISOTP_NONE          0xFF // Not a diagnostic id, or not a valid PCI
+
+// Flow status, the low nibble of a flow control frame
+#define CAN_ISOTP_CONTINUE 0x0
+#define CAN_ISOTP_WAIT     0x1
+#define CAN_ISOTP_OVERFLOW 0x2
+
+#define CAN_ISOTP_MAX_SESSIONS 8
+
+// Session states
+#define CAN_ISOTP_IDLE              0 // Last transfer finished or aborted
+#define CAN_ISOTP_WAIT_FLOW_CONTROL 1 // First frame or a full block sent, receiver's turn
+#define CAN_ISOTP_SENDING           2 // Consecutive frames allowed
+
+// One multi-frame transfer direction, keyed by the id its data frames use.
+// Counters and timings accumulate over every transfer on that id.
+struct CANIsoTpSession {
+    uint32_t id;
+    bool is_extended;
+    uint8_t direction;          // Direction the data frames travel
+    uint8_t state;
+    uint8_t next_sequence;
+    uint8_t block_size;         // From the last flow control, 0 = unlimited
+    uint8_t block_remaining;
+    bool awaiting_first_flow_control;
+    uint32_t st_min_us;         // From the last flow control
+    uint32_t length;            // Payload bytes announced by the first frame
+    uint32_t received;          // Payload bytes forwarded so far
+    int64_t first_frame_at;     // Receive timestamps, us
+    int64_t last_activity_at;
+    int64_t last_consecutive_sent_at; // Queued on the other bus, not on the wire
+
+    unsigned long transfers;        // Completed
+    unsigned long aborted;          // Restarted, overflowed or out of sequence
+    unsigned long sequence_errors;
+    unsigned long block_overruns;   // Consecutive frames sent without waiting for flow control
+    uint32_t last_duration_us;      // First frame to last consecutive frame
+    uint32_t max_duration_us;
+    uint64_t total_duration_us;
+    uint32_t last_flow_control_us;  // First frame to the receiver's first flow control
+    uint32_t max_flow_control_us;
+    uint32_t max_proxy_delay_us;    // Longest a frame of this transfer waited in the proxy
+};
+
+// Follows ISO 15765-2 transfers through the proxy without reassembling them.
+// Each frame is still forwarded as it arrives. The tracker pairs a flow
+// control with the transfer it answers, so consecutive frames can be held
+// back when the proxy would otherwise send them closer together than the
+// receiver's STmin. Only diagnostic ids are tracked (0x7DF, 0x7E0-0x7EF and
+// 29-bit 0x18DA/0x18DB), other traffic can look like ISO-TP by accident.
+// Not thread safe, the forwarding task is the only caller.
+class CANIsoTpTracker {
+public:
+    CANIsoTpTracker();
+
+    // PCI type of a frame, CAN_ISOTP_NONE if it isn't tracked
+    static uint8_t frameType(uint32_t id, bool is_extended, const uint8_t* data, uint8_t length);
+
+    // Earliest time this frame may be sent on, 0 if it can go now. STmin is
+    // counted from when the previous consecutive frame was queued, so it is a
+    // lower bound: a frame that waited in the transmit queue or lost
+    // arbitration went out later, and on a busy bus the next one may follow
+    // it closer than STmin on the wire.
+    int64_t releaseAt(uint8_t direction, uint32_t id, bool is_extended, const uint8_t* data, uint8_t length) const;
+
+    // Called once the frame is queued on the other bus. received_at is the
+    // frame's receive timestamp, sent_at when it was queued.
+    void forwarded(uint8_t direction, uint32_t id, bool is_extended, const uint8_t* data, uint8_t length,
+                   int64_t received_at, int64_t sent_at);
+
+    size_t size() const { return _count; }
+    const CANIsoTpSession& session(size_t index) const { return _sessions[index]; }
+
+    unsigned long unmatchedFlowControls() const { return _unmatched_flow_controls; }
+    unsigned long evictions() const { return _evictions; }
+
+    // ms 0x00-0x7F, 100-900 us 0xF1-0xF9, reserved values are 127 ms
+    static uint32_t stMinMicros(uint8_t st_min);
+
+    // Id the other side answers with, ANY_ID if the addressing is unknown
+    static uint32_t partnerId(uint32_t id, bool is_extended);
+    static const uint32_t ANY_ID = 0xFFFFFFFF;
+
+private:
+    CANIsoTpSession* _find(uint8_t direction, uint32_t id, bool is_extended);
+    const CANIsoTpSession* _find(uint8_t direction, uint32_t id, bool is_extended) const;
+    CANIsoTpSession* _claim(uint8_t direction, uint32_t id, bool is_extended);
+    CANIsoTpSession* _findFlowControlTarget(uint8_t direction, uint32_t id, bool is_extended);
+    void _complete(CANIsoTpSession& session, int64_t at);
+
+    CANIsoTpSession _sessions[CAN_ISOTP_MAX_SESSIONS];
+    size_t _count;
+    unsigned long _unmatched_flow_controls;
+    unsigned long _evictions;
+};
+
+#endif // CAN_ISOTP_H
@@ -0,0 +1,277 @@
+// vim: ts=4:sw=4:et
+
+#include <CANIsoTp.h>
+#include <string.h>
+
+// Bytes of payload a first frame and a consecutive frame carry on classic CAN
+#define CAN_ISOTP_FIRST_PAYLOAD 6
+#define CAN_ISOTP_ESCAPED_FIRST_PAYLOAD 2
+#define CAN_ISOTP_CONSECUTIVE_PAYLOAD 7
+
+CANIsoTpTracker::CANIsoTpTracker() : _count(0), _unmatched_flow_controls(0), _evictions(0) {
+    memset(_sessions, 0, sizeof(_sessions));
+}
+
+static bool isDiagnostic(uint32_t id, bool is_extended) {
+    if (is_extended) {
+        uint32_t format = id >> 16;
+        return format == 0x18DA || format == 0x18DB;
+    }
+    return id == 0x7DF || (id >= 0x7E0 && id <= 0x7EF);
+}
+
+uint8_t CANIsoTpTracker::frameType(uint32_t id, bool is_extended, const uint8_t* data, uint8_t length) {
+    if (length < 1 || !isDiagnostic(id, is_extended)) {
+        return CAN_ISOTP_NONE;
+    }
+    uint8_t type = data[0] >> 4;
+    return type <= CAN_ISOTP_FLOW_CONTROL ? type : CAN_ISOTP_NONE;
+}
+
+uint32_t CANIsoTpTracker::stMinMicros(uint8_t st_min) {
+    if (st_min <= 0x7F) {
+        return st_min * 1000UL;
+    }
+    if (st_min >= 0xF1 && st_min <= 0xF9) {
+        return (st_min - 0xF0) * 100UL;
+    }
+    return 127000UL;
+}
+
+uint32_t CANIsoTpTracker::partnerId(uint32_t id, bool is_extended) {
+    if (is_extended) {
+        // Normal fixed addressing, target and source address swap
+        if ((id >> 16) == 0x18DA) {
+            return (id & 0xFFFF0000) | ((id & 0xFF) << 8) | ((id >> 8) & 0xFF);
+        }
+        return ANY_ID;
+    }
+    if (id >= 0x7E0 && id <= 0x7E7) {
+        return id + 8;
+    }
+    if (id >= 0x7E8 && id <= 0x7EF) {
+        return id - 8;
+    }
+    return ANY_ID;
+}
+
+const CANIsoTpSession* CANIsoTpTracker::_find(uint8_t direction, uint32_t id, bool is_extended) const {
+    for (size_t i = 0; i < _count; i++) {
+        const CANIsoTpSession& session = _sessions[i];
+        if (session.id == id && session.is_extended == is_extended && session.direction == direction) {
+            return &session;
+        }
+    }
+    return nullptr;
+}
+
+CANIsoTpSession* CANIsoTpTracker::_find(uint8_t direction, uint32_t id, bool is_extended) {
+    return const_cast<CANIsoTpSession*>(static_cast<const CANIsoTpTracker*>(this)->_find(direction, id, is_extended));
+}
+
+// A full table reuses the slot that has been quiet longest, idle ones first
+CANIsoTpSession* CANIsoTpTracker::_claim(uint8_t direction, uint32_t id, bool is_extended) {
+    CANIsoTpSession* session = _find(direction, id, is_extended);
+    if (session) {
+        return session;
+    }
+
+    if (_count < CAN_ISOTP_MAX_SESSIONS) {
+        session = &_sessions[_count++];
+    } else {
+        for (size_t i = 0; i < _count; i++) {
+            CANIsoTpSession& candidate = _sessions[i];
+            if (!session ||
+                    (candidate.state == CAN_ISOTP_IDLE && session->state != CAN_ISOTP_IDLE) ||
+                    ((candidate.state == CAN_ISOTP_IDLE) == (session->state == CAN_ISOTP_IDLE) &&
+                     candidate.last_activity_at < session->last_activity_at)) {
+                session = &candidate;
+            }
+        }
+        _evictions++;
+    }
+
+    memset(session, 0, sizeof(*session));
+    session->id = id;
+    session->is_extended = is_extended;
+    session->direction = direction;
+    return session;
+}
+
+// A flow control travels against the transfer it controls, from the
+// partner of the transfer's id
+CANIsoTpSession* CANIsoTpTracker::_findFlowControlTarget(uint8_t direction, uint32_t id, bool is_extended) {
+    uint8_t data_direction = 1 - direction;
+    CANIsoTpSession* unaddressed = nullptr;
+    size_t unaddressed_count = 0;
+
+    for (size_t i = 0; i < _count; i++) {
+        CANIsoTpSession& session = _sessions[i];
+        if (session.direction != data_direction || session.is_extended != is_extended ||
+                session.state == CAN_ISOTP_IDLE) {
+            continue;
+        }
+        uint32_t partner = partnerId(session.id, is_extended);
+        if (partner == id) {
+            return &session;
+        }
+        if (partner == ANY_ID) {
+            unaddressed = &session;
+            unaddressed_count++;
+        }
+    }
+
+    // Unknown addressing is only safe to pair when there is one candidate
+    return unaddressed_count == 1 ? unaddressed : nullptr;
+}
+
+int64_t CANIsoTpTracker::releaseAt(uint8_t direction, uint32_t id, bool is_extended,
+                                   const uint8_t* data, uint8_t length) const {
+    if (frameType(id, is_extended, data, length) != CAN_ISOTP_CONSECUTIVE) {
+        return 0;
+    }
+
+    const CANIsoTpSession* session = _find(direction, id, is_extended);
+    if (!session || session->state != CAN_ISOTP_SENDING || session->last_consecutive_sent_at == 0) {
+        return 0;
+    }
+    return session->last_consecutive_sent_at + session->st_min_us;
+}
+
+void CANIsoTpTracker::_complete(CANIsoTpSession& session, int64_t at) {
+    uint32_t duration = (uint32_t)(at - session.first_frame_at);
+    session.last_duration_us = duration;
+    if (duration > session.max_duration_us) {
+        session.max_duration_us = duration;
+    }
+    session.total_duration_us += duration;
+    session.transfers++;
+    session.state = CAN_ISOTP_IDLE;
+}
+
+void CANIsoTpTracker::forwarded(uint8_t direction, uint32_t id, bool is_extended, const uint8_t* data,
+                                uint8_t length, int64_t received_at, int64_t sent_at) {
+    uint8_t type = frameType(id, is_extended, data, length);
+    if (type == CAN_ISOTP_NONE) {
+        return;
+    }
+    uint32_t proxy_delay = sent_at > received_at ? (uint32_t)(sent_at - received_at) : 0;
+
+    if (type == CAN_ISOTP_FLOW_CONTROL) {
+        CANIsoTpSession* session = _findFlowControlTarget(direction, id, is_extended);
+        if (!session) {
+            _unmatched_flow_controls++;
+            return;
+        }
+
+        session->last_activity_at = received_at;
+        if (session->awaiting_first_flow_control) {
+            session->awaiting_first_flow_control = false;
+            session->last_flow_control_us = (uint32_t)(received_at - session->first_frame_at);
+            if (session->last_flow_control_us > session->max_flow_control_us) {
+                session->max_flow_control_us = session->last_flow_control_us;
+            }
+        }
+
+        switch (data[0] & 0x0F) {
+            case CAN_ISOTP_CONTINUE:
+                session->block_size = length > 1 ? data[1] : 0;
+                session->st_min_us = stMinMicros(length > 2 ? data[2] : 0);
+                session->block_remaining = session->block_size;
+                session->last_consecutive_sent_at = 0; // The first frame of a block can go at once
+                session->state = CAN_ISOTP_SENDING;
+                break;
+            case CAN_ISOTP_WAIT:
+                session->state = CAN_ISOTP_WAIT_FLOW_CONTROL;
+                break;
+            default:
+                session->aborted++;
+                session->state = CAN_ISOTP_IDLE;
+                break;
+        }
+        return;
+    }
+
+    if (type == CAN_ISOTP_SINGLE) {
+        // A new message on the same id abandons a transfer in progress
+        CANIsoTpSession* session = _find(direction, id, is_extended);
+        if (session && session->state != CAN_ISOTP_IDLE) {
+            session->aborted++;
+            session->state = CAN_ISOTP_IDLE;
+        }
+        return;
+    }
+
+    if (type == CAN_ISOTP_FIRST) {
+        if (length < 2) {
+            return;
+        }
+        uint32_t message_length = ((uint32_t)(data[0] & 0x0F) << 8) | data[1];
+        uint8_t payload = CAN_ISOTP_FIRST_PAYLOAD;
+        if (message_length == 0) {
+            // Escaped first frame, 32-bit length for messages over 4095 bytes
+            if (length < 6) {
+                return;
+            }
+            message_length = ((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) |
+                             ((uint32_t)data[4] << 8) | data[5];
+            payload = CAN_ISOTP_ESCAPED_FIRST_PAYLOAD;
+        }
+
+        CANIsoTpSession* session = _claim(direction, id, is_extended);
+        if (session->state != CAN_ISOTP_IDLE) {
+            session->aborted++;
+        }
+        session->state = CAN_ISOTP_WAIT_FLOW_CONTROL;
+        session->awaiting_first_flow_control = true;
+        session->length = message_length;
+        session->received = payload < message_length ? payload : message_length;
+        session->next_sequence = 1;
+        session->block_size = 0;
+        session->block_remaining = 0;
+        session->st_min_us = 0;
+        session->first_frame_at = received_at;
+        session->last_activity_at = received_at;
+        session->last_consecutive_sent_at = 0;
+        if (proxy_delay > session->max_proxy_delay_us) {
+            session->max_proxy_delay_us = proxy_delay;
+        }
+        return;
+    }
+
+    // Consecutive frame
+    CANIsoTpSession* session = _find(direction, id, is_extended);
+    if (!session || session->state == CAN_ISOTP_IDLE) {
+        return;
+    }
+    if (session->state == CAN_ISOTP_WAIT_FLOW_CONTROL) {
+        session->block_overruns++;
+    }
+
+    uint8_t sequence = data[0] & 0x0F;
+    if (sequence != session->next_sequence) {
+        session->sequence_errors++;
+        session->aborted++;
+        session->state = CAN_ISOTP_IDLE;
+        return;
+    }
+
+    uint32_t remaining = session->length - session->received;
+    uint32_t payload = length > 1 ? length - 1 : 0;
+    if (payload > CAN_ISOTP_CONSECUTIVE_PAYLOAD) {
+        payload = CAN_ISOTP_CONSECUTIVE_PAYLOAD;
+    }
+    session->received += payload < remaining ? payload : remaining;
+    session->next_sequence = (sequence + 1) & 0x0F;
+    session->last_consecutive_sent_at = sent_at;
+    session->last_activity_at = received_at;
+    if (proxy_delay > session->max_proxy_delay_us) {
+        session->max_proxy_delay_us = proxy_delay;
+    }
+
+    if (session->received >= session->length) {
+        _complete(*session, received_at);
+    } else if (session->block_size && --session->block_remaining == 0) {
+        session->state = CAN_ISOTP_WAIT_FLOW_CONTROL;
+    }
+}
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <CANIsoTp.h>
+
+#define SCANNER_TO_ECU 0
+#define ECU_TO_SCANNER 1
+
+static void forward(CANIsoTpTracker& tracker, uint8_t direction, uint32_t id, bool is_extended,
+                    const uint8_t* data, int64_t at) {
+    tracker.forwarded(direction, id, is_extended, data, 8, at, at + 50);
+}
+
+static const CANIsoTpSession& onlySession(CANIsoTpTracker& tracker) {
+    assert(tracker.size() == 1);
+    return tracker.session(0);
+}
+
+void testHelpers() {
+    const uint8_t first[8] = { 0x10, 0x14, 0x49, 0x02, 0x01, 0x31, 0x47, 0x31 };
+    assert(CANIsoTpTracker::frameType(0x7E8, false, first, 8) == CAN_ISOTP_FIRST);
+    assert(CANIsoTpTracker::frameType(0x18DAF110, true, first, 8) == CAN_ISOTP_FIRST);
+
+    // Ordinary traffic can start with the same byte
+    assert(CANIsoTpTracker::frameType(0x100, false, first, 8) == CAN_ISOTP_NONE);
+    assert(CANIsoTpTracker::frameType(0x7E8, false, first, 0) == CAN_ISOTP_NONE);
+    const uint8_t bad[8] = { 0x40 };
+    assert(CANIsoTpTracker::frameType(0x7E8, false, bad, 8) == CAN_ISOTP_NONE);
+
+    assert(CANIsoTpTracker::stMinMicros(0x00) == 0);
+    assert(CANIsoTpTracker::stMinMicros(0x0A) == 10000);
+    assert(CANIsoTpTracker::stMinMicros(0x7F) == 127000);
+    assert(CANIsoTpTracker::stMinMicros(0xF1) == 100);
+    assert(CANIsoTpTracker::stMinMicros(0xF9) == 900);
+    assert(CANIsoTpTracker::stMinMicros(0x80) == 127000);
+
+    assert(CANIsoTpTracker::partnerId(0x7E8, false) == 0x7E0);
+    assert(CANIsoTpTracker::partnerId(0x7E3, false) == 0x7EB);
+    assert(CANIsoTpTracker::partnerId(0x18DAF110, true) == 0x18DA10F1);
+    assert(CANIsoTpTracker::partnerId(0x7DF, false) == CANIsoTpTracker::ANY_ID);
+}
+
+// A Mode 09 VIN response: 20 bytes, a first frame and two consecutive frames
+void testTransfer() {
+    CANIsoTpTracker tracker;
+    const uint8_t request[8] = { 0x02, 0x09, 0x02 };
+    const uint8_t first[8] = { 0x10, 0x14, 0x49, 0x02, 0x01, 0x31, 0x47, 0x31 };
+    const uint8_t flow[8] = { 0x30, 0x00, 0x0A };
+    const uint8_t cf1[8] = { 0x21, 0x4A, 0x43, 0x35, 0x34, 0x34, 0x34, 0x52 };
+    const uint8_t cf2[8] = { 0x22, 0x37, 0x32, 0x35, 0x32, 0x33, 0x36, 0x37 };
+
+    forward(tracker, SCANNER_TO_ECU, 0x7DF, false, request, 0);
+    assert(tracker.size() == 0);
+
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, first, 1000);
+    const CANIsoTpSession& session = onlySession(tracker);
+    assert(session.state == CAN_ISOTP_WAIT_FLOW_CONTROL);
+    assert(session.length == 20);
+    assert(session.received == 6);
+
+    forward(tracker, SCANNER_TO_ECU, 0x7E0, false, flow, 3000);
+    assert(session.state == CAN_ISOTP_SENDING);
+    assert(session.st_min_us == 10000);
+    assert(session.last_flow_control_us == 2000);
+
+    // The first consecutive frame can go at once, the next one STmin after it
+    assert(tracker.releaseAt(ECU_TO_SCANNER, 0x7E8, false, cf1, 8) == 0);
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, cf1, 4000);
+    assert(tracker.releaseAt(ECU_TO_SCANNER, 0x7E8, false, cf2, 8) == 4050 + 10000);
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, cf2, 14100);
+
+    assert(session.state == CAN_ISOTP_IDLE);
+    assert(session.received == 20);
+    assert(session.transfers == 1);
+    assert(session.last_duration_us == 13100);
+    assert(session.max_proxy_delay_us == 50);
+    assert(session.aborted == 0);
+
+    // Nothing to hold back once the transfer is over
+    assert(tracker.releaseAt(ECU_TO_SCANNER, 0x7E8, false, cf2, 8) == 0);
+}
+
+void testBlockSize() {
+    CANIsoTpTracker tracker;
+    const uint8_t first[8] = { 0x10, 0x1A }; // 26 bytes, 6 + 3 * 7 = 27
+    const uint8_t flow[8] = { 0x30, 0x02, 0x00 };
+    uint8_t cf[8] = { 0x21 };
+
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, first, 0);
+    forward(tracker, SCANNER_TO_ECU, 0x7E0, false, flow, 100);
+    const CANIsoTpSession& session = onlySession(tracker);
+    assert(session.block_size == 2);
+
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, cf, 200);
+    cf[0] = 0x22;
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, cf, 300);
+    assert(session.state == CAN_ISOTP_WAIT_FLOW_CONTROL);
+
+    // A wait keeps the receiver's turn going, the next continue opens a block
+    const uint8_t wait[8] = { 0x31 };
+    forward(tracker, SCANNER_TO_ECU, 0x7E0, false, wait, 400);
+    assert(session.state == CAN_ISOTP_WAIT_FLOW_CONTROL);
+    forward(tracker, SCANNER_TO_ECU, 0x7E0, false, flow, 500);
+    assert(session.state == CAN_ISOTP_SENDING);
+    assert(session.last_flow_control_us == 100); // Only the first flow control counts
+
+    cf[0] = 0x23;
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, cf, 600);
+    assert(session.transfers == 1);
+    assert(session.block_overruns == 0);
+
+    // A sender that doesn't wait for flow control is counted, not stopped
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, first, 1000);
+    cf[0] = 0x21;
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, cf, 1100);
+    assert(session.block_overruns == 1);
+    assert(session.received == 13);
+}
+
+void testAbort() {
+    CANIsoTpTracker tracker;
+    const uint8_t first[8] = { 0x10, 0x20 };
+    const uint8_t flow[8] = { 0x30, 0x00, 0x00 };
+    const uint8_t cf3[8] = { 0x23 };
+    const uint8_t overflow[8] = { 0x32 };
+    const uint8_t single[8] = { 0x03, 0x7F, 0x22, 0x78 };
+
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, first, 0);
+    forward(tracker, SCANNER_TO_ECU, 0x7E0, false, flow, 100);
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, cf3, 200);
+    const CANIsoTpSession& session = onlySession(tracker);
+    assert(session.sequence_errors == 1);
+    assert(session.aborted == 1);
+    assert(session.state == CAN_ISOTP_IDLE);
+
+    // Restarted before it finished
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, first, 300);
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, first, 400);
+    assert(session.aborted == 2);
+
+    forward(tracker, SCANNER_TO_ECU, 0x7E0, false, overflow, 500);
+    assert(session.aborted == 3);
+    assert(session.state == CAN_ISOTP_IDLE);
+
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, first, 600);
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, single, 700);
+    assert(session.aborted == 4);
+    assert(session.transfers == 0);
+}
+
+void testAddressing() {
+    CANIsoTpTracker tracker;
+    const uint8_t first[8] = { 0x10, 0x09 };
+    const uint8_t flow[8] = { 0x30, 0x00, 0xF5 };
+
+    // 29-bit normal fixed addressing, the flow control swaps target and source
+    forward(tracker, ECU_TO_SCANNER, 0x18DAF110, true, first, 0);
+    forward(tracker, SCANNER_TO_ECU, 0x18DAF110, true, flow, 100);
+    assert(tracker.unmatchedFlowControls() == 1);
+    forward(tracker, SCANNER_TO_ECU, 0x18DA10F1, true, flow, 200);
+    assert(onlySession(tracker).state == CAN_ISOTP_SENDING);
+    assert(onlySession(tracker).st_min_us == 500);
+
+    // Two ECUs answering at once each get their own flow control
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, first, 300);
+    forward(tracker, ECU_TO_SCANNER, 0x7E9, false, first, 310);
+    forward(tracker, SCANNER_TO_ECU, 0x7E1, false, flow, 400);
+    assert(tracker.size() == 3);
+    assert(tracker.session(1).state == CAN_ISOTP_WAIT_FLOW_CONTROL);
+    assert(tracker.session(2).state == CAN_ISOTP_SENDING);
+
+    // Flow control in the wrong direction matches nothing
+    forward(tracker, ECU_TO_SCANNER, 0x7E0, false, flow, 500);
+    assert(tracker.unmatchedFlowControls() == 2);
+}
+
+void testEviction() {
+    CANIsoTpTracker tracker;
+    const uint8_t first[8] = { 0x10, 0x09 };
+    const uint8_t flow[8] = { 0x30 };
+    const uint8_t cf[8] = { 0x21 };
+
+    // Eight ECUs on 0x18DA, half of them finish
+    for (uint32_t i = 0; i < CAN_ISOTP_MAX_SESSIONS; i++) {
+        uint32_t id = 0x18DAF100 + i;
+        forward(tracker, ECU_TO_SCANNER, id, true, first, i * 100);
+        if (i % 2) {
+            forward(tracker, SCANNER_TO_ECU, CANIsoTpTracker::partnerId(id, true), true, flow, i * 100 + 10);
+            forward(tracker, ECU_TO_SCANNER, id, true, cf, i * 100 + 20);
+        }
+    }
+    assert(tracker.size() == CAN_ISOTP_MAX_SESSIONS);
+
+    // The oldest finished one makes room, transfers in progress are kept
+    forward(tracker, ECU_TO_SCANNER, 0x18DAF1FF, true, first, 1000);
+    assert(tracker.evictions() == 1);
+    assert(tracker.size() == CAN_ISOTP_MAX_SESSIONS);
+    assert(tracker.session(1).id == 0x18DAF1FF);
+    assert(tracker.session(0).id == 0x18DAF100);
+}
+
+// A 4095 byte UDS read in blocks of 8, long enough for the sequence number
+// to wrap many times, then an escaped first frame
+void testLongTransfer() {
+    CANIsoTpTracker tracker;
+    const uint8_t first[8] = { 0x1F, 0xFF };
+    const uint8_t flow[8] = { 0x30, 0x08, 0xF1 };
+    uint8_t cf[8] = {0};
+    int64_t at = 0;
+
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, first, at);
+    const CANIsoTpSession& session = onlySession(tracker);
+    uint8_t sequence = 1;
+    unsigned long frames = 0;
+    while (session.state != CAN_ISOTP_IDLE) {
+        if (session.state == CAN_ISOTP_WAIT_FLOW_CONTROL) {
+            forward(tracker, SCANNER_TO_ECU, 0x7E0, false, flow, at += 100);
+        }
+        cf[0] = 0x20 | sequence;
+        int64_t release = tracker.releaseAt(ECU_TO_SCANNER, 0x7E8, false, cf, 8);
+        assert(release == 0 || release == at + 50 + 100);
+        forward(tracker, ECU_TO_SCANNER, 0x7E8, false, cf, at += 100);
+        sequence = (sequence + 1) & 0x0F;
+        frames++;
+    }
+    assert(frames == (4095 - 6 + 6) / 7);
+    assert(session.transfers == 1);
+    assert(session.aborted == 0);
+    assert(session.block_overruns == 0);
+
+    const uint8_t escaped[8] = { 0x10, 0x00, 0x00, 0x01, 0x00, 0x00 };
+    forward(tracker, ECU_TO_SCANNER, 0x7E8, false, escaped, at += 100);
+    assert(session.length == 0x10000);
+    assert(session.received == 2);
+}
+
+int main(int argc, char *argv[]) {
+    printf("Running testHelpers()... ");
+    testHelpers();
+    printf("Passed\n");
+    printf("Running testTransfer()... ");
+    testTransfer();
+    printf("Passed\n");
+    printf("Running testBlockSize()... ");
+    testBlockSize();
+    printf("Passed\n");
+    printf("Running testAbort()... ");
+    testAbort();
+    printf("Passed\n");
+    printf("Running testAddressing()... ");
+    testAddressing();
+    printf("Passed\n");
+    printf("Running testEviction()... ");
+    testEviction();
+    printf("Passed\n");
+    printf("Running testLongTransfer()... ");
+    testLongTransfer();
+    printf("Passed\n");
+}
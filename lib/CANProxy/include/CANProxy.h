@@ -6,21 +6,42 @@
 #include <Arduino.h>
 #include <CANStream.h>
 #include <OBD2Responder.h>
+#include <CANRouter.h>
+#include <CANIsoTp.h>
+#include <CANCorrelator.h>
+
+// Frames forwarded per direction per handleFrames() call, so a burst on one
+// bus can't hold up the other
+#define CAN_PROXY_FORWARD_BUDGET 16
+
+// The forwarding task also wakes this often with nothing received, so
+// transmit deadlines still expire on a quiet bus
+#define CAN_PROXY_SERVICE_INTERVAL_MS 5
+#define CAN_PROXY_TASK_STACK 4096
+
+// Statistics tracking, one per forwarding direction
+struct CANProxyDirectionStats {
+    unsigned long frames_received;
+    unsigned long frames_forwarded;
+    unsigned long frames_not_forwarded; // Classifier didn't tag them CAN_ACTION_FORWARD, or routed to drop
+    unsigned long frames_rewritten;     // Id or data changed by a route
+    unsigned long frames_echoed;        // Also sent back onto the bus they came from
+    unsigned long isotp_holds;          // Times a consecutive frame was held back for STmin
+    unsigned long frames_responded;     // Answered by the OBD2 responder instead
+    unsigned long tx_queue_full;        // Left queued for the next pass
+    unsigned long errors;
+};
 
-// Statistics tracking
 struct CANProxyStats {
-    unsigned long frames_received_can1;
-    unsigned long frames_received_can2;
-    unsigned long frames_forwarded_can1_to_can2;
-    unsigned long frames_forwarded_can2_to_can1;
-    unsigned long errors_can1;
-    unsigned long errors_can2;
+    CANProxyDirectionStats can1_to_can2;
+    CANProxyDirectionStats can2_to_can1;
 };
 
 class CANProxy {
 private:
-    CANStream _can1;
-    CANStream _can2;
+    // Declared by the sketch so each bus gets its own buffer depth
+    CANStream& _can1;
+    CANStream& _can2;
  
     OBD2Responder* _obd2_responder = nullptr;
     static int _obd2_responder_gpio_pin;
@@ -28,12 +49,30 @@ private:
     static void handleOBD2ResponderGPIOEnable();
 
     CANProxyStats _stats;
+    CANRouter* _router = nullptr;
+
+    // Multi-frame diagnostic transfers in both directions
+    CANIsoTpTracker _isotp;
+    int64_t _paced_until = 0; // Earliest held consecutive frame of either direction, 0 = none
+
+    // Diagnostic requests forwarded to CAN2 waiting for their responses
+    CANCorrelator _correlator;
+
+    TaskHandle_t _forwardingTask = nullptr;
+    static void _forwardingTaskLoop(void* arg);
+
+    // One direction of the proxy, drains from without ever waiting on to
+    bool _forward(CANStream& from, CANStream& to, CANProxyDirectionStats& stats,
+                  uint8_t route_direction, const char* direction);
+    void _printDirectionStats(const char* direction, const CANProxyDirectionStats& stats);
+    void _printIsoTpStats();
+    void _printCorrelatorStats();
     
     // Debug output
     static Stream* _debug;
     
 public:
-    CANProxy(const CANConfig& config1, const CANConfig& config2, Stream* debug = nullptr);
+    CANProxy(CANStream& can1, CANStream& can2, Stream* debug = nullptr);
     ~CANProxy();
     static Stream* getDebugOutput();
     
@@ -41,13 +80,25 @@ public:
     int begin();
     void end();
     
-    // Frame handling
-    void handleFrames();
+    // Frame handling. Returns true if frames were left for the next call.
+    bool handleFrames();
+
+    // Runs handleFrames() from a task woken by both streams, so frames are
+    // forwarded as they arrive and loop() only has housekeeping left
+    int startForwardingTask(UBaseType_t priority, BaseType_t core);
+    bool hasForwardingTask() const { return _forwardingTask != nullptr; }
+    TaskHandle_t getForwardingTask() const { return _forwardingTask; }
+
+    // Per-id drop, remap, patch and duplicate rules, nullptr forwards everything unchanged
+    void setRouter(CANRouter* router) { _router = router; }
     
     // Statistics
     void resetStats();
     void printStats();
+    void benchmarkSPI(int iterations);
     CANProxyStats getStats() const { return _stats; }
+    const CANIsoTpTracker& getIsoTpTracker() const { return _isotp; }
+    const CANCorrelator& getCorrelator() const { return _correlator; }
     
     // Direct CAN access (for OBD-II emulation)
     CANStream* getCAN1() { return &_can1; }
@@ -9,8 +9,8 @@ int CANProxy::_obd2_responder_gpio_pin;
 bool CANProxy::_obd2_responder_gpio_enabled = true; // Enabled by default
 
 
-CANProxy::CANProxy(const CANConfig& config1, const CANConfig& config2, Stream* debug) 
-    : _can1(config1, debug), _can2(config2, debug) {
+CANProxy::CANProxy(CANStream& can1, CANStream& can2, Stream* debug) 
+    : _can1(can1), _can2(can2) {
     
     // Initialize statistics
     memset(&_stats, 0, sizeof(_stats));
@@ -88,7 +88,7 @@ void CANProxy::activateOBD2Responder(int gpio_pin) {
         .is_retransmit = false,
         .data_len = 8,
         .data = { 0x06, 0x41, 0x01, 0x00, 0x07, 0xFF, 0x00, 0xCC },
-        .timestamp = millis()
+        .timestamp = esp_timer_get_time()
     };
 
     _obd2_responder->setMonitorStatusFrame(monitor_status_frame);
@@ -113,71 +113,194 @@ void CANProxy::handleOBD2ResponderGPIOEnable() {
     }
 }
 
-void CANProxy::handleFrames() {
-    // Process frames from CAN1 buffer and forward to CAN2
-    if (_can1.available()) {
-        // If OBD2Responder has been activated, let it process the frame first
-        if (_obd2_responder && _obd2_responder_gpio_enabled) {
-            FrameResultCode result = _obd2_responder->handleNextFrame();
-            
-            // If OBD2Responder handled the frame (responded to it), skip forwarding
-            // Positive values indicate the frame was handled
-            if (result > 0) {
-                _stats.frames_received_can1++;
+// Both directions run on every call and neither waits for the other bus, so
+// traffic the ECU sends on its own is forwarded as promptly as requests
+bool CANProxy::handleFrames() {
+    _paced_until = 0;
+
+    // Expire forwarded frames that never made it onto the bus
+    _can1.serviceTransmit();
+    _can2.serviceTransmit();
+
+    // Count diagnostic requests whose responses never came
+    _correlator.expire(esp_timer_get_time());
+
+    bool more1 = _forward(_can1, _can2, _stats.can1_to_can2, CAN_ROUTE_CAN1_TO_CAN2, "CAN1 to CAN2");
+    bool more2 = _forward(_can2, _can1, _stats.can2_to_can1, CAN_ROUTE_CAN2_TO_CAN1, "CAN2 to CAN1");
+    return more1 || more2;
+}
+
+int CANProxy::startForwardingTask(UBaseType_t priority, BaseType_t core) {
+    if (_forwardingTask) {
+        return 1;
+    }
+
+    if (xTaskCreatePinnedToCore(_forwardingTaskLoop, "can_proxy", CAN_PROXY_TASK_STACK,
+            this, priority, &_forwardingTask, core) != pdPASS) {
+        if (_debug) _debug->println("CANProxy: Failed to start forwarding task");
+        _forwardingTask = nullptr;
+        return -1;
+    }
+
+    _can1.setNotifyTask(_forwardingTask);
+    _can2.setNotifyTask(_forwardingTask);
+
+    if (_debug) _debug->printf("CANProxy: Forwarding from a task on core %d, priority %u\n",
+        (int)core, (unsigned int)priority);
+    return 1;
+}
+
+void CANProxy::_forwardingTaskLoop(void* arg) {
+    CANProxy* proxy = (CANProxy*)arg;
+
+    while (true) {
+        // Sleep no longer than a consecutive frame held back for STmin
+        TickType_t wait = pdMS_TO_TICKS(CAN_PROXY_SERVICE_INTERVAL_MS);
+        if (proxy->_paced_until) {
+            int64_t remaining_ms = (proxy->_paced_until - esp_timer_get_time() + 999) / 1000;
+            TickType_t paced = remaining_ms > 0 ? pdMS_TO_TICKS(remaining_ms) : 0;
+            if (paced < wait) {
+                wait = paced;
+            }
+        }
+
+        // Woken by a buffered frame or a finished transmit
+        ulTaskNotifyTake(pdTRUE, wait);
+
+        // Keep going while a direction used up its budget, frames are waiting
+        while (proxy->handleFrames()) { }
+    }
+}
+
+// Frames are forwarded straight out of the ring, without read()'s wait for
+// the source bus to go idle. A full transmit queue leaves the frame where it
+// is for the next call instead of dropping it. True if the budget ran out
+// with frames still waiting.
+bool CANProxy::_forward(CANStream& from, CANStream& to, CANProxyDirectionStats& stats,
+                        uint8_t route_direction, const char* direction) {
+    const CANFrame* frame;
+    CANFrame routed;
+    int budget = CAN_PROXY_FORWARD_BUDGET;
+    for (; budget > 0 && (frame = from.peek()) != nullptr; budget--) {
+        // If OBD2Responder has been activated it gets first look at the CAN1
+        // frames tagged respond. A frame it answers is consumed, not forwarded.
+        if (route_direction == CAN_ROUTE_CAN1_TO_CAN2 && (frame->action & CAN_ACTION_RESPOND) &&
+                _obd2_responder && _obd2_responder_gpio_enabled) {
+            FrameResultCode handled = _obd2_responder->handleNextFrame();
+            if (handled == PACKET_RESULT_TX_QUEUE_FULL) {
+                // Woken again when a transmit completes
+                stats.tx_queue_full++;
+                return false;
+            }
+            if (handled > 0) {
+                stats.frames_received++;
+                stats.frames_responded++;
                 if (_debug) {
                     _debug->println("CANProxy: OBD2Responder handled frame, not forwarding");
                 }
-                return;
+                continue;
+            }
+        }
+
+        // Frames the classifier kept for other stages stay on this bus
+        if (!(frame->action & CAN_ACTION_FORWARD)) {
+            stats.frames_received++;
+            stats.frames_not_forwarded++;
+            from.consume();
+            continue;
+        }
+
+        // Rewrites go to a copy, the ring slot is left as received
+        const CANFrame* out = frame;
+        uint8_t targets = CAN_ROUTE_FORWARD;
+        if (_router) {
+            routed = *frame;
+            uint32_t id = routed.id;
+            targets = _router->route(route_direction, id, routed.is_extended, (uint8_t*)routed.data);
+            routed.id = id;
+            out = &routed;
+        }
+
+        if (targets == CAN_ROUTE_DROP) {
+            stats.frames_received++;
+            stats.frames_not_forwarded++;
+            from.consume();
+            continue;
+        }
+
+        // Consecutive frames that queued up here would reach the receiver
+        // closer together than the STmin it asked for. A held frame stays in
+        // the ring and the other direction carries on, the forwarding task
+        // sleeps until the earliest one is due.
+        int64_t release_at = _isotp.releaseAt(route_direction, out->id, out->is_extended,
+            (const uint8_t*)out->data, (uint8_t)out->data_len);
+        if (release_at && release_at > esp_timer_get_time()) {
+            stats.isotp_holds++;
+            if (!_paced_until || release_at < _paced_until) {
+                _paced_until = release_at;
+            }
+            return false;
+        }
+
+        int result = 1;
+        if (targets & CAN_ROUTE_FORWARD) {
+            result = to.queueFrame(*out);
+            if (result == 0) {
+                // Woken again when a transmit completes
+                stats.tx_queue_full++;
+                return false;
             }
         }
 
-        // OBD2Responder didn't handle this frame, so forward it
-        CANFrame can_frame = _can1.read();
-        _stats.frames_received_can1++;
-        
-        // Forward frame to CAN2
-        int result = _can2.sendFrame(can_frame);
-        if (result == 1) {
-            _stats.frames_forwarded_can1_to_can2++;
+        stats.frames_received++;
+        if (result != 1) {
+            stats.errors++;
             if (_debug) {
-                _debug->print("CANProxy: Forwarded frame from CAN1 to CAN2, ID: 0x");
-                _debug->println(can_frame.id, HEX);
+                _debug->printf("CANProxy: Failed to forward frame from %s, error: %d\n", direction, result);
+            }
+        } else if (targets & CAN_ROUTE_FORWARD) {
+            stats.frames_forwarded++;
+            int64_t sent_at = esp_timer_get_time();
+
+            // Requests are matched by the id the ECUs see, responses by the one they sent
+            if (route_direction == CAN_ROUTE_CAN1_TO_CAN2) {
+                _correlator.request(out->id, out->is_extended, (const uint8_t*)out->data,
+                    (uint8_t)out->data_len, sent_at);
+            } else {
+                _correlator.response(frame->id, frame->is_extended, (const uint8_t*)frame->data,
+                    (uint8_t)frame->data_len, frame->timestamp);
+            }
+
+            // A flow control is paired by the id it answered on its own bus,
+            // data frames by the id they go out with
+            const CANFrame* tracked = out;
+            if (CANIsoTpTracker::frameType(frame->id, frame->is_extended, (const uint8_t*)frame->data,
+                    (uint8_t)frame->data_len) == CAN_ISOTP_FLOW_CONTROL) {
+                tracked = frame;
             }
-        } else {
-            _stats.errors_can1++;
+            _isotp.forwarded(route_direction, tracked->id, tracked->is_extended, (const uint8_t*)out->data,
+                (uint8_t)out->data_len, frame->timestamp, sent_at);
             if (_debug) {
-                _debug->print("CANProxy: Failed to forward frame from CAN1 to CAN2, error: ");
-                _debug->println(result);
+                _debug->printf("CANProxy: Forwarded frame from %s, ID: 0x%lX\n", direction, out->id);
             }
         }
-        
-        // Wait up to 50ms for response
-        unsigned long tx_time = millis();
-        while (!_can2.available() && millis() - tx_time < 50) { }
-        
-        // If we got a response, forward it
-        if (_can2.available()) {
-            // Process frames from CAN2 buffer and forward to CAN1
-            CANFrame can_frame_2 = _can2.read();
-            _stats.frames_received_can2++;
-            
-            // Forward frame to CAN1
-            result = _can1.sendFrame(can_frame_2);
-            if (result == 1) {
-                _stats.frames_forwarded_can2_to_can1++;
-                if (_debug) {
-                    _debug->print("CANProxy: Forwarded frame from CAN2 to CAN1, ID: 0x");
-                    _debug->println(can_frame_2.id, HEX);
-                }
+
+        // Best effort, retrying it would forward the frame twice
+        if (targets & CAN_ROUTE_ECHO) {
+            if (from.queueFrame(*out) == 1) {
+                stats.frames_echoed++;
             } else {
-                _stats.errors_can2++;
-                if (_debug) {
-                    _debug->print("CANProxy: Failed to forward frame from CAN2 to CAN1, error: ");
-                    _debug->println(result);
-                }
+                stats.errors++;
             }
         }
+
+        if (out->id != frame->id || memcmp(out->data, frame->data, sizeof(frame->data)) != 0) {
+            stats.frames_rewritten++;
+        }
+        from.consume();
     }
+
+    return budget == 0 && from.available();
 }
 
 void CANProxy::resetStats() {
@@ -186,18 +309,13 @@ void CANProxy::resetStats() {
 
 void CANProxy::printStats() {
     _debug->println("CANProxy Statistics:");
-    _debug->print("  CAN1 frames received: ");
-    _debug->println(_stats.frames_received_can1);
-    _debug->print("  CAN2 frames received: ");
-    _debug->println(_stats.frames_received_can2);
-    _debug->print("  Frames forwarded CAN1->CAN2: ");
-    _debug->println(_stats.frames_forwarded_can1_to_can2);
-    _debug->print("  Frames forwarded CAN2->CAN1: ");
-    _debug->println(_stats.frames_forwarded_can2_to_can1);
-    _debug->print("  CAN1 errors: ");
-    _debug->println(_stats.errors_can1);
-    _debug->print("  CAN2 errors: ");
-    _debug->println(_stats.errors_can2);
+    _printDirectionStats("CAN1->CAN2", _stats.can1_to_can2);
+    _printDirectionStats("CAN2->CAN1", _stats.can2_to_can1);
+    if (_router) {
+        _debug->printf("  Routes: %u\n", (unsigned int)_router->size());
+    }
+    _printIsoTpStats();
+    _printCorrelatorStats();
     
     if (_obd2_responder) {
         _debug->print("  OBD2 Responder: ");
@@ -207,6 +325,11 @@ void CANProxy::printStats() {
     }
 }
 
+void CANProxy::benchmarkSPI(int iterations) {
+    _can1.benchmarkSPI(iterations);
+    _can2.benchmarkSPI(iterations);
+}
+
 void CANProxy::dumpRegisters() {
     if (_debug) _debug->println("CANProxy Register Dumps:");
     if (_debug) _debug->println("CAN1 Registers:");
@@ -215,6 +338,48 @@ void CANProxy::dumpRegisters() {
     _can2.dumpRegisters();
 }
 
+void CANProxy::_printDirectionStats(const char* direction, const CANProxyDirectionStats& stats) {
+    _debug->printf("  %s: received %lu, forwarded %lu, not forwarded %lu, rewritten %lu, echoed %lu, responded %lu, TX queue full %lu, STmin holds %lu, errors %lu\n",
+        direction, stats.frames_received, stats.frames_forwarded, stats.frames_not_forwarded,
+        stats.frames_rewritten, stats.frames_echoed, stats.frames_responded, stats.tx_queue_full,
+        stats.isotp_holds, stats.errors);
+}
+
+void CANProxy::_printCorrelatorStats() {
+    const CANCorrelatorStats& stats = _correlator.getStats();
+    if (stats.requests == 0 && stats.orphans == 0) {
+        return;
+    }
+
+    unsigned long average = stats.answered ? (unsigned long)(stats.latency_total_us / stats.answered) : 0;
+    _debug->printf("  Diagnostics: requests %lu, in flight %u (max %u), answered %lu, responses %lu, "
+        "negative %lu, response pending %lu, timeouts %lu, orphans %lu, untracked %lu\n",
+        stats.requests, (unsigned int)_correlator.inFlight(), (unsigned int)stats.max_in_flight,
+        stats.answered, stats.responses, stats.negative, stats.response_pending,
+        stats.timeouts, stats.orphans, stats.untracked);
+    _debug->printf("  Diagnostic latency: min %lu, avg %lu, max %lu us\n",
+        (unsigned long)stats.latency_min_us, average, (unsigned long)stats.latency_max_us);
+}
+
+void CANProxy::_printIsoTpStats() {
+    if (_isotp.size() == 0) {
+        return;
+    }
+
+    _debug->printf("  ISO-TP sessions: %u, unmatched flow controls %lu, evictions %lu\n",
+        (unsigned int)_isotp.size(), _isotp.unmatchedFlowControls(), _isotp.evictions());
+    for (size_t i = 0; i < _isotp.size(); i++) {
+        const CANIsoTpSession& session = _isotp.session(i);
+        unsigned long average = session.transfers ? (unsigned long)(session.total_duration_us / session.transfers) : 0;
+        _debug->printf("    0x%lX %s: transfers %lu, aborted %lu, duration avg %lu max %lu us, "
+            "flow control max %lu us, proxy delay max %lu us, sequence errors %lu, block overruns %lu\n",
+            (unsigned long)session.id, session.direction == CAN_ROUTE_CAN1_TO_CAN2 ? "CAN1->CAN2" : "CAN2->CAN1",
+            session.transfers, session.aborted, average, (unsigned long)session.max_duration_us,
+            (unsigned long)session.max_flow_control_us, (unsigned long)session.max_proxy_delay_us,
+            session.sequence_errors, session.block_overruns);
+    }
+}
+
 bool CANProxy::detectHardware() {
     return _can1.detectHardware() && _can2.detectHardware();
 }
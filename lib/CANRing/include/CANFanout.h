@@ -0,0 +1,93 @@
+// vim: ts=4:sw=4:et
+
+#ifndef CAN_FANOUT_H
+#define CAN_FANOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// One consumer's position in a CANFanout. Owned by the consumer, the ring
+// doesn't know how many there are.
+struct CANSubscriber {
+    uint32_t tail = 0;
+    unsigned long received = 0;
+    unsigned long overruns = 0; // Frames overwritten before this subscriber got to them
+};
+
+// Single producer, any number of independent subscribers. The producer never
+// waits: it always writes the next slot, and a subscriber that falls a full
+// ring behind skips ahead and counts what it lost. A subscriber copies a slot
+// and then checks the producer hasn't come round to it, so a copy torn by
+// the producer is never returned. That costs one slot, a subscriber sees at
+// most Capacity - 1 frames of backlog.
+template <typename T, size_t Capacity>
+class CANFanout {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                  "CANFanout capacity must be a power of two");
+
+public:
+    CANFanout() : _head(0) {}
+
+    // Producer only
+    void push(const T& item) {
+        uint32_t head = _head.load(std::memory_order_relaxed);
+        // Subscribers that see this write also see the _head that makes them discard it
+        std::atomic_thread_fence(std::memory_order_release);
+        _items[head & MASK] = item;
+        _head.store(head + 1, std::memory_order_release);
+    }
+
+    // Starts a subscriber at the next item pushed
+    void subscribe(CANSubscriber& subscriber) const {
+        subscriber.tail = _head.load(std::memory_order_acquire);
+        subscriber.received = 0;
+        subscriber.overruns = 0;
+    }
+
+    // Subscriber's thread only. Oldest item the subscriber hasn't seen yet.
+    bool read(CANSubscriber& subscriber, T& item) const {
+        for (;;) {
+            uint32_t head = _head.load(std::memory_order_acquire);
+            if (head == subscriber.tail) {
+                return false;
+            }
+
+            if (head - subscriber.tail >= Capacity) {
+                uint32_t lost = head - subscriber.tail - (Capacity - 1);
+                subscriber.overruns += lost;
+                subscriber.tail += lost;
+            }
+
+            item = _items[subscriber.tail & MASK];
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            // The producer reached this slot while we copied it, skip ahead again
+            if (_head.load(std::memory_order_relaxed) - subscriber.tail >= Capacity) {
+                continue;
+            }
+
+            subscriber.tail++;
+            subscriber.received++;
+            return true;
+        }
+    }
+
+    // Items waiting for this subscriber, Capacity - 1 or more means it is overrunning
+    size_t lag(const CANSubscriber& subscriber) const {
+        return (size_t)(_head.load(std::memory_order_acquire) - subscriber.tail);
+    }
+
+    // Every item ever pushed
+    unsigned long pushed() const { return _head.load(std::memory_order_relaxed); }
+
+    static constexpr size_t capacity() { return Capacity; }
+
+private:
+    static constexpr uint32_t MASK = Capacity - 1;
+
+    T _items[Capacity];
+    std::atomic<uint32_t> _head;
+};
+
+#endif // CAN_FANOUT_H
@@ -0,0 +1,113 @@
+// vim: ts=4:sw=4:et
+
+#ifndef CAN_MAILBOX_H
+#define CAN_MAILBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Latest item per key, written by one producer (the receive path) and read
+// by anyone. Open addressed with linear probing, keys are never removed, so
+// a lookup is one hash and usually one slot. Each slot has a sequence
+// counter that is odd while the producer writes it, readers copy the item and
+// retry if the counter moved (a seqlock), so the producer never waits.
+template <typename T, size_t Slots>
+class CANMailbox {
+    static_assert(Slots >= 2 && (Slots & (Slots - 1)) == 0,
+                  "CANMailbox slots must be a power of two");
+
+public:
+    CANMailbox() : _used(0), _misses(0) {
+        for (size_t i = 0; i < Slots; i++) {
+            _entries[i].key.store(EMPTY, std::memory_order_relaxed);
+            _entries[i].sequence.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Producer only. Returns false and counts a miss when the key is new and
+    // every slot already belongs to another key.
+    bool update(uint32_t key, const T& item) {
+        Entry* entry = _find(key, true);
+        if (!entry) {
+            _misses.store(_misses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        uint32_t sequence = entry->sequence.load(std::memory_order_relaxed);
+        entry->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        entry->item = item;
+        entry->sequence.store(sequence + 2, std::memory_order_release);
+
+        // A new key becomes visible only once its first item is complete
+        if (entry->key.load(std::memory_order_relaxed) == EMPTY) {
+            entry->key.store(key, std::memory_order_release);
+            _used.store(_used.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Any thread. Copies the newest item for key, false if it was never seen.
+    bool latest(uint32_t key, T& item) const {
+        const Entry* entry = const_cast<CANMailbox*>(this)->_find(key, false);
+        if (!entry) {
+            return false;
+        }
+
+        uint32_t before, after;
+        do {
+            before = entry->sequence.load(std::memory_order_acquire);
+            item = entry->item;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = entry->sequence.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+        return true;
+    }
+
+    // How many times key has been written, 0 if never. Cheap change detection.
+    uint32_t updates(uint32_t key) const {
+        const Entry* entry = const_cast<CANMailbox*>(this)->_find(key, false);
+        return entry ? entry->sequence.load(std::memory_order_acquire) / 2 : 0;
+    }
+
+    size_t size() const { return _used.load(std::memory_order_relaxed); }
+    static constexpr size_t capacity() { return Slots; }
+    unsigned long misses() const { return _misses.load(std::memory_order_relaxed); }
+
+    // Reserved, a key is never all ones (29-bit CAN id plus a flag bit)
+    static constexpr uint32_t EMPTY = 0xFFFFFFFF;
+
+private:
+    static constexpr uint32_t MASK = Slots - 1;
+
+    struct Entry {
+        std::atomic<uint32_t> key;
+        std::atomic<uint32_t> sequence;
+        T item;
+    };
+
+    // Claiming an empty slot is left to update(), so readers never take one
+    Entry* _find(uint32_t key, bool claim) {
+        uint32_t hash = key * 0x9E3779B1u;
+        hash ^= hash >> 16;
+
+        for (uint32_t probe = 0; probe < Slots; probe++) {
+            Entry* entry = &_entries[(hash + probe) & MASK];
+            uint32_t found = entry->key.load(std::memory_order_acquire);
+            if (found == key) {
+                return entry;
+            }
+            if (found == EMPTY) {
+                return claim ? entry : nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+    Entry _entries[Slots];
+    std::atomic<uint32_t> _used;
+    std::atomic<uint32_t> _misses;
+};
+
+#endif // CAN_MAILBOX_H
@@ -0,0 +1,135 @@
+// vim: ts=4:sw=4:et
+
+#ifndef CAN_RING_H
+#define CAN_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Single producer, single consumer ring. The producer (receive interrupt or
+// task) only writes _head, the consumer (main loop) only writes _tail, so no
+// locks are needed. Indices run freely and are masked on access, which keeps
+// all Capacity slots usable and takes the % off the hot path.
+template <typename T, size_t Capacity>
+class CANRing {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                  "CANRing capacity must be a power of two");
+
+public:
+    CANRing() : _head(0), _tail(0), _pushed(0), _overflows(0), _highWatermark(0) {}
+
+    // Producer only. Returns false and counts an overflow when full.
+    bool push(const T& item) {
+        uint32_t head = _head.load(std::memory_order_relaxed);
+        uint32_t tail = _tail.load(std::memory_order_acquire);
+
+        if (head - tail >= Capacity) {
+            _overflows.store(_overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        _items[head & MASK] = item;
+        // Publishes the slot, the consumer's acquire load of _head sees it written
+        _head.store(head + 1, std::memory_order_release);
+        _pushed.store(_pushed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+        // Depth right after this push, the consumer can only have made it smaller since
+        uint32_t depth = head + 1 - tail;
+        if (depth > _highWatermark.load(std::memory_order_relaxed)) {
+            _highWatermark.store(depth, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    // Consumer only. Oldest item first.
+    bool pop(T& item) {
+        uint32_t tail = _tail.load(std::memory_order_relaxed);
+        uint32_t head = _head.load(std::memory_order_acquire);
+
+        if (head == tail) {
+            return false;
+        }
+
+        item = _items[tail & MASK];
+        // Hands the slot back, the producer's acquire load of _tail sees it read
+        _tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Copies the most recent item without consuming anything.
+    bool newest(T& item) const {
+        uint32_t tail = _tail.load(std::memory_order_relaxed);
+        uint32_t head = _head.load(std::memory_order_acquire);
+
+        if (head == tail) {
+            return false;
+        }
+
+        // The producer can't reuse this slot until we move _tail past it
+        item = _items[(head - 1) & MASK];
+        return true;
+    }
+
+    // Consumer only. Points at the offset'th oldest item in place, nullptr past
+    // the end. The slot stays put until consume() moves _tail past it.
+    const T* peek(size_t offset = 0) const {
+        uint32_t tail = _tail.load(std::memory_order_relaxed);
+        uint32_t head = _head.load(std::memory_order_acquire);
+
+        if (offset >= head - tail) {
+            return nullptr;
+        }
+
+        return &_items[(tail + offset) & MASK];
+    }
+
+    // Consumer only. Releases up to count peeked items, returns how many.
+    size_t consume(size_t count) {
+        uint32_t tail = _tail.load(std::memory_order_relaxed);
+        uint32_t head = _head.load(std::memory_order_acquire);
+
+        if (count > head - tail) {
+            count = head - tail;
+        }
+
+        _tail.store(tail + (uint32_t)count, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer only. Drops everything queued so far, the producer keeps going.
+    void clear() {
+        _tail.store(_head.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    bool empty() const {
+        return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+    }
+
+    // Exact from the consumer, a snapshot from anywhere else
+    size_t size() const {
+        uint32_t tail = _tail.load(std::memory_order_acquire);
+        return (size_t)(_head.load(std::memory_order_acquire) - tail);
+    }
+
+    static constexpr size_t capacity() { return Capacity; }
+
+    // Every push() lands in exactly one of these
+    unsigned long pushed() const { return _pushed.load(std::memory_order_relaxed); }
+    unsigned long overflows() const { return _overflows.load(std::memory_order_relaxed); }
+
+    // Deepest the ring has been, Capacity means it has been full
+    size_t highWatermark() const { return _highWatermark.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr uint32_t MASK = Capacity - 1;
+
+    T _items[Capacity];
+    std::atomic<uint32_t> _head;
+    std::atomic<uint32_t> _tail;
+    std::atomic<uint32_t> _pushed;
+    std::atomic<uint32_t> _overflows;
+    std::atomic<uint32_t> _highWatermark;
+};
+
+#endif // CAN_RING_H
@@ -0,0 +1,49 @@
+// vim: ts=4:sw=4:et
+
+#ifndef CAN_SEQLOCK_H
+#define CAN_SEQLOCK_H
+
+#include <stdint.h>
+#include <atomic>
+
+// A value with one writer that any thread can copy out whole. The writer
+// updates it in place between beginWrite() and endWrite() and never waits, a
+// reader that overlaps a write retries until it gets a consistent copy.
+template <typename T>
+class CANSeqlock {
+public:
+    CANSeqlock() : _sequence(0), _value() {}
+
+    // Writer only. The counter is odd until endWrite().
+    T& beginWrite() {
+        _sequence.store(_sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        return _value;
+    }
+
+    void endWrite() {
+        _sequence.store(_sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Writer only, no copy needed to read its own value
+    const T& peek() const { return _value; }
+
+    // Any thread
+    T load() const {
+        T copy;
+        uint32_t before, after;
+        do {
+            before = _sequence.load(std::memory_order_acquire);
+            copy = _value;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = _sequence.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+        return copy;
+    }
+
+private:
+    std::atomic<uint32_t> _sequence;
+    T _value;
+};
+
+#endif // CAN_SEQLOCK_H
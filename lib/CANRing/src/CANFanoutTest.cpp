@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <thread>
+#include <atomic>
+#include <CANFanout.h>
+
+// Shaped like a CANFrame so a torn copy shows up in the payload check
+struct TestFrame {
+    uint32_t sequence;
+    uint8_t data[8];
+    uint32_t check;
+};
+
+static TestFrame makeFrame(uint32_t sequence) {
+    TestFrame frame;
+    frame.sequence = sequence;
+    for (int i = 0; i < 8; i++) {
+        frame.data[i] = (uint8_t)(sequence >> (i % 4 * 8));
+    }
+    frame.check = ~sequence;
+    return frame;
+}
+
+static bool frameIntact(const TestFrame& frame) {
+    TestFrame expected = makeFrame(frame.sequence);
+    return memcmp(frame.data, expected.data, sizeof(frame.data)) == 0 && frame.check == expected.check;
+}
+
+void testIndependentSubscribers() {
+    CANFanout<TestFrame, 8> fanout;
+    CANSubscriber fast, slow, late;
+    TestFrame frame;
+
+    fanout.subscribe(fast);
+    fanout.subscribe(slow);
+    assert(!fanout.read(fast, frame));
+
+    for (uint32_t i = 0; i < 3; i++) {
+        fanout.push(makeFrame(i));
+    }
+
+    // Reading with one cursor leaves the other where it was
+    for (uint32_t i = 0; i < 3; i++) {
+        assert(fanout.read(fast, frame));
+        assert(frame.sequence == i);
+    }
+    assert(!fanout.read(fast, frame));
+    assert(fanout.lag(fast) == 0);
+    assert(fanout.lag(slow) == 3);
+
+    // A new subscriber only sees what comes after it
+    fanout.subscribe(late);
+    fanout.push(makeFrame(3));
+    assert(fanout.read(late, frame));
+    assert(frame.sequence == 3);
+
+    assert(fanout.read(slow, frame));
+    assert(frame.sequence == 0);
+    assert(slow.received == 1);
+    assert(slow.overruns == 0);
+}
+
+void testOverrun() {
+    CANFanout<TestFrame, 8> fanout;
+    CANSubscriber subscriber;
+    TestFrame frame;
+
+    fanout.subscribe(subscriber);
+
+    // The producer never waits, the subscriber loses the oldest frames
+    for (uint32_t i = 0; i < 20; i++) {
+        fanout.push(makeFrame(i));
+    }
+    assert(fanout.lag(subscriber) == 20);
+
+    uint32_t expected = 20 - 7;
+    while (fanout.read(subscriber, frame)) {
+        assert(frame.sequence == expected++);
+    }
+    assert(expected == 20);
+    assert(subscriber.received == 7);
+    assert(subscriber.overruns == 13);
+    assert(fanout.pushed() == 20);
+}
+
+// One producer that never waits and two subscribers, one of them slow. Each
+// must see intact frames in order, and account for every frame once.
+void testStress(uint32_t frames) {
+    static CANFanout<TestFrame, 32> fanout;
+    std::atomic<bool> done(false);
+    CANSubscriber subscribers[2];
+    uint32_t corrupt[2] = {0, 0};
+    uint32_t out_of_order[2] = {0, 0};
+
+    fanout.subscribe(subscribers[0]);
+    fanout.subscribe(subscribers[1]);
+
+    std::thread producer([&]() {
+        for (uint32_t i = 0; i < frames; i++) {
+            fanout.push(makeFrame(i));
+            if (i % 64 == 0) {
+                std::this_thread::yield();
+            }
+        }
+        done.store(true);
+    });
+
+    std::thread readers[2];
+    for (int r = 0; r < 2; r++) {
+        readers[r] = std::thread([&, r]() {
+            CANSubscriber& subscriber = subscribers[r];
+            TestFrame frame;
+            uint32_t next = 0;
+            for (;;) {
+                bool finished = done.load();
+                if (!fanout.read(subscriber, frame)) {
+                    if (finished) {
+                        break; // Producer is done and everything is drained
+                    }
+                    continue;
+                }
+                if (!frameIntact(frame)) {
+                    corrupt[r]++;
+                }
+                if (frame.sequence < next) {
+                    out_of_order[r]++;
+                }
+                next = frame.sequence + 1;
+                if (r == 1 && frame.sequence % 16 == 0) {
+                    std::this_thread::yield(); // The slow one
+                }
+            }
+        });
+    }
+
+    producer.join();
+    readers[0].join();
+    readers[1].join();
+
+    printf("%u frames: %lu/%lu received, %lu/%lu overruns ", frames,
+        subscribers[0].received, subscribers[1].received,
+        subscribers[0].overruns, subscribers[1].overruns);
+    for (int r = 0; r < 2; r++) {
+        assert(corrupt[r] == 0);
+        assert(out_of_order[r] == 0);
+        assert(subscribers[r].received + subscribers[r].overruns == frames);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    printf("Running testIndependentSubscribers()... ");
+    testIndependentSubscribers();
+    printf("Passed\n");
+    printf("Running testOverrun()... ");
+    testOverrun();
+    printf("Passed\n");
+    printf("Running testStress()... ");
+    testStress(5000000);
+    printf("Passed\n");
+}
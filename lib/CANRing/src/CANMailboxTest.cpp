@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <thread>
+#include <atomic>
+#include <CANMailbox.h>
+
+// Shaped like a CANFrame so a torn copy shows up in the payload check
+struct TestFrame {
+    uint32_t sequence;
+    uint8_t data[8];
+    uint32_t check;
+};
+
+static TestFrame makeFrame(uint32_t sequence) {
+    TestFrame frame;
+    frame.sequence = sequence;
+    for (int i = 0; i < 8; i++) {
+        frame.data[i] = (uint8_t)(sequence >> (i % 4 * 8));
+    }
+    frame.check = ~sequence;
+    return frame;
+}
+
+static bool frameIntact(const TestFrame& frame) {
+    TestFrame expected = makeFrame(frame.sequence);
+    return memcmp(frame.data, expected.data, sizeof(frame.data)) == 0 && frame.check == expected.check;
+}
+
+void testUpdateLatest() {
+    CANMailbox<TestFrame, 8> mailbox;
+    TestFrame frame;
+
+    assert(!mailbox.latest(0x7df, frame));
+    assert(mailbox.updates(0x7df) == 0);
+
+    assert(mailbox.update(0x7df, makeFrame(1)));
+    assert(mailbox.update(0x7e8, makeFrame(2)));
+    assert(mailbox.update(0x7df, makeFrame(3)));
+
+    // Only the newest item per key is kept
+    assert(mailbox.latest(0x7df, frame));
+    assert(frame.sequence == 3);
+    assert(mailbox.latest(0x7e8, frame));
+    assert(frame.sequence == 2);
+    assert(mailbox.updates(0x7df) == 2);
+    assert(mailbox.size() == 2);
+
+    // Id 0 is a key like any other
+    assert(mailbox.update(0, makeFrame(4)));
+    assert(mailbox.latest(0, frame));
+    assert(frame.sequence == 4);
+}
+
+void testFull() {
+    CANMailbox<TestFrame, 4> mailbox;
+    TestFrame frame;
+
+    for (uint32_t key = 0; key < 4; key++) {
+        assert(mailbox.update(key * 0x100, makeFrame(key)));
+    }
+
+    // A new key has nowhere to go, known keys still update
+    assert(!mailbox.update(0x400, makeFrame(4)));
+    assert(mailbox.misses() == 1);
+    assert(!mailbox.latest(0x400, frame));
+    assert(mailbox.update(0x300, makeFrame(5)));
+    assert(mailbox.latest(0x300, frame));
+    assert(frame.sequence == 5);
+
+    for (uint32_t key = 0; key < 3; key++) {
+        assert(mailbox.latest(key * 0x100, frame));
+        assert(frame.sequence == key);
+    }
+}
+
+// One producer rewriting a few keys while a reader polls them. Every copy must
+// be intact, belong to its key, and never go back in time.
+void testStress(uint32_t frames) {
+    static CANMailbox<TestFrame, 16> mailbox;
+    const uint32_t keys = 5;
+    std::atomic<bool> done(false);
+    uint32_t reads = 0;
+    uint32_t corrupt = 0;
+    uint32_t wrong_key = 0;
+    uint32_t backwards = 0;
+
+    std::thread producer([&]() {
+        for (uint32_t i = 0; i < frames; i++) {
+            mailbox.update(0x7e0 + i % keys, makeFrame(i));
+        }
+        done.store(true);
+    });
+
+    std::thread reader([&]() {
+        uint32_t last[keys] = {0};
+        TestFrame frame;
+        while (!done.load()) {
+            for (uint32_t key = 0; key < keys; key++) {
+                if (!mailbox.latest(0x7e0 + key, frame)) {
+                    continue;
+                }
+                if (!frameIntact(frame)) {
+                    corrupt++;
+                }
+                if (frame.sequence % keys != key) {
+                    wrong_key++;
+                }
+                if (frame.sequence < last[key]) {
+                    backwards++;
+                }
+                last[key] = frame.sequence;
+                reads++;
+            }
+        }
+    });
+
+    producer.join();
+    reader.join();
+
+    printf("%u updates: %u reads ", frames, reads);
+    assert(corrupt == 0);
+    assert(wrong_key == 0);
+    assert(backwards == 0);
+    assert(mailbox.size() == keys);
+    assert(mailbox.misses() == 0);
+}
+
+int main(int argc, char *argv[]) {
+    printf("Running testUpdateLatest()... ");
+    testUpdateLatest();
+    printf("Passed\n");
+    printf("Running testFull()... ");
+    testFull();
+    printf("Passed\n");
+    printf("Running testStress()... ");
+    testStress(5000000);
+    printf("Passed\n");
+}
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <thread>
+#include <CANRing.h>
+
+// Shaped like a CANFrame so a torn copy shows up in the payload check
+struct TestFrame {
+    uint32_t sequence;
+    uint8_t data[8];
+    uint32_t check;
+};
+
+static TestFrame makeFrame(uint32_t sequence) {
+    TestFrame frame;
+    frame.sequence = sequence;
+    for (int i = 0; i < 8; i++) {
+        frame.data[i] = (uint8_t)(sequence >> (i % 4 * 8));
+    }
+    frame.check = ~sequence;
+    return frame;
+}
+
+static bool frameIntact(const TestFrame& frame) {
+    TestFrame expected = makeFrame(frame.sequence);
+    return memcmp(frame.data, expected.data, sizeof(frame.data)) == 0 && frame.check == expected.check;
+}
+
+void testPushPop() {
+    CANRing<TestFrame, 8> ring;
+    TestFrame frame;
+
+    assert(ring.empty());
+    assert(!ring.pop(frame));
+
+    // Every slot is usable, the ninth push overflows
+    for (uint32_t i = 0; i < 8; i++) {
+        assert(ring.push(makeFrame(i)));
+    }
+    assert(ring.size() == 8);
+    assert(!ring.push(makeFrame(8)));
+    assert(ring.overflows() == 1);
+    assert(ring.pushed() == 8);
+    assert(ring.highWatermark() == 8);
+
+    for (uint32_t i = 0; i < 8; i++) {
+        assert(ring.pop(frame));
+        assert(frame.sequence == i);
+    }
+    assert(ring.empty());
+
+    // Run the indices around the mask many times
+    for (uint32_t i = 0; i < 1000; i++) {
+        assert(ring.push(makeFrame(i)));
+        assert(ring.pop(frame));
+        assert(frame.sequence == i);
+    }
+}
+
+void testHighWatermark() {
+    CANRing<TestFrame, 8> ring;
+    TestFrame frame;
+
+    assert(ring.highWatermark() == 0);
+
+    // Tracks the deepest point, not the current depth
+    for (uint32_t i = 0; i < 5; i++) {
+        ring.push(makeFrame(i));
+    }
+    ring.consume(4);
+    ring.push(makeFrame(5));
+    assert(ring.size() == 2);
+    assert(ring.highWatermark() == 5);
+
+    ring.clear();
+    for (uint32_t i = 0; i < 100; i++) {
+        ring.push(makeFrame(i));
+        ring.pop(frame);
+    }
+    assert(ring.highWatermark() == 5);
+}
+
+void testNewestAndClear() {
+    CANRing<TestFrame, 4> ring;
+    TestFrame frame;
+
+    assert(!ring.newest(frame));
+    ring.push(makeFrame(1));
+    ring.push(makeFrame(2));
+    ring.push(makeFrame(3));
+    assert(ring.newest(frame));
+    assert(frame.sequence == 3);
+    assert(ring.size() == 3);
+
+    ring.clear();
+    assert(ring.empty());
+    assert(!ring.newest(frame));
+
+    // Still usable after a clear with the indices mid-way round
+    for (uint32_t i = 10; i < 14; i++) {
+        assert(ring.push(makeFrame(i)));
+    }
+    assert(ring.pop(frame));
+    assert(frame.sequence == 10);
+}
+
+void testPeekConsume() {
+    CANRing<TestFrame, 4> ring;
+
+    assert(ring.peek() == nullptr);
+    assert(ring.consume(1) == 0);
+
+    for (uint32_t i = 0; i < 3; i++) {
+        ring.push(makeFrame(i));
+    }
+
+    // Peeking leaves everything queued
+    assert(ring.peek()->sequence == 0);
+    assert(ring.peek(2)->sequence == 2);
+    assert(ring.peek(3) == nullptr);
+    assert(ring.size() == 3);
+
+    assert(ring.consume(2) == 2);
+    assert(ring.peek()->sequence == 2);
+
+    // Consumed slots are free again, the peeked one is not
+    assert(ring.push(makeFrame(3)));
+    assert(ring.push(makeFrame(4)));
+    assert(ring.push(makeFrame(5)));
+    assert(!ring.push(makeFrame(6)));
+    assert(ring.peek()->sequence == 2);
+
+    // Only what is queued gets consumed
+    assert(ring.consume(10) == 4);
+    assert(ring.empty());
+}
+
+// One producer and one consumer hammering the ring. Every frame must arrive
+// once, in order and intact, or be counted as an overflow.
+void testStress(uint32_t frames) {
+    static CANRing<TestFrame, 32> ring;
+    uint32_t received = 0;
+    uint32_t gaps = 0;
+    uint32_t corrupt = 0;
+    uint32_t out_of_order = 0;
+
+    std::thread producer([&]() {
+        for (uint32_t i = 0; i < frames; i++) {
+            ring.push(makeFrame(i));
+            if (i % 64 == 0) {
+                std::this_thread::yield(); // Let the consumer fall behind and catch up
+            }
+        }
+    });
+
+    std::thread consumer([&]() {
+        uint32_t expected = 0;
+        TestFrame frame;
+        while (expected < frames) {
+            if (!ring.pop(frame)) {
+                if (ring.pushed() + ring.overflows() == frames && ring.empty()) {
+                    break; // Producer is done and everything is drained
+                }
+                continue;
+            }
+            if (!frameIntact(frame)) {
+                corrupt++;
+            }
+            if (frame.sequence < expected) {
+                out_of_order++; // Duplicate or reordered
+            } else {
+                gaps += frame.sequence - expected;
+                expected = frame.sequence + 1;
+            }
+            received++;
+        }
+        gaps += frames - expected;
+    });
+
+    producer.join();
+    consumer.join();
+
+    printf("%u frames: %u received, %lu overflows ", frames, received, ring.overflows());
+    assert(corrupt == 0);
+    assert(out_of_order == 0);
+    assert(received == ring.pushed());
+    assert(received + ring.overflows() == frames);
+    assert(gaps == ring.overflows());
+}
+
+int main(int argc, char *argv[]) {
+    printf("Running testPushPop()... ");
+    testPushPop();
+    printf("Passed\n");
+    printf("Running testHighWatermark()... ");
+    testHighWatermark();
+    printf("Passed\n");
+    printf("Running testNewestAndClear()... ");
+    testNewestAndClear();
+    printf("Passed\n");
+    printf("Running testPeekConsume()... ");
+    testPeekConsume();
+    printf("Passed\n");
+    printf("Running testStress()... ");
+    testStress(5000000);
+    printf("Passed\n");
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <assert.h>
+#include <thread>
+#include <atomic>
+#include <CANSeqlock.h>
+
+// Every field derives from sequence, so a mixed copy shows up
+struct TestStats {
+    uint32_t sequence;
+    uint32_t buckets[8];
+    uint64_t total;
+};
+
+static bool statsConsistent(const TestStats& stats) {
+    for (int i = 0; i < 8; i++) {
+        if (stats.buckets[i] != stats.sequence + i) {
+            return false;
+        }
+    }
+    return stats.total == (uint64_t)stats.sequence * 3;
+}
+
+static void writeStats(CANSeqlock<TestStats>& seqlock, uint32_t sequence) {
+    TestStats& stats = seqlock.beginWrite();
+    stats.sequence = sequence;
+    for (int i = 0; i < 8; i++) {
+        stats.buckets[i] = sequence + i;
+    }
+    stats.total = (uint64_t)sequence * 3;
+    seqlock.endWrite();
+}
+
+void testLoad() {
+    CANSeqlock<TestStats> seqlock;
+
+    assert(seqlock.load().sequence == 0);
+
+    writeStats(seqlock, 7);
+    TestStats stats = seqlock.load();
+    assert(stats.sequence == 7);
+    assert(statsConsistent(stats));
+    assert(seqlock.peek().total == 21);
+}
+
+// One writer updating nonstop while a reader copies. Every copy must be whole
+// and no older than the one before it. Both start together and the writer
+// keeps going until the reader has made more copies than there were writes,
+// so every copy raced a write.
+void testStress(uint32_t writes) {
+    static CANSeqlock<TestStats> seqlock;
+    std::atomic<int> ready(0);
+    std::atomic<bool> done(false);
+    std::atomic<uint32_t> reads(0);
+    uint32_t written = 0;
+    uint32_t torn = 0;
+    uint32_t backwards = 0;
+
+    writeStats(seqlock, 0);
+
+    std::thread writer([&]() {
+        ready++;
+        while (ready.load() < 2) { }
+        uint32_t i = 0;
+        while (i < writes || reads.load(std::memory_order_relaxed) <= writes) {
+            writeStats(seqlock, ++i);
+        }
+        written = i;
+        done.store(true);
+    });
+
+    std::thread reader([&]() {
+        ready++;
+        while (ready.load() < 2) { }
+        uint32_t last = 0;
+        while (!done.load()) {
+            TestStats stats = seqlock.load();
+            if (!statsConsistent(stats)) {
+                torn++;
+            }
+            if (stats.sequence < last) {
+                backwards++;
+            }
+            last = stats.sequence;
+            reads.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+
+    writer.join();
+    reader.join();
+
+    printf("%u writes: %u reads ", written, reads.load());
+    assert(reads.load() > writes);
+    assert(torn == 0);
+    assert(backwards == 0);
+    assert(seqlock.load().sequence == written);
+}
+
+int main(int argc, char *argv[]) {
+    printf("Running testLoad()... ");
+    testLoad();
+    printf("Passed\n");
+    printf("Running testStress()... ");
+    testStress(5000000);
+    printf("Passed\n");
+}
@@ -0,0 +1,97 @@
+// vim: ts=4:sw=4:et
+
+#ifndef CAN_ROUTER_H
+#define CAN_ROUTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+// Where a routed frame goes. Duplicate sends it on and also back onto the
+// bus it came from, so a remapped copy can be seen on both.
+#define CAN_ROUTE_DROP      0x00
+#define CAN_ROUTE_FORWARD   0x01
+#define CAN_ROUTE_ECHO      0x02
+#define CAN_ROUTE_DUPLICATE (CAN_ROUTE_FORWARD | CAN_ROUTE_ECHO)
+
+// Routes are per direction of the proxy
+#define CAN_ROUTE_CAN1_TO_CAN2 0
+#define CAN_ROUTE_CAN2_TO_CAN1 1
+#define CAN_ROUTER_DIRECTIONS 2
+
+#define CAN_ROUTE_KEEP_ID 0xFFFFFFFF
+
+#define CAN_ROUTER_STANDARD_IDS 2048
+#define CAN_ROUTER_MAX_ROUTES 64
+// Extended id hash slots per direction, a power of two well above the routes
+#define CAN_ROUTER_EXTENDED_SLOTS 128
+
+// One id in one direction
+struct CANRoute {
+    uint32_t id;
+    bool is_extended;
+    uint8_t direction;  // CAN_ROUTE_CAN1_TO_CAN2 or CAN_ROUTE_CAN2_TO_CAN1
+    uint8_t targets;    // CAN_ROUTE_* bits
+    uint32_t remap_id;  // New id, same format, or CAN_ROUTE_KEEP_ID
+    uint8_t mask[8];    // Data bits replaced by the same bits of data, all zero = no patch
+    uint8_t data[8];
+};
+
+// Decides per frame whether the proxy drops, forwards or duplicates it, and
+// rewrites its id and data on the way. A rule list is compiled into a bank:
+// standard ids index a 2048-entry table per direction directly, extended ids
+// are looked up in an open addressed hash, so route() is O(1) and never
+// allocates. A new rule list is compiled into the spare bank and swapped in
+// whole, route() sees either the old rules or the new ones, never a mix.
+// route() runs on one thread (the forwarding task), the setters on another.
+class CANRouter {
+public:
+    CANRouter(uint8_t default_targets = CAN_ROUTE_FORWARD);
+
+    // Replaces every route, ids without one get default_targets unchanged.
+    // Returns 1, -1 for too many routes, -2 for a bad or repeated route.
+    int setRoutes(const CANRoute* routes, size_t count, uint8_t default_targets = CAN_ROUTE_FORWARD);
+
+    // A JSON or MsgPack rule file, see README. Returns 1, -3 if it doesn't
+    // parse, or setRoutes()'s errors.
+    int load(const char* document, size_t length, bool msgpack = false);
+#ifdef ARDUINO
+    int load(Stream& input, bool msgpack = false);
+#endif
+
+    // Forwarding task only. Rewrites id and data in place, returns CAN_ROUTE_* bits.
+    uint8_t route(uint8_t direction, uint32_t& id, bool is_extended, uint8_t* data) const;
+
+    // Routes in the active bank
+    size_t size() const { return _banks[_active.load()].count; }
+    static constexpr size_t capacity() { return CAN_ROUTER_MAX_ROUTES; }
+
+private:
+    struct ExtendedSlot {
+        uint32_t id;
+        uint8_t route; // Index into routes
+    };
+
+    struct Bank {
+        // Index into routes plus one, 0 = default
+        uint8_t standard[CAN_ROUTER_DIRECTIONS][CAN_ROUTER_STANDARD_IDS];
+        ExtendedSlot extended[CAN_ROUTER_DIRECTIONS][CAN_ROUTER_EXTENDED_SLOTS];
+        CANRoute routes[CAN_ROUTER_MAX_ROUTES];
+        size_t count;
+        uint8_t fallback;
+    };
+
+    static const uint32_t EMPTY = 0xFFFFFFFF;
+
+    static uint32_t _hash(uint32_t id);
+
+    Bank _banks[2];
+    std::atomic<uint8_t> _active;
+    mutable std::atomic<uint8_t> _routing; // Bank route() is in, plus one, 0 = none
+};
+
+#endif // CAN_ROUTER_H
@@ -0,0 +1,254 @@
+// vim: ts=4:sw=4:et
+
+#include <CANRouter.h>
+#include <ArduinoJson.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CAN_ROUTER_STANDARD_MAX 0x7FFUL
+#define CAN_ROUTER_EXTENDED_MAX 0x1FFFFFFFUL
+
+static const char* directionNames[CAN_ROUTER_DIRECTIONS] = { "can1_to_can2", "can2_to_can1" };
+
+CANRouter::CANRouter(uint8_t default_targets) : _active(0), _routing(0) {
+    for (int bank = 0; bank < 2; bank++) {
+        memset(_banks[bank].standard, 0, sizeof(_banks[bank].standard));
+        for (int direction = 0; direction < CAN_ROUTER_DIRECTIONS; direction++) {
+            for (size_t slot = 0; slot < CAN_ROUTER_EXTENDED_SLOTS; slot++) {
+                _banks[bank].extended[direction][slot].id = EMPTY;
+            }
+        }
+        _banks[bank].count = 0;
+        _banks[bank].fallback = default_targets;
+    }
+}
+
+uint32_t CANRouter::_hash(uint32_t id) {
+    uint32_t hash = id * 0x9E3779B1u;
+    return hash ^ (hash >> 16);
+}
+
+int CANRouter::setRoutes(const CANRoute* routes, size_t count, uint8_t default_targets) {
+    if (count > CAN_ROUTER_MAX_ROUTES) {
+        return -1;
+    }
+
+    uint8_t next = 1 - _active.load();
+
+    // route() may still be in the spare bank from before the last swap
+    while (_routing.load() == next + 1) { }
+
+    Bank& bank = _banks[next];
+    memset(bank.standard, 0, sizeof(bank.standard));
+    for (int direction = 0; direction < CAN_ROUTER_DIRECTIONS; direction++) {
+        for (size_t slot = 0; slot < CAN_ROUTER_EXTENDED_SLOTS; slot++) {
+            bank.extended[direction][slot].id = EMPTY;
+        }
+    }
+    bank.count = 0;
+    bank.fallback = default_targets;
+
+    for (size_t i = 0; i < count; i++) {
+        const CANRoute& route = routes[i];
+        uint32_t max_id = route.is_extended ? CAN_ROUTER_EXTENDED_MAX : CAN_ROUTER_STANDARD_MAX;
+        if (route.direction >= CAN_ROUTER_DIRECTIONS || route.targets > CAN_ROUTE_DUPLICATE ||
+                route.id > max_id || (route.remap_id != CAN_ROUTE_KEEP_ID && route.remap_id > max_id)) {
+            return -2;
+        }
+
+        if (!route.is_extended) {
+            uint8_t& entry = bank.standard[route.direction][route.id];
+            if (entry) {
+                return -2;
+            }
+            entry = (uint8_t)(i + 1);
+        } else {
+            ExtendedSlot* table = bank.extended[route.direction];
+            uint32_t hash = _hash(route.id);
+            size_t probe = 0;
+            for (; probe < CAN_ROUTER_EXTENDED_SLOTS; probe++) {
+                ExtendedSlot& slot = table[(hash + probe) & (CAN_ROUTER_EXTENDED_SLOTS - 1)];
+                if (slot.id == route.id) {
+                    return -2;
+                }
+                if (slot.id == EMPTY) {
+                    slot.id = route.id;
+                    slot.route = (uint8_t)i;
+                    break;
+                }
+            }
+        }
+
+        bank.routes[i] = route;
+        bank.count++;
+    }
+
+    _active.store(next);
+    return 1;
+}
+
+uint8_t CANRouter::route(uint8_t direction, uint32_t& id, bool is_extended, uint8_t* data) const {
+    // Claim the active bank, and make sure it was still active once claimed
+    uint8_t active;
+    do {
+        active = _active.load();
+        _routing.store(active + 1);
+    } while (_active.load() != active);
+
+    const Bank& bank = _banks[active];
+    const CANRoute* route = nullptr;
+    direction &= CAN_ROUTER_DIRECTIONS - 1;
+
+    if (!is_extended) {
+        uint8_t entry = bank.standard[direction][id & CAN_ROUTER_STANDARD_MAX];
+        if (entry) {
+            route = &bank.routes[entry - 1];
+        }
+    } else {
+        const ExtendedSlot* table = bank.extended[direction];
+        uint32_t hash = _hash(id);
+        for (size_t probe = 0; probe < CAN_ROUTER_EXTENDED_SLOTS; probe++) {
+            const ExtendedSlot& slot = table[(hash + probe) & (CAN_ROUTER_EXTENDED_SLOTS - 1)];
+            if (slot.id == id) {
+                route = &bank.routes[slot.route];
+                break;
+            }
+            if (slot.id == EMPTY) {
+                break;
+            }
+        }
+    }
+
+    uint8_t targets = bank.fallback;
+    if (route) {
+        targets = route->targets;
+        if (route->remap_id != CAN_ROUTE_KEEP_ID) {
+            id = route->remap_id;
+        }
+        for (int i = 0; i < 8; i++) {
+            data[i] = (data[i] & ~route->mask[i]) | (route->data[i] & route->mask[i]);
+        }
+    }
+
+    _routing.store(0);
+    return targets;
+}
+
+// Ids are numbers or strings like "0x7DF"
+static bool parseId(JsonVariantConst value, uint32_t& id) {
+    if (value.is<uint32_t>()) {
+        id = value.as<uint32_t>();
+        return true;
+    }
+
+    const char* text = value.as<const char*>();
+    if (!text || !*text) {
+        return false;
+    }
+    char* end;
+    unsigned long parsed = strtoul(text, &end, 0);
+    if (*end || parsed > 0xFFFFFFFFUL) {
+        return false;
+    }
+    id = (uint32_t)parsed;
+    return true;
+}
+
+static bool parseTargets(const char* action, uint8_t& targets) {
+    if (!strcmp(action, "drop")) {
+        targets = CAN_ROUTE_DROP;
+    } else if (!strcmp(action, "forward")) {
+        targets = CAN_ROUTE_FORWARD;
+    } else if (!strcmp(action, "echo")) {
+        targets = CAN_ROUTE_ECHO;
+    } else if (!strcmp(action, "duplicate")) {
+        targets = CAN_ROUTE_DUPLICATE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parseBytes(JsonVariantConst value, uint8_t* bytes) {
+    if (value.isNull()) {
+        return true;
+    }
+
+    JsonArrayConst array = value.as<JsonArrayConst>();
+    if (array.isNull() || array.size() > 8) {
+        return false;
+    }
+    size_t i = 0;
+    for (JsonVariantConst byte : array) {
+        if (!byte.is<uint8_t>()) {
+            return false;
+        }
+        bytes[i++] = byte.as<uint8_t>();
+    }
+    return true;
+}
+
+// Parsing happens once per load, only the compiled bank is used per frame
+static int compileDocument(CANRouter& router, const JsonDocument& document) {
+    uint8_t fallback;
+    if (!parseTargets(document["default"] | "forward", fallback)) {
+        return -2;
+    }
+
+    size_t count = 0;
+    for (int direction = 0; direction < CAN_ROUTER_DIRECTIONS; direction++) {
+        count += document[directionNames[direction]].size();
+    }
+    if (count > CAN_ROUTER_MAX_ROUTES) {
+        return -1;
+    }
+
+    CANRoute* routes = new CANRoute[count > 0 ? count : 1];
+    size_t i = 0;
+    int result = 1;
+    for (int direction = 0; direction < CAN_ROUTER_DIRECTIONS && result == 1; direction++) {
+        for (JsonObjectConst rule : document[directionNames[direction]].as<JsonArrayConst>()) {
+            CANRoute& route = routes[i++];
+            memset(&route, 0, sizeof(route));
+            route.direction = (uint8_t)direction;
+            route.is_extended = rule["extended"] | false;
+            route.remap_id = CAN_ROUTE_KEEP_ID;
+
+            if (!parseId(rule["id"], route.id) ||
+                    !parseTargets(rule["action"] | "forward", route.targets) ||
+                    (!rule["remap"].isNull() && !parseId(rule["remap"], route.remap_id)) ||
+                    !parseBytes(rule["mask"], route.mask) ||
+                    !parseBytes(rule["data"], route.data)) {
+                result = -2;
+                break;
+            }
+        }
+    }
+
+    if (result == 1) {
+        result = router.setRoutes(routes, i, fallback);
+    }
+    delete[] routes;
+    return result;
+}
+
+int CANRouter::load(const char* document, size_t length, bool msgpack) {
+    JsonDocument json;
+    DeserializationError error = msgpack ? deserializeMsgPack(json, document, length)
+                                         : deserializeJson(json, document, length);
+    if (error) {
+        return -3;
+    }
+    return compileDocument(*this, json);
+}
+
+#ifdef ARDUINO
+int CANRouter::load(Stream& input, bool msgpack) {
+    JsonDocument json;
+    DeserializationError error = msgpack ? deserializeMsgPack(json, input) : deserializeJson(json, input);
+    if (error) {
+        return -3;
+    }
+    return compileDocument(*this, json);
+}
+#endif
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <thread>
+#include <atomic>
+#include <CANRouter.h>
+#include <ArduinoJson.h>
+
+static CANRoute makeRoute(uint8_t direction, uint32_t id, bool is_extended, uint8_t targets) {
+    CANRoute route;
+    memset(&route, 0, sizeof(route));
+    route.id = id;
+    route.is_extended = is_extended;
+    route.direction = direction;
+    route.targets = targets;
+    route.remap_id = CAN_ROUTE_KEEP_ID;
+    return route;
+}
+
+void testStandard() {
+    CANRouter router;
+    uint8_t data[8] = { 0x02, 0x01, 0x0C, 0, 0, 0, 0, 0 };
+    uint32_t id = 0x7DF;
+
+    // Everything is forwarded unchanged until told otherwise
+    assert(router.route(CAN_ROUTE_CAN1_TO_CAN2, id, false, data) == CAN_ROUTE_FORWARD);
+    assert(id == 0x7DF);
+
+    CANRoute routes[3] = {
+        makeRoute(CAN_ROUTE_CAN1_TO_CAN2, 0x7DF, false, CAN_ROUTE_DROP),
+        makeRoute(CAN_ROUTE_CAN1_TO_CAN2, 0x7E0, false, CAN_ROUTE_FORWARD),
+        makeRoute(CAN_ROUTE_CAN2_TO_CAN1, 0x7E8, false, CAN_ROUTE_DUPLICATE),
+    };
+    routes[1].remap_id = 0x7E1;
+    routes[2].mask[2] = 0xF0;
+    routes[2].data[2] = 0xA5;
+    assert(router.setRoutes(routes, 3, CAN_ROUTE_DROP) == 1);
+    assert(router.size() == 3);
+
+    id = 0x7DF;
+    assert(router.route(CAN_ROUTE_CAN1_TO_CAN2, id, false, data) == CAN_ROUTE_DROP);
+
+    id = 0x7E0;
+    assert(router.route(CAN_ROUTE_CAN1_TO_CAN2, id, false, data) == CAN_ROUTE_FORWARD);
+    assert(id == 0x7E1);
+
+    // Only the masked bits change
+    id = 0x7E8;
+    assert(router.route(CAN_ROUTE_CAN2_TO_CAN1, id, false, data) == CAN_ROUTE_DUPLICATE);
+    assert(id == 0x7E8);
+    assert(data[2] == 0xAC);
+    assert(data[1] == 0x01);
+
+    // Routes belong to one direction, and other ids get the default
+    id = 0x7E8;
+    assert(router.route(CAN_ROUTE_CAN1_TO_CAN2, id, false, data) == CAN_ROUTE_DROP);
+    id = 0x123;
+    assert(router.route(CAN_ROUTE_CAN2_TO_CAN1, id, false, data) == CAN_ROUTE_DROP);
+}
+
+void testExtended() {
+    CANRouter router;
+    uint8_t data[8] = {0};
+    CANRoute routes[CAN_ROUTER_MAX_ROUTES];
+
+    // Enough ids to collide in the hash
+    for (uint32_t i = 0; i < CAN_ROUTER_MAX_ROUTES; i++) {
+        routes[i] = makeRoute(CAN_ROUTE_CAN2_TO_CAN1, 0x18DA00F1 + (i << 8), true, CAN_ROUTE_FORWARD);
+        routes[i].remap_id = 0x18DB0000 + i;
+    }
+    assert(router.setRoutes(routes, CAN_ROUTER_MAX_ROUTES, CAN_ROUTE_DROP) == 1);
+
+    for (uint32_t i = 0; i < CAN_ROUTER_MAX_ROUTES; i++) {
+        uint32_t id = 0x18DA00F1 + (i << 8);
+        assert(router.route(CAN_ROUTE_CAN2_TO_CAN1, id, true, data) == CAN_ROUTE_FORWARD);
+        assert(id == 0x18DB0000 + i);
+    }
+
+    // Same number as a standard id, or in the other direction, is a different route
+    uint32_t id = 0x18DA00F1;
+    assert(router.route(CAN_ROUTE_CAN1_TO_CAN2, id, true, data) == CAN_ROUTE_DROP);
+    id = 0x7F1;
+    assert(router.route(CAN_ROUTE_CAN2_TO_CAN1, id, false, data) == CAN_ROUTE_DROP);
+}
+
+void testErrors() {
+    CANRouter router;
+    CANRoute routes[CAN_ROUTER_MAX_ROUTES + 1];
+    for (uint32_t i = 0; i <= CAN_ROUTER_MAX_ROUTES; i++) {
+        routes[i] = makeRoute(CAN_ROUTE_CAN1_TO_CAN2, i, false, CAN_ROUTE_FORWARD);
+    }
+    assert(router.setRoutes(routes, CAN_ROUTER_MAX_ROUTES + 1) == -1);
+
+    CANRoute repeated[2] = {
+        makeRoute(CAN_ROUTE_CAN1_TO_CAN2, 0x7E0, false, CAN_ROUTE_FORWARD),
+        makeRoute(CAN_ROUTE_CAN1_TO_CAN2, 0x7E0, false, CAN_ROUTE_DROP),
+    };
+    assert(router.setRoutes(repeated, 2) == -2);
+    repeated[0].is_extended = repeated[1].is_extended = true;
+    assert(router.setRoutes(repeated, 2) == -2);
+
+    CANRoute bad = makeRoute(CAN_ROUTE_CAN1_TO_CAN2, 0x800, false, CAN_ROUTE_FORWARD);
+    assert(router.setRoutes(&bad, 1) == -2);
+    bad.id = 0x7E0;
+    bad.remap_id = 0x800;
+    assert(router.setRoutes(&bad, 1) == -2);
+
+    // A failed compile leaves the old routes in place
+    assert(router.size() == 0);
+    uint32_t id = 0x7E0;
+    uint8_t data[8] = {0};
+    assert(router.route(CAN_ROUTE_CAN1_TO_CAN2, id, false, data) == CAN_ROUTE_FORWARD);
+}
+
+void testLoad() {
+    CANRouter router;
+    const char* json = R"({
+        "default": "drop",
+        "can1_to_can2": [
+            { "id": "0x7DF" },
+            { "id": "0x7E0", "remap": "0x7E1" },
+            { "id": "0x18DB33F1", "extended": true, "action": "duplicate" }
+        ],
+        "can2_to_can1": [
+            { "id": 2024, "action": "forward", "mask": [0, 0, 255], "data": [0, 0, 66] }
+        ]
+    })";
+    assert(router.load(json, strlen(json)) == 1);
+    assert(router.size() == 4);
+
+    uint8_t data[8] = {0};
+    uint32_t id = 0x7DF;
+    assert(router.route(CAN_ROUTE_CAN1_TO_CAN2, id, false, data) == CAN_ROUTE_FORWARD);
+    id = 0x7E0;
+    assert(router.route(CAN_ROUTE_CAN1_TO_CAN2, id, false, data) == CAN_ROUTE_FORWARD);
+    assert(id == 0x7E1);
+    id = 0x18DB33F1;
+    assert(router.route(CAN_ROUTE_CAN1_TO_CAN2, id, true, data) == CAN_ROUTE_DUPLICATE);
+    id = 0x7E8;
+    assert(router.route(CAN_ROUTE_CAN2_TO_CAN1, id, false, data) == CAN_ROUTE_FORWARD);
+    assert(data[2] == 66);
+    id = 0x7E9;
+    assert(router.route(CAN_ROUTE_CAN2_TO_CAN1, id, false, data) == CAN_ROUTE_DROP);
+
+    // The same rules as MsgPack
+    JsonDocument document;
+    deserializeJson(document, json);
+    char packed[256];
+    size_t length = serializeMsgPack(document, packed, sizeof(packed));
+    CANRouter packed_router;
+    assert(packed_router.load(packed, length, true) == 1);
+    assert(packed_router.size() == 4);
+
+    const char* broken = R"({ "can1_to_can2": [ { "id": "0x7DF" )";
+    assert(router.load(broken, strlen(broken)) == -3);
+    const char* unknown = R"({ "can1_to_can2": [ { "id": "0x7DF", "action": "bounce" } ] })";
+    assert(router.load(unknown, strlen(unknown)) == -2);
+    const char* no_id = R"({ "can1_to_can2": [ { "action": "drop" } ] })";
+    assert(router.load(no_id, strlen(no_id)) == -2);
+    const char* long_mask = R"({ "can1_to_can2": [ { "id": 1, "mask": [1,2,3,4,5,6,7,8,9] } ] })";
+    assert(router.load(long_mask, strlen(long_mask)) == -2);
+    assert(router.size() == 4);
+}
+
+// One thread routing while another keeps swapping between two rule sets. Each
+// frame must be routed entirely by one set, never by half of each.
+void testStress(uint32_t swaps) {
+    static CANRouter router;
+    static CANRoute sets[2][8];
+    std::atomic<bool> done(false);
+    uint32_t routed = 0;
+    uint32_t mixed = 0;
+
+    for (uint32_t set = 0; set < 2; set++) {
+        for (uint32_t i = 0; i < 8; i++) {
+            bool is_extended = i % 2;
+            CANRoute& route = sets[set][i];
+            route = makeRoute(CAN_ROUTE_CAN1_TO_CAN2, is_extended ? 0x18DA0000 + i : 0x700 + i, is_extended,
+                set ? CAN_ROUTE_DUPLICATE : CAN_ROUTE_FORWARD);
+            route.remap_id = is_extended ? 0x18DB0000 + set : 0x600 + set;
+            for (int b = 0; b < 8; b++) {
+                route.mask[b] = 0xFF;
+                route.data[b] = (uint8_t)(set * 0x10 + b);
+            }
+        }
+    }
+
+    // Routed before any set is loaded, a frame would match neither
+    assert(router.setRoutes(sets[0], 8) == 1);
+
+    std::thread router_thread([&]() {
+        uint8_t data[8];
+        while (!done.load()) {
+            for (uint32_t i = 0; i < 8; i++) {
+                bool is_extended = i % 2;
+                uint32_t id = is_extended ? 0x18DA0000 + i : 0x700 + i;
+                uint8_t targets = router.route(CAN_ROUTE_CAN1_TO_CAN2, id, is_extended, data);
+                uint32_t set = targets == CAN_ROUTE_DUPLICATE ? 1 : 0;
+                bool consistent = (id & 0xF) == set;
+                for (int b = 0; b < 8; b++) {
+                    consistent = consistent && data[b] == (uint8_t)(set * 0x10 + b);
+                }
+                if (!consistent) {
+                    mixed++;
+                }
+                routed++;
+            }
+        }
+    });
+
+    std::thread loader([&]() {
+        for (uint32_t i = 0; i < swaps; i++) {
+            assert(router.setRoutes(sets[i % 2], 8) == 1);
+        }
+        done.store(true);
+    });
+
+    loader.join();
+    router_thread.join();
+
+    printf("%u swaps: %u frames routed ", swaps, routed);
+    assert(mixed == 0);
+}
+
+int main(int argc, char *argv[]) {
+    printf("Running testStandard()... ");
+    testStandard();
+    printf("Passed\n");
+    printf("Running testExtended()... ");
+    testExtended();
+    printf("Passed\n");
+    printf("Running testErrors()... ");
+    testErrors();
+    printf("Passed\n");
+    printf("Running testLoad()... ");
+    testLoad();
+    printf("Passed\n");
+    printf("Running testStress()... ");
+    testStress(20000);
+    printf("Passed\n");
+}
@@ -5,10 +5,19 @@
 
 #include <Arduino.h>
 #include <MCP2515.h>
+#include <CANRing.h>
+#include <CANMailbox.h>
+#include <CANFanout.h>
+#include <CANClassifier.h>
+#include <CANSeqlock.h>
 
 // Maximum number of CANStream instances supported
 #define MAX_CAN_STREAM_INSTANCES 4
 
+// Bits from the receive interrupt until the bus is idle: ACK slot and
+// delimiter, EOF and intermission
+#define CAN_SETTLE_BITS 12
+
 // Configuration for CAN controller
 struct CANConfig {
     // Index for reading/writing this instance's state data to the static store
@@ -29,6 +38,35 @@ struct CANConfig {
     // SPI mode configuration
     uint8_t spi_bit_order;  // SPI bit order (MSBFIRST or LSBFIRST)
     uint8_t spi_mode;       // SPI mode (SPI_MODE0, SPI_MODE1, SPI_MODE2, SPI_MODE3)
+
+    // Queued frames still unsent after this long are dropped or aborted, 0 = never
+    unsigned long tx_deadline_us;
+
+    // Hardware acceptance filter applied by begin(), nullptr = receive everything
+    const CANAcceptanceFilter* acceptance_filter;
+
+    // GPIO wired to the MCP2515 CLKOUT pin to count every frame on the bus, -1 = not wired
+    int sof_pin;
+
+    // Service the controller from a task pinned to rx_task_core instead of the
+    // GPIO ISR. 0 = do all the SPI work inside the ISR.
+    unsigned int rx_task_priority;
+    int rx_task_core;
+
+    // Arduino SPI or the ESP-IDF spi_master driver, the IDF one needs rx_task_priority > 0
+    MCP2515SPIBackend spi_backend;
+
+    // VSPI_HOST or HSPI_HOST. Controllers on separate hosts (and pins) are
+    // serviced in parallel, on a shared host they serialize behind each other.
+    spi_host_device_t spi_host;
+
+    // Bit sample point in permille (750 = 75%), the closest one the clock allows is used.
+    // Check a constexpr config with static_assert(mcp2515BitTiming(...).valid).
+    int sample_point;
+
+    // Tags every received frame with CAN_ACTION_* bits and drops the ones with none.
+    // Can be changed while running, nullptr = every frame gets CAN_ACTION_ALL.
+    CANClassifier* classifier;
 };
 
 // Frame data structure for CAN messages
@@ -39,26 +77,64 @@ struct CANConfig {
     // bool is_retransmit;
     // int data_len;
     // char data[8];
-    // unsigned long timestamp;
+    // int64_t timestamp;
 // };
 
 // For tuning purposes, scanner sends a frame about every 75-100 milliseconds
 // Only the most recent frame in the buffer gets processed, so the buffer can be small
+// Received frames live in the BufferedCANStream ring, which also counts what was received and dropped
 struct CANStreamState {
-    CANFrame frame_buffer[128];  // Static array instead of pointer
-	unsigned int delay_after_receive = 50; // microseconds
-    unsigned int frames_buffered = 0;
+    unsigned int settle_time_us = 0; // CAN_SETTLE_BITS at the configured baud rate
     unsigned int frames_processed = 0;
-    unsigned int dropped_frames = 0;
-    unsigned int frame_buffer_size = 20;
-    unsigned int buffer_head = 0;  // Ring buffer head index
-    unsigned int buffer_tail = 0;  // Ring buffer tail index
+    unsigned long frames_classified_drop = 0; // Never buffered
     unsigned long error_count = 0;
     unsigned long interrupt_count = 0;
-    unsigned long frames_received = 0;
     unsigned long frames_sent = 0;
+    unsigned long tx_latency_total_us = 0; // Queue to completion, completed frames only
+    unsigned long tx_latency_max_us = 0;
+};
+
+// Residency histogram, bucket n counts frames that left the ring less than
+// 2^(n+4) us after their INT edge, the last bucket counts everything slower
+#define CAN_RESIDENCY_BUCKETS 12
+
+// Frames that have left the receive ring, by read, consume or clear
+struct CANResidencyStats {
+    int64_t since; // esp_timer_get_time() when begin() started counting
+    unsigned long count;
+    uint64_t total_us;
+    unsigned long max_us;
+    unsigned long buckets[CAN_RESIDENCY_BUCKETS];
+};
+
+// Receive ring sizing snapshot, safe to take from any task while frames arrive
+struct CANQueueMetrics {
+    size_t depth;
+    size_t capacity;
+    size_t high_watermark;
+    float average_depth; // Time weighted since begin(): total residency / elapsed time
+    CANResidencyStats residency;
+};
+
+// Receive ring occupancy and totals
+struct CANBufferStats {
+    size_t size;
+    size_t capacity;
+    size_t high_watermark;
+    unsigned long pushed;
+    unsigned long overflows;
+    size_t mailbox_ids;      // Distinct ids in the latest-value table
+    size_t mailbox_capacity; // 0 = no table
+    unsigned long mailbox_misses;
 };
 
+// Mailbox key, standard and extended frames with the same id are different keys
+inline uint32_t canMailboxKey(unsigned long id, bool is_extended) {
+    return (uint32_t)(id & 0x1FFFFFFF) | (is_extended ? 0x80000000 : 0);
+}
+
+// Everything but the receive storage, which BufferedCANStream provides so each
+// instance can be sized for its bus
 class CANStream {
 private:
     MCP2515Class _can;
@@ -74,11 +150,44 @@ private:
     // Debug output
     static Stream* _debug;
     
+    // Instance callback function for queued transmit results
+    void _onTransmit(const CANTransmitResult& result);
+    
     // Internal methods
     void _handleInterrupt();
+
+    // Woken when frames are buffered or a queued transmit finishes
+    volatile TaskHandle_t _notify_task = nullptr;
+    void _notify();
+
+    // Written by the loop as frames leave the ring, read from anywhere
+    CANSeqlock<CANResidencyStats> _residency;
+    static void _addResidency(CANResidencyStats& stats, int64_t waited_us);
+
+protected:
+    // Receive storage. Push is called by the receive path only, the rest by the loop only.
+    virtual bool _bufferPush(const CANFrame& frame) = 0;
+    virtual bool _bufferPop(CANFrame& frame) = 0;
+    virtual bool _bufferNewest(CANFrame& frame) = 0;
+    virtual const CANFrame* _bufferPeek(size_t offset) = 0;
+    virtual size_t _bufferConsume(size_t count) = 0;
+    virtual size_t _bufferPopBatch(CANFrame* frames, size_t max) = 0;
+    virtual bool _bufferEmpty() const = 0;
+    virtual CANBufferStats _bufferStats() const = 0;
+
+    // Latest frame per id. Update is called by the receive path only, lookups from anywhere.
+    virtual void _mailboxUpdate(const CANFrame& frame) = 0;
+    virtual bool _mailboxLatest(uint32_t key, CANFrame& frame) const = 0;
+
+    // Broadcast ring. Push is called by the receive path only, each subscriber reads from its own thread.
+    virtual void _fanoutPush(const CANFrame& frame) = 0;
+    virtual bool _fanoutSubscribe(CANSubscriber& subscriber) = 0;
+    virtual bool _fanoutRead(CANSubscriber& subscriber, CANFrame& frame) = 0;
+    virtual size_t _fanoutLag(const CANSubscriber& subscriber) const = 0;
     
 public:
     CANStream(const CANConfig& config, Stream* debug = nullptr);
+    virtual ~CANStream() {}
     
     // Initialization
     int begin();
@@ -89,12 +198,38 @@ public:
     CANFrame read();
     CANFrame getLastFrame();
     void clearBuffer();
+
+    // Draining without the per-frame copy and settle delay of read()
+    const CANFrame* peek(size_t offset = 0);
+    size_t consume(size_t count = 1);
+    size_t readBatch(CANFrame* frames, size_t max);
+    // The settle delay read() applies, for replies to a peeked frame
+    void waitForBusIdle(const CANFrame& frame);
+
+    // Newest frame seen with this id, leaves the receive ring alone
+    bool getLatestFrame(unsigned long id, CANFrame& frame, bool is_extended = false);
+
+    // Every frame for each subscriber, independent of read() and of each other
+    bool subscribe(CANSubscriber& subscriber);
+    bool read(CANSubscriber& subscriber, CANFrame& frame);
+    size_t subscriberLag(const CANSubscriber& subscriber) const;
+   
+    // Task to notify (xTaskNotifyGive) on new frames and transmit completions, nullptr = none
+    void setNotifyTask(TaskHandle_t task) { _notify_task = task; }
    
     // Sending frames
     int sendFrame(const CANFrame& frame);
+    int queueFrame(const CANFrame& frame);
+    void serviceTransmit();
+    
+    // Hardware acceptance filtering
+    int setFilters(const CANAcceptanceFilter& filter);
+    int clearFilters();
     
     // Statistics
     void printStats();
+    CANQueueMetrics getQueueMetrics() const;
+    void benchmarkSPI(int iterations);
     
     // Configuration
     void dumpRegisters();
@@ -109,6 +244,168 @@ public:
     
     // Callback function for frame reception
     static void onReceive(const int instance_id);
+    
+    // Callback function for queued transmit results
+    static void onTransmit(const int instance_id, const CANTransmitResult& result);
+};
+
+// How a frame type is kept in the receive ring. Specialize it to store
+// something more compact than a CANFrame.
+template <typename Frame>
+struct CANFrameStorage;
+
+template <>
+struct CANFrameStorage<CANFrame> {
+    static void store(CANFrame& slot, const CANFrame& frame) { slot = frame; }
+    static void load(CANFrame& frame, const CANFrame& slot) { frame = slot; }
+    static const CANFrame* view(CANFrame& scratch, const CANFrame& slot) { return &slot; }
+};
+
+// Half the RAM per slot, frames must be read within 16.7 s of arriving
+template <>
+struct CANFrameStorage<CANPackedFrame> {
+    static void store(CANPackedFrame& slot, const CANFrame& frame) { packFrame(slot, frame); }
+    static void load(CANFrame& frame, const CANPackedFrame& slot) { unpackFrame(frame, slot, esp_timer_get_time()); }
+    // Packed slots can't be pointed at as a CANFrame, so peek() unpacks a copy
+    static const CANFrame* view(CANFrame& scratch, const CANPackedFrame& slot) {
+        load(scratch, slot);
+        return &scratch;
+    }
+};
+
+// Latest-value table with room for Slots distinct ids. Always holds full
+// CANFrames, a packed timestamp would wrap for ids that go quiet.
+template <size_t Slots>
+struct CANFrameMailbox {
+    CANMailbox<CANFrame, Slots> table;
+
+    void update(const CANFrame& frame) { table.update(canMailboxKey(frame.id, frame.is_extended), frame); }
+    bool latest(uint32_t key, CANFrame& frame) const { return table.latest(key, frame); }
+    size_t size() const { return table.size(); }
+    unsigned long misses() const { return table.misses(); }
+    static constexpr size_t capacity() { return Slots; }
+};
+
+// No table, nothing stored and every lookup misses
+template <>
+struct CANFrameMailbox<0> {
+    void update(const CANFrame& frame) {}
+    bool latest(uint32_t key, CANFrame& frame) const { return false; }
+    size_t size() const { return 0; }
+    unsigned long misses() const { return 0; }
+    static constexpr size_t capacity() { return 0; }
+};
+
+// Broadcast ring for subscribers, stored the same way as the receive ring
+template <typename Frame, size_t Capacity>
+struct CANFrameFanout {
+    CANFanout<Frame, Capacity> ring;
+
+    void push(const CANFrame& frame) {
+        Frame slot;
+        CANFrameStorage<Frame>::store(slot, frame);
+        ring.push(slot);
+    }
+
+    bool subscribe(CANSubscriber& subscriber) {
+        ring.subscribe(subscriber);
+        return true;
+    }
+
+    bool read(CANSubscriber& subscriber, CANFrame& frame) {
+        Frame slot;
+        if (!ring.read(subscriber, slot)) {
+            return false;
+        }
+        CANFrameStorage<Frame>::load(frame, slot);
+        return true;
+    }
+
+    size_t lag(const CANSubscriber& subscriber) const { return ring.lag(subscriber); }
+};
+
+// No broadcast ring, subscribing fails
+template <typename Frame>
+struct CANFrameFanout<Frame, 0> {
+    void push(const CANFrame& frame) {}
+    bool subscribe(CANSubscriber& subscriber) { return false; }
+    bool read(CANSubscriber& subscriber, CANFrame& frame) { return false; }
+    size_t lag(const CANSubscriber& subscriber) const { return 0; }
+};
+
+// A CANStream with room for Capacity received frames (a power of two). The
+// ring is part of the object, so it lands wherever the stream is declared.
+// MailboxSlots > 0 (a power of two) also keeps the newest frame per id, and
+// FanoutCapacity > 0 (a power of two) adds a broadcast ring for subscribers.
+template <size_t Capacity, typename Frame = CANFrame, size_t MailboxSlots = 0, size_t FanoutCapacity = 0>
+class BufferedCANStream : public CANStream {
+private:
+    CANRing<Frame, Capacity> _rx;
+    CANFrame _peeked; // Only used when Frame isn't a CANFrame
+    CANFrameMailbox<MailboxSlots> _mailbox;
+    CANFrameFanout<Frame, FanoutCapacity> _fanout;
+
+protected:
+    bool _bufferPush(const CANFrame& frame) override {
+        Frame slot;
+        CANFrameStorage<Frame>::store(slot, frame);
+        return _rx.push(slot);
+    }
+
+    bool _bufferPop(CANFrame& frame) override {
+        Frame slot;
+        if (!_rx.pop(slot)) {
+            return false;
+        }
+        CANFrameStorage<Frame>::load(frame, slot);
+        return true;
+    }
+
+    bool _bufferNewest(CANFrame& frame) override {
+        Frame slot;
+        if (!_rx.newest(slot)) {
+            return false;
+        }
+        CANFrameStorage<Frame>::load(frame, slot);
+        return true;
+    }
+
+    const CANFrame* _bufferPeek(size_t offset) override {
+        const Frame* slot = _rx.peek(offset);
+        return slot ? CANFrameStorage<Frame>::view(_peeked, *slot) : nullptr;
+    }
+
+    size_t _bufferConsume(size_t count) override { return _rx.consume(count); }
+
+    // Copies straight out of the ring and hands the slots back in one go
+    size_t _bufferPopBatch(CANFrame* frames, size_t max) override {
+        size_t count = 0;
+        const Frame* slot;
+        while (count < max && (slot = _rx.peek(count)) != nullptr) {
+            CANFrameStorage<Frame>::load(frames[count], *slot);
+            count++;
+        }
+        return _rx.consume(count);
+    }
+
+    bool _bufferEmpty() const override { return _rx.empty(); }
+
+    CANBufferStats _bufferStats() const override {
+        CANBufferStats stats = { _rx.size(), _rx.capacity(), _rx.highWatermark(), _rx.pushed(), _rx.overflows(),
+                                 _mailbox.size(), _mailbox.capacity(), _mailbox.misses() };
+        return stats;
+    }
+
+    void _mailboxUpdate(const CANFrame& frame) override { _mailbox.update(frame); }
+    bool _mailboxLatest(uint32_t key, CANFrame& frame) const override { return _mailbox.latest(key, frame); }
+
+    void _fanoutPush(const CANFrame& frame) override { _fanout.push(frame); }
+    bool _fanoutSubscribe(CANSubscriber& subscriber) override { return _fanout.subscribe(subscriber); }
+    bool _fanoutRead(CANSubscriber& subscriber, CANFrame& frame) override { return _fanout.read(subscriber, frame); }
+    size_t _fanoutLag(const CANSubscriber& subscriber) const override { return _fanout.lag(subscriber); }
+
+public:
+    BufferedCANStream(const CANConfig& config, Stream* debug = nullptr) : CANStream(config, debug) {}
 };
 
 #endif // CAN_STREAM_H 
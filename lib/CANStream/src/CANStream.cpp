@@ -11,16 +11,16 @@ CANStream* CANStream::_instances[MAX_CAN_STREAM_INSTANCES] = {nullptr};
 Stream* CANStream::_debug = nullptr;
 
 CANStream::CANStream(const CANConfig& config, Stream* debug) : _config(config), _can(config.instance_id, debug) {
-    // Initialize ring buffer indices
-    _state.buffer_head = 0;
-    _state.buffer_tail = 0;
-    _state.frames_buffered = 0;
-    
     // Set instance pointer for interrupt callbacks
     if (config.instance_id >= 0 && config.instance_id < MAX_CAN_STREAM_INSTANCES) {
         _instances[config.instance_id] = this;
     }
 
+    // Rounded up, a response must never start before the intermission ends
+    if (config.baud_rate > 0) {
+        _state.settle_time_us = (CAN_SETTLE_BITS * 1000000L + config.baud_rate - 1) / config.baud_rate;
+    }
+
     // Set debug output
     _debug = debug;
 }
@@ -35,14 +35,37 @@ int CANStream::begin() {
     _can.setSPIPins(_config.spi_sck_pin, _config.spi_miso_pin, 
                     _config.spi_mosi_pin, _config.cs_pin, _config.irq_pin);
     _can.setClockFrequency(_config.clock_frequency);
+    _can.setSamplePoint(_config.sample_point);
+    _can.setSOFPin(_config.sof_pin);
+    _can.setSPIBackend(_config.spi_backend);
+    _can.setSPIHost(_config.spi_host);
     _can.setSPISettings(_config.spi_frequency, _config.spi_bit_order, _config.spi_mode);
     
-    // Set up interrupt callback
+    // Move SPI work out of the ISR before the interrupt gets attached
+    if (_config.rx_task_priority > 0) {
+        if (_can.startInterruptTask(_config.rx_task_priority, _config.rx_task_core) != 1) {
+            _state.error_count++;
+        }
+    }
+    
+    // Set up interrupt callbacks
+    _can.setTransmitDeadline(_config.tx_deadline_us);
+    _can.configureTransmitCallback(onTransmit);
     _can.configureCallback(onReceive);
     
+    // Residency and average depth count from here
+    CANResidencyStats& residency = _residency.beginWrite();
+    memset(&residency, 0, sizeof(residency));
+    residency.since = esp_timer_get_time();
+    _residency.endWrite();
+    
     // Initialize CAN with SPI initialization
     int result = _can.begin(_config.baud_rate, true);
     
+    if (result == 1 && _config.acceptance_filter) {
+        result = setFilters(*_config.acceptance_filter);
+    }
+    
     if (result == 1) {
         if (_debug) {
             _debug->print("CANStream: Successfully initialized ");
@@ -62,51 +85,135 @@ int CANStream::begin() {
 }
 
 bool CANStream::available() {
-    return _state.buffer_head != _state.buffer_tail;
+    return !_bufferEmpty();
 }
 
 // When responding to CAN frames, only respond to the last one received
 CANFrame CANStream::getLastFrame() {
-    delayMicroseconds(_state.delay_after_receive); // Wait for ACK, EOF, and IFS to fully elapse
-
-    if (!available()) {
-        // Return empty frame if no data available
-        CANFrame empty_frame = {0, false, false, false, 0, {0}, 0};
-        return empty_frame;
-    }
-
     // Get the most recent frame (last frame added to buffer)
-    unsigned int last_index = (_state.buffer_head - 1 + _state.frame_buffer_size) % _state.frame_buffer_size;
-    return _state.frame_buffer[last_index];
+    CANFrame frame = {0, false, false, false, CAN_ACTION_DROP, 0, {0}, 0};
+    if (_bufferNewest(frame)) {
+        waitForBusIdle(frame);
+    }
+    return frame;
 }
 
 // After responding to a frame, clear the buffer because any old frames are not
-// longer valid 
+// longer valid. Only moves the tail, frames that arrive after this are kept.
 void CANStream::clearBuffer() {
-    _state.buffer_head = 0;
-    _state.buffer_tail = 0;
-    _state.frames_buffered = 0;
+    consume((size_t)-1);
 }
 
 CANFrame CANStream::read() {
-    delayMicroseconds(_state.delay_after_receive); // Wait for ACK, EOF, and IFS to fully elapse
-    
-    if (!available()) {
-        // Return empty frame if no data available
-        CANFrame empty_frame = {0, false, false, false, 0, {0}, 0};
-        return empty_frame;
+    // Get the oldest frame from the ring buffer (FIFO order), empty if none
+    CANFrame frame = {0, false, false, false, CAN_ACTION_DROP, 0, {0}, 0};
+    if (_bufferPop(frame)) {
+        CANResidencyStats& residency = _residency.beginWrite();
+        _addResidency(residency, esp_timer_get_time() - frame.timestamp);
+        _residency.endWrite();
+
+        waitForBusIdle(frame);
     }
-    
-    // Get the oldest frame from the ring buffer (FIFO order)
-    CANFrame frame = _state.frame_buffer[_state.buffer_tail];
-    
-    // Advance the tail pointer
-    _state.buffer_tail = (_state.buffer_tail + 1) % _state.frame_buffer_size;
-    _state.frames_buffered--;
-    
     return frame;
 }
 
+// Wait for ACK, EOF, and IFS to fully elapse after the frame's INT edge.
+// Frames older than that return straight away.
+void CANStream::waitForBusIdle(const CANFrame& frame) {
+    int64_t remaining = frame.timestamp + _state.settle_time_us - esp_timer_get_time();
+    if (remaining > 0) {
+        delayMicroseconds((uint32_t)remaining);
+    }
+}
+
+// Oldest frame first, nullptr past the end. Valid until the next peek() or
+// consume(), so copy out anything that has to outlive that.
+const CANFrame* CANStream::peek(size_t offset) {
+    return _bufferPeek(offset);
+}
+
+// Releases peeked frames back to the receive path, returns how many. Only
+// frames already seen here are released, later arrivals stay queued.
+size_t CANStream::consume(size_t count) {
+    int64_t now = esp_timer_get_time();
+    CANResidencyStats& residency = _residency.beginWrite();
+    size_t seen = 0;
+    const CANFrame* frame;
+    while (seen < count && (frame = _bufferPeek(seen)) != nullptr) {
+        _addResidency(residency, now - frame->timestamp);
+        seen++;
+    }
+    _residency.endWrite();
+
+    return _bufferConsume(seen);
+}
+
+// Drains up to max frames in FIFO order, returns how many were copied
+size_t CANStream::readBatch(CANFrame* frames, size_t max) {
+    size_t count = _bufferPopBatch(frames, max);
+
+    int64_t now = esp_timer_get_time();
+    CANResidencyStats& residency = _residency.beginWrite();
+    for (size_t i = 0; i < count; i++) {
+        _addResidency(residency, now - frames[i].timestamp);
+    }
+    _residency.endWrite();
+    return count;
+}
+
+// Time from the INT edge to leaving the ring, so it includes the receive path
+void CANStream::_addResidency(CANResidencyStats& stats, int64_t waited_us) {
+    unsigned long waited = waited_us > 0 ? (unsigned long)waited_us : 0;
+    int bucket = 0;
+    while (bucket < CAN_RESIDENCY_BUCKETS - 1 && waited >= (16UL << bucket)) {
+        bucket++;
+    }
+
+    stats.buckets[bucket]++;
+    stats.count++;
+    stats.total_us += waited;
+    if (waited > stats.max_us) {
+        stats.max_us = waited;
+    }
+}
+
+// By Little's law the time-weighted depth is the total time frames spent in
+// the ring over the time it was open. Frames still queued aren't counted yet.
+CANQueueMetrics CANStream::getQueueMetrics() const {
+    CANQueueMetrics metrics;
+    CANBufferStats buffer = _bufferStats();
+    metrics.depth = buffer.size;
+    metrics.capacity = buffer.capacity;
+    metrics.high_watermark = buffer.high_watermark;
+    metrics.residency = _residency.load();
+
+    int64_t elapsed = esp_timer_get_time() - metrics.residency.since;
+    metrics.average_depth = elapsed > 0 ? (float)((double)metrics.residency.total_us / elapsed) : 0.0f;
+    return metrics;
+}
+
+// Unlike getLastFrame() this doesn't wait for the bus, check the timestamp
+// if the answer depends on how fresh the frame is
+bool CANStream::getLatestFrame(unsigned long id, CANFrame& frame, bool is_extended) {
+    return _mailboxLatest(canMailboxKey(id, is_extended), frame);
+}
+
+// Starts the subscriber at the next frame received. False if the stream was
+// declared without a fan-out ring.
+bool CANStream::subscribe(CANSubscriber& subscriber) {
+    return _fanoutSubscribe(subscriber);
+}
+
+// Never waits, a subscriber that falls a ring behind loses the oldest frames
+// and counts them in subscriber.overruns
+bool CANStream::read(CANSubscriber& subscriber, CANFrame& frame) {
+    return _fanoutRead(subscriber, frame);
+}
+
+size_t CANStream::subscriberLag(const CANSubscriber& subscriber) const {
+    return _fanoutLag(subscriber);
+}
+
 int CANStream::sendFrame(const CANFrame& frame) {
     int result = _can.transmitFrame(frame);
     if (result == 1) {
@@ -126,6 +233,43 @@ int CANStream::sendFrame(const CANFrame& frame) {
     return result;
 }
 
+// Non-blocking send, the result arrives later through _onTransmit(). Returns
+// 0 without counting an error when the queue is full, so callers can retry.
+int CANStream::queueFrame(const CANFrame& frame) {
+    int result = _can.queueFrame(frame);
+    if (result < 0) {
+        _state.error_count++;
+    }
+    return result;
+}
+
+int CANStream::setFilters(const CANAcceptanceFilter& filter) {
+    int result = _can.setFilters(filter);
+    if (result != 1) {
+        _state.error_count++;
+        if (_debug) {
+            _debug->print("CANStream: Failed to set acceptance filters, error ");
+            _debug->println(result);
+        }
+        return -8 + result;
+    }
+    return 1;
+}
+
+int CANStream::clearFilters() {
+    int result = _can.clearFilters();
+    if (result != 1) {
+        _state.error_count++;
+        return -8 + result;
+    }
+    return 1;
+}
+
+// Expires queued frames that are past their deadline
+void CANStream::serviceTransmit() {
+    _can.serviceTransmitQueue();
+}
+
 void CANStream::printFrameData(const CANFrame &frame) {
     // Safety check - ensure _debug is valid
     if (_debug == nullptr) {
@@ -149,8 +293,8 @@ void CANStream::printFrameData(const CANFrame &frame) {
     memset(output_buffer, 0x0, output_buffer_len);
 
     snprintf(output_buffer, output_buffer_len, 
-        "Frame data: time: %lu, id=%x length: %u, hex: %s, binary: %s\n", 
-        frame.timestamp, frame.id, frame.data_len, data_hex, data_binary
+        "Frame data: time: %lld, id=%x length: %u, hex: %s, binary: %s\n", 
+        (long long)frame.timestamp, frame.id, frame.data_len, data_hex, data_binary
     );
 
     _debug->print(output_buffer);
@@ -161,22 +305,90 @@ void CANStream::printStats() {
         _debug->print("CANStream ");
         _debug->print(_config.name);
         _debug->println(" Statistics:");
+        CANBufferStats buffer = _bufferStats();
         _debug->print("  Frames received: ");
-        _debug->println(_state.frames_received);
-        _debug->print("  Frames buffered: ");
-        _debug->println(_state.frames_buffered);
-        _debug->print("  Ring buffer head: ");
-        _debug->println(_state.buffer_head);
-        _debug->print("  Ring buffer tail: ");
-        _debug->println(_state.buffer_tail);
+        _debug->println(buffer.pushed);
+        _debug->printf("  Frames buffered: %u/%u, high watermark: %u\n", (unsigned int)buffer.size,
+            (unsigned int)buffer.capacity, (unsigned int)buffer.high_watermark);
         _debug->print("  Frames sent: ");
         _debug->println(_state.frames_sent);
         _debug->print("  Frames dropped: ");
-        _debug->println(_state.dropped_frames);
+        _debug->println(buffer.overflows);
+        if (_config.classifier) {
+            _debug->print("  Frames dropped by classifier: ");
+            _debug->println(_state.frames_classified_drop);
+        }
+        if (buffer.mailbox_capacity > 0) {
+            _debug->printf("  Mailbox ids: %u/%u, untracked frames: %lu\n", (unsigned int)buffer.mailbox_ids,
+                (unsigned int)buffer.mailbox_capacity, buffer.mailbox_misses);
+        }
         _debug->print("  Errors: ");
         _debug->println(_state.error_count);
         _debug->print("  Interrupts: ");
         _debug->println(_state.interrupt_count);
+
+        MCP2515Stats can_stats = _can.getStats();
+        _debug->printf("  TX queued: %lu, completed: %lu, aborted: %lu, stale: %lu, queue full: %lu, lost arbitration: %lu\n",
+            can_stats.tx_queued, can_stats.tx_completed, can_stats.tx_aborted,
+            can_stats.tx_stale, can_stats.tx_queue_full, can_stats.tx_arbitration_lost);
+        if (can_stats.tx_completed > 0) {
+            _debug->printf("  TX latency: avg %lu us, max %lu us\n",
+                _state.tx_latency_total_us / can_stats.tx_completed,
+                _state.tx_latency_max_us);
+        }
+
+        _debug->printf("  RX overflows: RXB0 %lu, RXB1 %lu, error interrupts: %lu, pass limit: %lu\n",
+            can_stats.rx_overflow_rxb0, can_stats.rx_overflow_rxb1, can_stats.error_interrupts,
+            can_stats.interrupt_pass_limit);
+
+        // Every frame on the bus is either ours, accepted, or filtered by the hardware
+        long bus_frames = _can.busFrameCount();
+        if (bus_frames >= 0) {
+            long filtered = bus_frames - (long)can_stats.rx_frames
+                - (long)(can_stats.tx_completed + can_stats.tx_direct);
+            _debug->printf("  HW filter: %ld frames on bus, %lu reached host, %ld filtered\n",
+                bus_frames, can_stats.rx_frames, filtered > 0 ? filtered : 0);
+        }
+
+        CANQueueMetrics queue = getQueueMetrics();
+        if (queue.residency.count > 0) {
+            _debug->printf("  Average depth: %.2f, residency avg %lu us\n", queue.average_depth,
+                (unsigned long)(queue.residency.total_us / queue.residency.count));
+            _debug->print("  Residency (us):");
+            for (int i = 0; i < CAN_RESIDENCY_BUCKETS - 1; i++) {
+                _debug->printf(" <%lu:%lu", 16UL << i, queue.residency.buckets[i]);
+            }
+            _debug->printf(" >=%lu:%lu max:%lu\n", 16UL << (CAN_RESIDENCY_BUCKETS - 2),
+                queue.residency.buckets[CAN_RESIDENCY_BUCKETS - 1], queue.residency.max_us);
+        }
+
+        CANInterruptLatency latency = _can.getInterruptLatency();
+        if (latency.count > 0) {
+            _debug->print("  ISR->task latency (us):");
+            for (int i = 0; i < CAN_LATENCY_BUCKETS - 1; i++) {
+                _debug->printf(" <%lu:%lu", 8UL << i, latency.buckets[i]);
+            }
+            _debug->printf(" >=%lu:%lu max:%lu\n", 8UL << (CAN_LATENCY_BUCKETS - 2),
+                latency.buckets[CAN_LATENCY_BUCKETS - 1], latency.max_us);
+        }
+
+        if (can_stats.rx_frames > 0) {
+            _debug->printf("  SPI per RX frame: %.1f transactions, %.1f bytes\n",
+                (double)can_stats.rx_spi_transactions / can_stats.rx_frames,
+                (double)can_stats.rx_spi_bytes / can_stats.rx_frames);
+        }
+    }
+}
+
+// Prints the SPI cost of one frame, the RX buffers are emptied while it runs
+void CANStream::benchmarkSPI(int iterations) {
+    MCP2515SPIBenchmark result = _can.benchmarkSPI(iterations);
+    if (_debug) {
+        _debug->printf("CANStream %s SPI (%s, host %d, %lu Hz): RX %.1f us/frame, TX %.1f us/frame\n",
+            _config.name,
+            _config.spi_backend == MCP2515_SPI_ESP_IDF ? "esp-idf" : "arduino",
+            (int)_config.spi_host,
+            (unsigned long)_config.spi_frequency, result.rx_us, result.tx_us);
     }
 }
 
@@ -218,24 +430,65 @@ void CANStream::onReceive(const int instance_id) {
 void CANStream::_onReceive() {
     _state.interrupt_count++;
 
+    // Drain both RX buffers, another frame can land while we read the first
     CANFrame frame;
-    int receive_len = _can.receiveFrame(&frame);
+    bool buffered = false;
+    while (_can.receiveFrame(&frame) > 0) {
+        frame.action = _config.classifier ? _config.classifier->classify(frame.id, frame.is_extended) : CAN_ACTION_ALL;
+        if (frame.action == CAN_ACTION_DROP) {
+            _state.frames_classified_drop++;
+            continue;
+        }
+
+        // A full ring drops the frame and counts it
+        _bufferPush(frame);
+        _mailboxUpdate(frame);
+        _fanoutPush(frame);
+        buffered = true;
+    }
+
+    // One wake-up for the whole drain
+    if (buffered) {
+        _notify();
+    }
+}
 
-    // Only process the frame if we actually received data
-    if (receive_len <= 0) {
+// Runs from the GPIO ISR or the receive task, depending on rx_task_priority
+void CANStream::_notify() {
+    TaskHandle_t task = _notify_task;
+    if (!task) {
         return;
     }
 
-    // Store frame in ring buffer
-    unsigned int next_head = (_state.buffer_head + 1) % _state.frame_buffer_size;
-    if (next_head != _state.buffer_tail) {
-        // Buffer has space, store the frame
-        _state.frame_buffer[_state.buffer_head] = frame;
-        _state.buffer_head = next_head;
-        _state.frames_buffered++;
-        _state.frames_received++;
+    if (xPortInIsrContext()) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(task, &woken);
+        portYIELD_FROM_ISR(woken);
     } else {
-        // Buffer is full, drop the frame
-        _state.dropped_frames++;
+        xTaskNotifyGive(task);
     }
 }
+
+// Static lookup and call of instance transmit handler
+void CANStream::onTransmit(const int instance_id, const CANTransmitResult& result) {
+    if (instance_id >= 0 && instance_id < MAX_CAN_STREAM_INSTANCES && _instances[instance_id]) {
+        _instances[instance_id]->_onTransmit(result);
+    }
+}
+
+// May be called from the interrupt, keep it short and don't print
+void CANStream::_onTransmit(const CANTransmitResult& result) {
+    if (result.status == TX_STATUS_COMPLETE) {
+        unsigned long latency = (unsigned long)(result.completed_at - result.queued_at);
+        _state.frames_sent++;
+        _state.tx_latency_total_us += latency;
+        if (latency > _state.tx_latency_max_us) {
+            _state.tx_latency_max_us = latency;
+        }
+    } else {
+        _state.error_count++;
+    }
+
+    // A transmit queue slot is free again
+    _notify();
+}
@@ -0,0 +1,57 @@
+// vim: ts=4:sw=4:et
+
+#ifndef DEBUG_QUEUE_H
+#define DEBUG_QUEUE_H
+
+#include <Arduino.h>
+#include <MPSCQueue.h>
+
+// Each write() is split into records of up to DEBUG_QUEUE_RECORD_TEXT bytes
+#define DEBUG_QUEUE_RECORD_TEXT 63
+#define DEBUG_QUEUE_RECORDS 64
+
+// The sink is flushed at least this often while draining, Broadcast sends a
+// UDP packet per flush and its buffer must not fill up
+#define DEBUG_QUEUE_SINK_FLUSH_BYTES 1024
+#define DEBUG_QUEUE_TASK_STACK 4096
+
+struct DebugQueueRecord {
+    uint8_t length;
+    char text[DEBUG_QUEUE_RECORD_TEXT];
+};
+
+// A Stream that any task (or interrupt) can print to without waiting. Text is
+// queued and written to the sink by one task, normally pinned to core 0 with
+// the WiFi stack, so slow UDP sends never hold up the CAN tasks. When the
+// queue is full the text is dropped and counted.
+class DebugQueue : public Stream {
+    MPSCQueue<DebugQueueRecord, DEBUG_QUEUE_RECORDS> _queue;
+    Stream* _sink;
+    TaskHandle_t _task = nullptr;
+    unsigned long _flush_interval_ms = 100;
+    unsigned long _reported_drops = 0;
+
+    static void _taskLoop(void* arg);
+    void _drain();
+
+    public:
+    DebugQueue(Stream& sink);
+
+    // Until this is called, flush() drains the queue on the caller's thread
+    int startTask(UBaseType_t priority, BaseType_t core, unsigned long flush_interval_ms = 100);
+    TaskHandle_t getTask() const { return _task; }
+    unsigned long dropped() const { return _queue.dropped(); }
+
+    // Stream interface
+    virtual size_t write(uint8_t byte) override;
+    virtual size_t write(const uint8_t *data, size_t size) override;
+    virtual void flush() override; // Wakes the task to send now
+
+    virtual int available() override { return 0; }
+    virtual int read() override { return -1; }
+    virtual int peek() override { return -1; }
+
+    using Print::write; // Pull in Print::write overrides
+};
+
+#endif // DEBUG_QUEUE_H
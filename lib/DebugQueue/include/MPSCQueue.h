@@ -0,0 +1,84 @@
+// vim: ts=4:sw=4:et
+
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// Bounded multi producer, single consumer queue. Producers claim a cell with
+// a compare-and-swap on the enqueue index, and each cell's sequence number
+// says whether it is free, being written, or ready, so nobody takes a lock
+// and a full queue fails the push instead of waiting. Safe to push from
+// tasks on both cores and from interrupts.
+template <typename T, size_t Capacity>
+class MPSCQueue {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                  "MPSCQueue capacity must be a power of two");
+
+public:
+    MPSCQueue() : _enqueue(0), _dequeue(0), _dropped(0) {
+        for (size_t i = 0; i < Capacity; i++) {
+            _cells[i].sequence.store((uint32_t)i, std::memory_order_relaxed);
+        }
+    }
+
+    // Any thread. Returns false and counts a drop when full.
+    bool push(const T& item) {
+        uint32_t position = _enqueue.load(std::memory_order_relaxed);
+        Cell* cell;
+        for (;;) {
+            cell = &_cells[position & MASK];
+            int32_t diff = (int32_t)(cell->sequence.load(std::memory_order_acquire) - position);
+            if (diff == 0) {
+                // Free for this lap, try to claim it
+                if (_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                _dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            } else {
+                // Another producer got it first
+                position = _enqueue.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->item = item;
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Items come out in the order their cells were claimed.
+    bool pop(T& item) {
+        Cell& cell = _cells[_dequeue & MASK];
+        if ((int32_t)(cell.sequence.load(std::memory_order_acquire) - (_dequeue + 1)) < 0) {
+            return false;
+        }
+
+        item = cell.item;
+        // Free for the producers' next lap
+        cell.sequence.store(_dequeue + Capacity, std::memory_order_release);
+        _dequeue++;
+        return true;
+    }
+
+    static constexpr size_t capacity() { return Capacity; }
+    unsigned long dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr uint32_t MASK = Capacity - 1;
+
+    struct Cell {
+        std::atomic<uint32_t> sequence;
+        T item;
+    };
+
+    Cell _cells[Capacity];
+    std::atomic<uint32_t> _enqueue;
+    uint32_t _dequeue;
+    std::atomic<uint32_t> _dropped;
+};
+
+#endif // MPSC_QUEUE_H
@@ -0,0 +1,88 @@
+// vim: ts=4:sw=4:et
+
+#include <DebugQueue.h>
+
+DebugQueue::DebugQueue(Stream& sink) : _sink(&sink) {}
+
+int DebugQueue::startTask(UBaseType_t priority, BaseType_t core, unsigned long flush_interval_ms) {
+    if (_task) {
+        return 1;
+    }
+
+    _flush_interval_ms = flush_interval_ms;
+    if (xTaskCreatePinnedToCore(_taskLoop, "debug_queue", DEBUG_QUEUE_TASK_STACK,
+            this, priority, &_task, core) != pdPASS) {
+        _task = nullptr;
+        return -1;
+    }
+    return 1;
+}
+
+void DebugQueue::_taskLoop(void* arg) {
+    DebugQueue* queue = (DebugQueue*)arg;
+
+    while (true) {
+        // Woken early by flush()
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(queue->_flush_interval_ms));
+        queue->_drain();
+    }
+}
+
+// Consumer side, only ever runs on one thread at a time
+void DebugQueue::_drain() {
+    DebugQueueRecord record;
+    size_t unflushed = 0;
+
+    while (_queue.pop(record)) {
+        _sink->write((const uint8_t*)record.text, record.length);
+        unflushed += record.length;
+        if (unflushed >= DEBUG_QUEUE_SINK_FLUSH_BYTES) {
+            _sink->flush();
+            unflushed = 0;
+        }
+    }
+
+    unsigned long drops = _queue.dropped();
+    if (drops != _reported_drops) {
+        _sink->printf("DebugQueue: dropped %lu records\n", drops - _reported_drops);
+        _reported_drops = drops;
+        unflushed++;
+    }
+
+    if (unflushed > 0) {
+        _sink->flush();
+    }
+}
+
+size_t DebugQueue::write(uint8_t byte) {
+    return write(&byte, 1);
+}
+
+// Print::printf() and print() hand over whole strings, so a line from one
+// task is only split from another task's text at record boundaries
+size_t DebugQueue::write(const uint8_t *data, size_t size) {
+    size_t written = 0;
+    DebugQueueRecord record;
+
+    while (written < size) {
+        size_t length = size - written;
+        if (length > DEBUG_QUEUE_RECORD_TEXT) {
+            length = DEBUG_QUEUE_RECORD_TEXT;
+        }
+        record.length = (uint8_t)length;
+        memcpy(record.text, data + written, length);
+        if (!_queue.push(record)) {
+            break;
+        }
+        written += length;
+    }
+    return written;
+}
+
+void DebugQueue::flush() {
+    if (_task) {
+        xTaskNotifyGive(_task);
+    } else {
+        _drain();
+    }
+}
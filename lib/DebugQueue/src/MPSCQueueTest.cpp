@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <assert.h>
+#include <thread>
+#include <atomic>
+#include <MPSCQueue.h>
+
+struct TestRecord {
+    uint32_t producer;
+    uint32_t sequence;
+    uint32_t check;
+};
+
+static TestRecord makeRecord(uint32_t producer, uint32_t sequence) {
+    TestRecord record = { producer, sequence, ~(producer * 0x10000 + sequence) };
+    return record;
+}
+
+void testPushPop() {
+    MPSCQueue<TestRecord, 4> queue;
+    TestRecord record;
+
+    assert(!queue.pop(record));
+
+    // Every cell is usable, then pushes fail instead of waiting
+    for (uint32_t i = 0; i < 4; i++) {
+        assert(queue.push(makeRecord(0, i)));
+    }
+    assert(!queue.push(makeRecord(0, 4)));
+    assert(queue.dropped() == 1);
+
+    for (uint32_t i = 0; i < 4; i++) {
+        assert(queue.pop(record));
+        assert(record.sequence == i);
+    }
+    assert(!queue.pop(record));
+
+    // Run the indices around the mask many times
+    for (uint32_t i = 0; i < 1000; i++) {
+        assert(queue.push(makeRecord(0, i)));
+        assert(queue.pop(record));
+        assert(record.sequence == i);
+    }
+}
+
+// Several producers racing for cells while one consumer drains. Each
+// producer's records must arrive intact and in its own order, and every push
+// must either arrive or be counted as dropped.
+void testStress(uint32_t records) {
+    static MPSCQueue<TestRecord, 64> queue;
+    const uint32_t producers = 4;
+    uint32_t pushed[producers] = {0};
+    uint32_t received[producers] = {0};
+    uint32_t last[producers] = {0};
+    uint32_t corrupt = 0;
+    uint32_t out_of_order = 0;
+    std::atomic<uint32_t> finished(0);
+
+    std::thread threads[producers];
+    for (uint32_t p = 0; p < producers; p++) {
+        threads[p] = std::thread([&, p]() {
+            for (uint32_t i = 1; i <= records; i++) {
+                if (queue.push(makeRecord(p, i))) {
+                    pushed[p]++;
+                }
+                if (i % 64 == 0) {
+                    std::this_thread::yield();
+                }
+            }
+            finished.fetch_add(1);
+        });
+    }
+
+    std::thread consumer([&]() {
+        TestRecord record;
+        for (;;) {
+            bool done = finished.load() == producers;
+            if (!queue.pop(record)) {
+                if (done) {
+                    break;
+                }
+                continue;
+            }
+            if (record.producer >= producers || record.check != ~(record.producer * 0x10000 + record.sequence)) {
+                corrupt++;
+                continue;
+            }
+            if (record.sequence <= last[record.producer]) {
+                out_of_order++;
+            }
+            last[record.producer] = record.sequence;
+            received[record.producer]++;
+        }
+    });
+
+    for (uint32_t p = 0; p < producers; p++) {
+        threads[p].join();
+    }
+    consumer.join();
+
+    uint32_t total = 0;
+    for (uint32_t p = 0; p < producers; p++) {
+        assert(received[p] == pushed[p]);
+        total += received[p];
+    }
+    printf("%u records: %u received, %lu dropped ", records * producers, total, queue.dropped());
+    assert(corrupt == 0);
+    assert(out_of_order == 0);
+    assert(total + queue.dropped() == records * producers);
+}
+
+int main(int argc, char *argv[]) {
+    printf("Running testPushPop()... ");
+    testPushPop();
+    printf("Passed\n");
+    printf("Running testStress()... ");
+    testStress(1000000);
+    printf("Passed\n");
+}
@@ -33,6 +33,8 @@ DebugWebserver::DebugWebserver(uint16_t port) : port(port) {
 int DebugWebserver::start() {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.server_port = port;
+    // Keep the HTTP server with the WiFi stack, core 1 belongs to the CAN tasks
+    config.core_id = 0;
     
     if (httpd_start(&server, &config) == ESP_OK) {
         httpd_register_uri_handler(server, &uri_get);
@@ -12,6 +12,8 @@ typedef enum {
     PACKET_RESULT_UNKNOWN = -4,
     PACKET_RESULT_DUPLICATE = -5,
     PACKET_RESULT_BUS_ERROR = -6,
+    PACKET_RESULT_NOT_TAGGED = -7, // Classifier didn't tag it CAN_ACTION_RESPOND
+    PACKET_RESULT_TX_QUEUE_FULL = -8, // Reply not queued, frame left in the buffer to retry
 } FrameResultCode;
 
 // Forward declarations
@@ -32,10 +34,11 @@ class OBD2Responder {
     int init();
 	
     FrameResultCode handleNextFrame();
-	void sendSupportedPIDs();
-	void sendMonitorStatus();
-	void sendTroubleCodes();
-	void sendOxygenSensor();
+	// Queue the reply without waiting for it, CANStream::queueFrame() result
+	int sendSupportedPIDs();
+	int sendMonitorStatus();
+	int sendTroubleCodes();
+	int sendOxygenSensor();
 
     private:
 
@@ -48,6 +51,6 @@ class OBD2Responder {
         .is_retransmit = false,
         .data_len = 8,
         .data = { 0x06, 0x41, 0x01, 0x00, 0x07, 0xFF, 0x20, 0xCC },
-        .timestamp = millis()
+        .timestamp = esp_timer_get_time()
     };
 }; 
@@ -24,25 +24,33 @@ int OBD2Responder::init() {
     }
 }
 
-// Only respond to the most recent frame
-// If we respond, clear the buffer
-// Leave other packets in the buffer so they can be forwarded elsewhere
+// Looks at the oldest frame in the buffer and consumes it only if we respond.
+// Anything else stays where it is, so it can still be forwarded.
 FrameResultCode OBD2Responder::handleNextFrame() {
     if (!_can_stream) {
         return PACKET_RESULT_BUS_ERROR;
     }
     
-    if (!_can_stream->available()) {
+    const CANFrame* next = _can_stream->peek();
+    if (!next) {
         return PACKET_RESULT_NONE;
     }
 
-	if (_debug) _debug->println();
-    
-    CANFrame frame = _can_stream->getLastFrame();
+    CANFrame frame = *next;
+    if (!(frame.action & CAN_ACTION_RESPOND)) {
+        return PACKET_RESULT_NOT_TAGGED;
+    }
+
     if (_debug) _debug->println("Processing frame.");
     _can_stream->printFrameData(frame);
 
+    // Replies wait out the request's ACK and IFS, as read() would have
+    if (frame.id == 0x7df) {
+        _can_stream->waitForBusIdle(frame);
+    }
+
     FrameResultCode retcode;
+    int sent = 1;
 
     if (frame.is_retransmit) {
         retcode = PACKET_RESULT_RTR;
@@ -52,46 +60,43 @@ FrameResultCode OBD2Responder::handleNextFrame() {
         retcode = PACKET_RESULT_SELF;
     } else if (frame.id == 0x7df && frame.data[0] == 0x02 && frame.data[1] == 0x01 && frame.data[2] == 0x00) {
         if (_debug) _debug->println("Received request for supported PIDs");
-        _can_stream->printFrameData(frame);
-        sendSupportedPIDs();
-        _can_stream->clearBuffer();
+        sent = sendSupportedPIDs();
         retcode = PACKET_RESULT_PIDS;
     } else if (frame.id == 0x7df && frame.data[0] == 0x02 && frame.data[1] == 0x01 && frame.data[2] == 0x01) {
         if (_debug) _debug->println("Received request for monitor status");
-        _can_stream->printFrameData(frame);
-        sendMonitorStatus();
-        _can_stream->clearBuffer();
+        sent = sendMonitorStatus();
         retcode = PACKET_RESULT_MONITOR_STATUS;
     } else if (frame.id == 0x7df && frame.data[0] == 0x01 && frame.data[1] == 0x03) {
         if (_debug) _debug->println("Received request for trouble codes");
-        _can_stream->printFrameData(frame);
-        sendTroubleCodes();
-        _can_stream->clearBuffer();
+        sent = sendTroubleCodes();
         retcode = PACKET_RESULT_TROUBLE_CODES;
     } else if (frame.id == 0x7df && frame.data[0] == 0x01 && frame.data[1] == 0x07) {
         if (_debug) _debug->println("Received request for pending trouble codes");
-        _can_stream->printFrameData(frame);
-        sendTroubleCodes();
-        _can_stream->clearBuffer();
+        sent = sendTroubleCodes();
         retcode = PACKET_RESULT_TROUBLE_CODES;
     } else if (frame.id == 0x7df && frame.data[0] == 0x02 && frame.data[1] == 0x01 && frame.data[2] == 0x11) {
         if (_debug) _debug->println("Received request for oxygen sensor");
-        _can_stream->printFrameData(frame);
-        sendOxygenSensor();
-        _can_stream->clearBuffer();
+        sent = sendOxygenSensor();
         retcode = PACKET_RESULT_OXYGEN_SENSOR;
     } else {
         if (_debug) _debug->println("Unknown frame");
-        _can_stream->printFrameData(frame);
         retcode = PACKET_RESULT_UNKNOWN;
     }
 
+    // Leave the request where it is and answer it once a mailbox frees up
+    if (sent == 0) {
+        return PACKET_RESULT_TX_QUEUE_FULL;
+    }
+
+    if (retcode > 0) {
+        _can_stream->consume();
+    }
     return retcode;
 }
 
 // { 0x06, 0x41, 0x00, 0xbe, 0x1f, 0xe8, 0x1b, 0xCC  }
-void OBD2Responder::sendSupportedPIDs() {
-    if (!_can_stream) return;
+int OBD2Responder::sendSupportedPIDs() {
+    if (!_can_stream) return -1;
     if (_debug) _debug->println("Sending supported PIDs");
 
     CANFrame frame = {
@@ -101,14 +106,14 @@ void OBD2Responder::sendSupportedPIDs() {
         .is_retransmit = false,
         .data_len = 8,
         .data = {0x06, 0x41, 0x00, 0xbe, 0x1f, 0xe8, 0x1b, 0xCC},
-        .timestamp = millis()
+        .timestamp = esp_timer_get_time()
     };
 
-    _can_stream->sendFrame(frame);
+    return _can_stream->queueFrame(frame);
 }
 
-void OBD2Responder::sendOxygenSensor() {
-    if (!_can_stream) return;
+int OBD2Responder::sendOxygenSensor() {
+    if (!_can_stream) return -1;
     if (_debug) _debug->println("Sending oxygen sensor data");
     
     CANFrame frame = {
@@ -118,25 +123,25 @@ void OBD2Responder::sendOxygenSensor() {
         .is_retransmit = false,
         .data_len = 8,
         .data = { 0x04, 0x41, 0x11, 0x80, 0x80, 0xCC, 0xCC, 0xCC },
-        .timestamp = millis()
+        .timestamp = esp_timer_get_time()
     };
 
-    _can_stream->sendFrame(frame);
+    return _can_stream->queueFrame(frame);
 }
     
 void OBD2Responder::setMonitorStatusFrame(CANFrame frame) {
     _monitor_status_frame = frame;
 }
 
-void OBD2Responder::sendMonitorStatus() {
-    if (!_can_stream) return;
+int OBD2Responder::sendMonitorStatus() {
+    if (!_can_stream) return -1;
     if (_debug) _debug->println("Sending monitor status");
-    _can_stream->sendFrame(_monitor_status_frame);
+    return _can_stream->queueFrame(_monitor_status_frame);
 }
 
 // { 0x02, 0x43, 0x00, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC  }
-void OBD2Responder::sendTroubleCodes() {
-    if (!_can_stream) return;
+int OBD2Responder::sendTroubleCodes() {
+    if (!_can_stream) return -1;
     if (_debug) _debug->println("Sending monitor status");
     
     CANFrame frame = {
@@ -146,8 +151,8 @@ void OBD2Responder::sendTroubleCodes() {
         .is_retransmit = false,
         .data_len = 8,
         .data = { 0x02, 0x43, 0x00, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC },
-        .timestamp = millis()
+        .timestamp = esp_timer_get_time()
     };
 
-    _can_stream->sendFrame(frame);
+    return _can_stream->queueFrame(frame);
 }
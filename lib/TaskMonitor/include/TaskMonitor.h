@@ -0,0 +1,45 @@
+// vim: ts=4:sw=4:et
+
+#ifndef TASK_MONITOR_H
+#define TASK_MONITOR_H
+
+#include <Arduino.h>
+
+#define TASK_MONITOR_MAX_TASKS 8
+#define TASK_MONITOR_MAX_CORES 2
+
+// Reports where the watched tasks run, how close they came to overflowing
+// their stacks, and their share of their core since the last report. The
+// Arduino core ships without FreeRTOS run time stats, so the CPU share is
+// sampled instead: each core's tick hook notes which task the tick landed
+// on. Shares are good to a tick or so per report, which at 1 kHz and a
+// report every few seconds is well under a percent.
+class TaskMonitor {
+    TaskHandle_t _tasks[TASK_MONITOR_MAX_TASKS];
+    volatile uint32_t _task_ticks[TASK_MONITOR_MAX_TASKS];   // Ticks that found the task running
+    uint32_t _last_task_ticks[TASK_MONITOR_MAX_TASKS];
+    volatile uint32_t _core_ticks[TASK_MONITOR_MAX_CORES];
+    volatile uint32_t _idle_ticks[TASK_MONITOR_MAX_CORES];   // Ticks that found the idle task
+    uint32_t _last_core_ticks[TASK_MONITOR_MAX_CORES];
+    uint32_t _last_idle_ticks[TASK_MONITOR_MAX_CORES];
+    volatile size_t _count = 0; // Set after the slot, the tick hooks read it first
+
+    // The hooks take no argument, so only one monitor samples at a time
+    static TaskMonitor* volatile _sampling;
+    static void _onTick();
+    void _sample(int core);
+    void _startSampling();
+
+    public:
+    ~TaskMonitor();
+
+    // Returns 1, -1 for a null task, -2 when TASK_MONITOR_MAX_TASKS are watched
+    int watch(TaskHandle_t task);
+    size_t size() const { return _count; }
+
+    // One line per task and one per core. CPU is the share of the task's core
+    // since the last call, n/a when another monitor is sampling.
+    void print(Stream* out);
+};
+
+#endif // TASK_MONITOR_H
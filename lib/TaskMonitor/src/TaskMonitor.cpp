@@ -0,0 +1,145 @@
+// vim: ts=4:sw=4:et
+
+#include <TaskMonitor.h>
+#include <esp_freertos_hooks.h>
+
+#define TASK_MONITOR_CORES (portNUM_PROCESSORS < TASK_MONITOR_MAX_CORES ? portNUM_PROCESSORS : TASK_MONITOR_MAX_CORES)
+
+TaskMonitor* volatile TaskMonitor::_sampling = nullptr;
+
+TaskMonitor::~TaskMonitor() {
+    if (_sampling == this) {
+        esp_deregister_freertos_tick_hook(_onTick);
+        _sampling = nullptr;
+    }
+}
+
+int TaskMonitor::watch(TaskHandle_t task) {
+    if (!task) {
+        return -1;
+    }
+    for (size_t i = 0; i < _count; i++) {
+        if (_tasks[i] == task) {
+            return 1;
+        }
+    }
+    if (_count >= TASK_MONITOR_MAX_TASKS) {
+        return -2;
+    }
+
+    if (_count == 0) {
+        _startSampling();
+    }
+
+    _tasks[_count] = task;
+    _task_ticks[_count] = 0;
+    _last_task_ticks[_count] = 0;
+    _count++;
+    return 1;
+}
+
+// A core whose hook didn't register keeps a zero tick count and prints n/a
+void TaskMonitor::_startSampling() {
+    if (_sampling) {
+        return;
+    }
+
+    for (int core = 0; core < TASK_MONITOR_MAX_CORES; core++) {
+        _core_ticks[core] = 0;
+        _idle_ticks[core] = 0;
+        _last_core_ticks[core] = 0;
+        _last_idle_ticks[core] = 0;
+    }
+
+    _sampling = this;
+    for (int core = 0; core < TASK_MONITOR_CORES; core++) {
+        esp_register_freertos_tick_hook_for_cpu(_onTick, core);
+    }
+}
+
+// Runs in each core's tick interrupt, keep it short
+void TaskMonitor::_onTick() {
+    TaskMonitor* monitor = _sampling;
+    int core = xPortGetCoreID();
+    if (monitor && core < TASK_MONITOR_MAX_CORES) {
+        monitor->_sample(core);
+    }
+}
+
+// Each counter only moves on the core running the task, so no lock
+void TaskMonitor::_sample(int core) {
+    _core_ticks[core]++;
+
+    TaskHandle_t current = xTaskGetCurrentTaskHandle();
+    if (current == xTaskGetIdleTaskHandleForCPU(core)) {
+        _idle_ticks[core]++;
+        return;
+    }
+
+    size_t count = _count;
+    for (size_t i = 0; i < count; i++) {
+        if (_tasks[i] == current) {
+            _task_ticks[i]++;
+            return;
+        }
+    }
+}
+
+void TaskMonitor::print(Stream* out) {
+    if (!out) {
+        return;
+    }
+
+    bool sampled = _sampling == this;
+    uint32_t elapsed[TASK_MONITOR_MAX_CORES];
+    uint32_t idle[TASK_MONITOR_MAX_CORES];
+    uint32_t elapsed_all = 0;
+    for (int core = 0; core < TASK_MONITOR_CORES; core++) {
+        uint32_t ticks = _core_ticks[core];
+        uint32_t idle_ticks = _idle_ticks[core];
+        elapsed[core] = ticks - _last_core_ticks[core];
+        idle[core] = idle_ticks - _last_idle_ticks[core];
+        _last_core_ticks[core] = ticks;
+        _last_idle_ticks[core] = idle_ticks;
+        elapsed_all += elapsed[core];
+    }
+
+    out->print("Tasks:\n");
+    for (size_t i = 0; i < _count; i++) {
+        TaskHandle_t task = _tasks[i];
+        uint32_t ticks = _task_ticks[i];
+        uint32_t used = ticks - _last_task_ticks[i];
+        _last_task_ticks[i] = ticks;
+
+        // An unpinned task is measured against the average core
+        BaseType_t core = xTaskGetAffinity(task);
+        char core_name[8];
+        uint32_t core_elapsed;
+        if (core == tskNO_AFFINITY) {
+            snprintf(core_name, sizeof(core_name), "any");
+            core_elapsed = elapsed_all / TASK_MONITOR_CORES;
+        } else {
+            snprintf(core_name, sizeof(core_name), "%d", (int)core);
+            core_elapsed = core < TASK_MONITOR_CORES ? elapsed[core] : 0;
+        }
+
+        // ESP-IDF counts stack in bytes, not words
+        out->printf("  %-16s core %-3s prio %2u  stack free %5u B  CPU ",
+            pcTaskGetName(task), core_name, (unsigned int)uxTaskPriorityGet(task),
+            (unsigned int)uxTaskGetStackHighWaterMark(task));
+        if (sampled && core_elapsed > 0) {
+            out->printf("%5.1f%%\n", 100.0f * used / core_elapsed);
+        } else {
+            out->print("  n/a\n");
+        }
+    }
+
+    for (int core = 0; core < TASK_MONITOR_CORES; core++) {
+        out->printf("  core %d busy ", core);
+        if (sampled && elapsed[core] > 0) {
+            out->printf("%5.1f%%\n", 100.0f * (elapsed[core] - idle[core]) / elapsed[core]);
+        } else {
+            out->print("  n/a\n");
+        }
+    }
+}
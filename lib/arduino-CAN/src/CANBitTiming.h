@@ -0,0 +1,155 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifndef CAN_BIT_TIMING_H
+#define CAN_BIT_TIMING_H
+
+#include <stdint.h>
+
+// Bitrates further off than this are rejected, oscillator tolerance eats the rest of the budget
+#define CAN_BITRATE_TOLERANCE_PPM 5000
+
+// Where the controllers differ. Both the MCP2515 and the SJA1000 use
+// TQ = 2 * BRP / Fosc and a bit of SYNC (1 TQ) + TSEG1 + TSEG2.
+struct CANBitTimingLimits {
+    long brp_min;
+    long brp_max;
+    int tq_min;    // Whole bit, SYNC included
+    int tq_max;
+    int tseg1_min; // Everything between SYNC and the sample point
+    int tseg1_max;
+    int tseg2_min; // Sample point to the end of the bit
+    int tseg2_max;
+    int sjw_max;
+};
+
+struct CANBitTiming {
+    bool valid;
+    long brp;
+    int tq;
+    int tseg1;
+    int tseg2;
+    int sjw;
+    long error_ppm;    // Distance from the requested bitrate
+    int sample_point;  // Achieved, in permille
+    int sample_point_error;
+};
+
+// Everything is constexpr and C++11 (single return, recursion) so a constant
+// clock and bitrate can be checked with static_assert. At runtime use
+// findBitTiming(), it walks the same candidates in a loop instead of recursing.
+namespace can_bit_timing {
+
+constexpr long long absolute(long long value) {
+    return value < 0 ? -value : value;
+}
+
+constexpr int clamp(int value, int low, int high) {
+    return value < low ? low : (value > high ? high : value);
+}
+
+constexpr CANBitTiming invalid() {
+    return CANBitTiming{false, 0, 0, 0, 0, 0, 0, 0, 0};
+}
+
+// |fosc / (2 * brp * tq) - bitrate| / bitrate
+constexpr long errorPpm(long fosc, long bitrate, long brp, int tq) {
+    return (long)(absolute((long long)fosc - 2LL * brp * tq * bitrate) * 1000000LL
+        / (2LL * brp * tq * bitrate));
+}
+
+// The sample point sits after SYNC + TSEG1
+constexpr int samplePoint(int tq, int tseg2) {
+    return (tq - tseg2) * 1000 / tq;
+}
+
+// SJW has to stay below TSEG2
+constexpr int sjw(const CANBitTimingLimits& limits, int tseg2) {
+    return clamp(tseg2 - 1, 1, limits.sjw_max);
+}
+
+constexpr bool fits(const CANBitTimingLimits& limits, int tseg1, int tseg2) {
+    return tseg1 >= limits.tseg1_min && tseg1 <= limits.tseg1_max
+        && tseg2 >= limits.tseg2_min && tseg2 <= limits.tseg2_max
+        && tseg1 >= tseg2;
+}
+
+constexpr CANBitTiming make(const CANBitTimingLimits& limits, long fosc, long bitrate,
+                            int sample_point, long brp, int tq, int tseg2) {
+    return fits(limits, tq - 1 - tseg2, tseg2)
+        ? CANBitTiming{true, brp, tq, tq - 1 - tseg2, tseg2, sjw(limits, tseg2),
+                       errorPpm(fosc, bitrate, brp, tq), samplePoint(tq, tseg2),
+                       (int)absolute(samplePoint(tq, tseg2) - sample_point)}
+        : invalid();
+}
+
+// TSEG2 rounded to the requested sample point, then pulled into the range
+// where both it and TSEG1 fit
+constexpr CANBitTiming candidate(const CANBitTimingLimits& limits, long fosc, long bitrate,
+                                 int sample_point, long brp, int tq) {
+    return make(limits, fosc, bitrate, sample_point, brp, tq,
+        clamp(clamp(tq - (tq * sample_point + 500) / 1000,
+                    tq - 1 - limits.tseg1_max, tq - 1 - limits.tseg1_min),
+              limits.tseg2_min, limits.tseg2_max));
+}
+
+// Closest bitrate first, then closest sample point, then the finest quanta
+constexpr bool better(const CANBitTiming& a, const CANBitTiming& b) {
+    return a.valid && (!b.valid
+        || a.error_ppm < b.error_ppm
+        || (a.error_ppm == b.error_ppm && (a.sample_point_error < b.sample_point_error
+            || (a.sample_point_error == b.sample_point_error && a.tq > b.tq))));
+}
+
+constexpr CANBitTiming pick(const CANBitTiming& a, const CANBitTiming& b) {
+    return better(a, b) ? a : b;
+}
+
+constexpr CANBitTiming searchTq(const CANBitTimingLimits& limits, long fosc, long bitrate,
+                                int sample_point, long brp, int tq, const CANBitTiming& best) {
+    return tq > limits.tq_max ? best
+        : searchTq(limits, fosc, bitrate, sample_point, brp, tq + 1,
+            pick(candidate(limits, fosc, bitrate, sample_point, brp, tq), best));
+}
+
+constexpr CANBitTiming searchBrp(const CANBitTimingLimits& limits, long fosc, long bitrate,
+                                 int sample_point, long brp, const CANBitTiming& best) {
+    return brp > limits.brp_max ? best
+        : searchBrp(limits, fosc, bitrate, sample_point, brp + 1,
+            searchTq(limits, fosc, bitrate, sample_point, brp, limits.tq_min, best));
+}
+
+constexpr CANBitTiming withinTolerance(const CANBitTiming& t) {
+    return t.valid && t.error_ppm <= CAN_BITRATE_TOLERANCE_PPM ? t : invalid();
+}
+
+} // namespace can_bit_timing
+
+// Best BRP/TSEG1/TSEG2/SJW for the oscillator, bitrate and sample point
+// (permille, e.g. 750 or 875). valid is false if nothing is within tolerance.
+constexpr CANBitTiming solveBitTiming(const CANBitTimingLimits& limits, long fosc,
+                                      long bitrate, int sample_point) {
+    return fosc <= 0 || bitrate <= 0 ? can_bit_timing::invalid()
+        : can_bit_timing::withinTolerance(can_bit_timing::searchBrp(
+            limits, fosc, bitrate, sample_point, limits.brp_min, can_bit_timing::invalid()));
+}
+
+// Same answer as solveBitTiming() without the recursion depth
+inline CANBitTiming findBitTiming(const CANBitTimingLimits& limits, long fosc,
+                                  long bitrate, int sample_point) {
+    if (fosc <= 0 || bitrate <= 0) {
+        return can_bit_timing::invalid();
+    }
+
+    CANBitTiming best = can_bit_timing::invalid();
+    for (long brp = limits.brp_min; brp <= limits.brp_max; brp++) {
+        for (int tq = limits.tq_min; tq <= limits.tq_max; tq++) {
+            best = can_bit_timing::pick(
+                can_bit_timing::candidate(limits, fosc, bitrate, sample_point, brp, tq), best);
+        }
+    }
+
+    return can_bit_timing::withinTolerance(best);
+}
+
+#endif // CAN_BIT_TIMING_H
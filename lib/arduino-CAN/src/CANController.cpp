@@ -15,6 +15,7 @@ CANControllerClass::CANControllerClass(const int instance_id, Stream* debug)
         _instances[instance_id] = this;
     }
     _debug = debug;
+    memset(&_latency, 0, sizeof(_latency));
 }
 
 void CANControllerClass::configureCallback(TCallback callback)
@@ -71,32 +72,110 @@ void CANControllerClass::_attachInterruptToInstance()
     configureHardwareInterrupt(interruptHandler);
 }
 
+int CANControllerClass::startInterruptTask(UBaseType_t priority, BaseType_t core)
+{
+    if (_interruptTask) {
+        return 1;
+    }
+
+    char name[16];
+    snprintf(name, sizeof(name), "can_irq%d", _instance_id);
+
+    if (xTaskCreatePinnedToCore(_interruptTaskLoop, name, CAN_INTERRUPT_TASK_STACK,
+            this, priority, &_interruptTask, core) != pdPASS) {
+        if (_debug) _debug->printf("CANControllerClass failed to start interrupt task for instance %d\n", _instance_id);
+        _interruptTask = nullptr;
+        return -1;
+    }
+
+    if (_debug) _debug->printf("CANControllerClass instance %d interrupts serviced by task on core %d, priority %u\n",
+        _instance_id, (int)core, (unsigned int)priority);
+    return 1;
+}
+
+void CANControllerClass::_interruptTaskLoop(void* arg)
+{
+    CANControllerClass* controller = (CANControllerClass*)arg;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        int64_t edge = controller->_edgeTime;
+        controller->_edgePending = false;
+
+        unsigned long latency = (unsigned long)(esp_timer_get_time() - edge);
+        int bucket = 0;
+        while (bucket < CAN_LATENCY_BUCKETS - 1 && latency >= (8UL << bucket)) {
+            bucket++;
+        }
+        controller->_latency.buckets[bucket]++;
+        controller->_latency.count++;
+        if (latency > controller->_latency.max_us) {
+            controller->_latency.max_us = latency;
+        }
+
+        controller->_serviceEdgeTime = edge;
+        controller->handleInterrupt();
+    }
+}
+
+// Only for the interrupt task, handleInterrupt() in the ISR has to finish the job itself
+void CANControllerClass::retriggerInterrupt()
+{
+    if (!_edgePending) {
+        _edgeTime = esp_timer_get_time();
+        _edgePending = true;
+    }
+
+    xTaskNotifyGive(_interruptTask);
+}
+
+// Runs in the GPIO ISR, so no SPI and nothing outside IRAM
+void IRAM_ATTR CANControllerClass::_onEdge()
+{
+    if (!_interruptTask) {
+        _serviceEdgeTime = esp_timer_get_time();
+        handleInterrupt();
+        return;
+    }
+
+    // Keep the oldest unserviced edge, that's the one the latency is measured from
+    if (!_edgePending) {
+        _edgeTime = esp_timer_get_time();
+        _edgePending = true;
+    }
+
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(_interruptTask, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
 // Static interrupt handlers for each instance
-void CANControllerClass::onInterrupt0()
+void IRAM_ATTR CANControllerClass::onInterrupt0()
 {
     // if (_debug) _debug->printf("CANControllerClass interrupt on instance 0\n");
     if (_instances[0]) {
-        _instances[0]->handleInterrupt();
+        _instances[0]->_onEdge();
     }
 }
 
-void CANControllerClass::onInterrupt1()
+void IRAM_ATTR CANControllerClass::onInterrupt1()
 {
     if (_instances[1]) {
-        _instances[1]->handleInterrupt();
+        _instances[1]->_onEdge();
     }
 }
 
-void CANControllerClass::onInterrupt2()
+void IRAM_ATTR CANControllerClass::onInterrupt2()
 {
     if (_instances[2]) {
-        _instances[2]->handleInterrupt();
+        _instances[2]->_onEdge();
     }
 }
 
-void CANControllerClass::onInterrupt3()
+void IRAM_ATTR CANControllerClass::onInterrupt3()
 {
     if (_instances[3]) {
-        _instances[3]->handleInterrupt();
+        _instances[3]->_onEdge();
     }
 }
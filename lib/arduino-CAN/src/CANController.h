@@ -2,10 +2,22 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 
 #include <Arduino.h>
+#include <esp_timer.h>
 
 // Maximum number of CAN controller instances supported
 #define MAX_CAN_CONTROLLER_INSTANCES 4
 
+// ISR to task latency histogram, bucket n counts latencies below 2^(n+3) us,
+// the last bucket counts everything slower
+#define CAN_LATENCY_BUCKETS 10
+#define CAN_INTERRUPT_TASK_STACK 4096
+
+struct CANInterruptLatency {
+    unsigned long buckets[CAN_LATENCY_BUCKETS];
+    unsigned long count;
+    unsigned long max_us;
+};
+
 typedef void (*TCallback)(int);
 typedef void (*TErrorCallback)(int, int);
 
@@ -14,11 +26,62 @@ struct CANFrame {
     bool is_extended;
     bool is_remote;
     bool is_retransmit;
+    uint8_t action; // CAN_ACTION_* bits from the receive classifier, fits in the padding
     int data_len;
     char data[8];
-    unsigned long timestamp;
+    int64_t timestamp; // esp_timer_get_time() in us, received frames are stamped at the INT edge
+};
+
+// 16 byte storage form of a CANFrame for buffers and captures. The timestamp
+// keeps its low 24 bits (16.7 s) and is rebuilt relative to the unpack time,
+// so a packed frame has to be unpacked within that window.
+#define CAN_PACKED_ID_MASK         0x1FFFFFFFUL
+#define CAN_PACKED_FLAG_EXTENDED   (1UL << 29)
+#define CAN_PACKED_FLAG_REMOTE     (1UL << 30)
+#define CAN_PACKED_FLAG_RETRANSMIT (1UL << 31)
+#define CAN_PACKED_TIMESTAMP_MASK  0xFFFFFF
+#define CAN_PACKED_DLC_MASK        0x0F
+#define CAN_PACKED_ACTION_SHIFT    4
+
+struct CANPackedFrame {
+    alignas(8) uint8_t data[8];
+    uint32_t id;          // 29-bit id plus the CAN_PACKED_FLAG_* bits
+    uint8_t dlc;          // DLC in the low nibble, the low 4 action bits in the high one
+    uint8_t timestamp[3]; // Low 24 bits of the microsecond timestamp, little endian
 };
 
+static_assert(sizeof(CANPackedFrame) == 16, "CANPackedFrame must stay 16 bytes");
+
+inline void packFrame(CANPackedFrame& packed, const CANFrame& frame) {
+    packed.id = (frame.id & CAN_PACKED_ID_MASK)
+        | (frame.is_extended ? CAN_PACKED_FLAG_EXTENDED : 0)
+        | (frame.is_remote ? CAN_PACKED_FLAG_REMOTE : 0)
+        | (frame.is_retransmit ? CAN_PACKED_FLAG_RETRANSMIT : 0);
+    packed.dlc = (frame.data_len < 0 ? 0 : (frame.data_len > 8 ? 8 : frame.data_len))
+        | (frame.action << CAN_PACKED_ACTION_SHIFT);
+    memcpy(packed.data, frame.data, 8);
+
+    uint32_t stamp = (uint32_t)frame.timestamp;
+    packed.timestamp[0] = stamp;
+    packed.timestamp[1] = stamp >> 8;
+    packed.timestamp[2] = stamp >> 16;
+}
+
+// now is an esp_timer_get_time() value taken after the frame was packed
+inline void unpackFrame(CANFrame& frame, const CANPackedFrame& packed, int64_t now) {
+    frame.id = packed.id & CAN_PACKED_ID_MASK;
+    frame.is_extended = (packed.id & CAN_PACKED_FLAG_EXTENDED) ? true : false;
+    frame.is_remote = (packed.id & CAN_PACKED_FLAG_REMOTE) ? true : false;
+    frame.is_retransmit = (packed.id & CAN_PACKED_FLAG_RETRANSMIT) ? true : false;
+    frame.data_len = packed.dlc & CAN_PACKED_DLC_MASK;
+    frame.action = packed.dlc >> CAN_PACKED_ACTION_SHIFT;
+    memcpy(frame.data, packed.data, 8);
+
+    uint32_t stamp = packed.timestamp[0] | (packed.timestamp[1] << 8) | ((uint32_t)packed.timestamp[2] << 16);
+    uint32_t age = ((uint32_t)now - stamp) & CAN_PACKED_TIMESTAMP_MASK;
+    frame.timestamp = now - age;
+}
+
 class CANControllerClass {
 
 public:
@@ -28,6 +91,14 @@ public:
 
   // Has a frame been recieved
   int available();
+
+  int getInstanceId() const { return _instance_id; }
+
+  // Service interrupts from a task instead of the GPIO ISR. The ISR then only
+  // timestamps the edge and notifies the task, which does all the SPI work.
+  int startInterruptTask(UBaseType_t priority, BaseType_t core);
+  TaskHandle_t getInterruptTask() const { return _interruptTask; }
+  CANInterruptLatency getInterruptLatency() const { return _latency; }
   
   static void onInterrupt0();
   static void onInterrupt1();
@@ -41,6 +112,11 @@ protected:
 
   // These are used by the derived classes
   void doCallback();
+  bool hasInterruptTask() const { return _interruptTask != nullptr; }
+  // When the INT edge being serviced by handleInterrupt() fired
+  int64_t edgeTime() const { return _serviceEdgeTime; }
+  // Runs handleInterrupt() again from the task without a new edge, needs the task
+  void retriggerInterrupt();
   static Stream* _debug;
 
 private:
@@ -51,4 +127,13 @@ private:
   TErrorCallback _onError;
 
   void _attachInterruptToInstance();      
+
+  TaskHandle_t _interruptTask = nullptr;
+  volatile int64_t _edgeTime = 0;
+  volatile bool _edgePending = false;
+  int64_t _serviceEdgeTime = 0;
+  CANInterruptLatency _latency;
+
+  void _onEdge();
+  static void _interruptTaskLoop(void* arg);
 };
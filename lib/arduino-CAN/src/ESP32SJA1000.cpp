@@ -48,9 +48,16 @@ ESP32SJA1000Class::ESP32SJA1000Class(const int instance_id, Stream* debug) :
   CANControllerClass(instance_id, debug),
   _rxPin(DEFAULT_CAN_RX_PIN),
   _txPin(DEFAULT_CAN_TX_PIN),
+  _samplePoint(SJA1000_DEFAULT_SAMPLE_POINT)
 {
 }
 
+// Permille of the bit, e.g. 750 or 875
+void ESP32SJA1000Class::setSamplePoint(int samplePoint)
+{
+  _samplePoint = samplePoint;
+}
+
 int ESP32SJA1000Class::begin(long baudRate)
 {
   CANControllerClass::begin(baudRate);
@@ -72,71 +79,16 @@ int ESP32SJA1000Class::begin(long baudRate)
 
   modifyRegister(REG_CDR, 0x80, 0x80); // pelican mode
 
-  // Masks:
-  // 0xc0: bits 6-7
-  // 0x3f: bits 0-5
-  //
-  // 0x80: bit 7
-  // 0x70: bits 4-6
-  // 0x0f: bits 0-3
-  //
-  // Validate with python:
-  // format(ord(chr(0xff & ~0x07 | 0x40)), 'b').zfill(8)
-
-  // Final SJW, BRP, TSEG1, and TSEG2 values are regval + 1
-  uint8_t sjw, brp, ts, tseg1, tseg2;
-  
-  switch (baudRate) {
-    case (long)500E3:
-      // Target config is 500kbps, 75% sample point, triple sampling disabled
-      // ESP32 has an 80 Mhz APB clock (79998976 hz to be exact), 
-      // 80E6 / 500E3 = 160
-      // So theoretically, (BRP +1) * (1 + TSEG1+1 + TSEG2+1) must equal 160
-	  // The TWAI library 500k settings are brp=8, tseg_1=15, tseg_2=4, sjw=3, triple_sampling=false
-      // Which is 8 * (1 + 15 + 4) = 160
-      // But that doesn't seem to work at all 
-      // The ESP32-WROOM-32E datasheet says the crystal on this board is 40 Mhz 
-      // The TJA1000 datasheet says the clock is 24 Mhz
-	  // The clock divider is set to 0x00
-	  // The TJA1000 datasheet says CLKDIV 0x00 = 2 and 0x01 = 1
-	  // So let's do some experiments
-
-	  // 20 Mhz = 20E6/500E3 = 40 = 2x20; brp=2; 20x.75=15 (75% sample point); tseg1=15; 20-15=5; tseg2=5;
-	  // Acks first scanner frame, sends response, scaner acks, triggers CAN error on next scanner tx bit
-	  sjw = 2; ts = 0; brp = 2, tseg1 = 15, tseg2 = 5;
-	  
-	  // Same: sjw = 2; ts = 0; brp = 2, tseg1 = 14, tseg2 = 6;
-	  // Nope: sjw = 2; ts = 0; brp = 2, tseg1 = 15, tseg2 = 6;
-	  // sjw = 2; ts = 0; brp = 2, tseg1 = 16, tseg2 = 4;
-
-	  // 24 Mhz = 24E6/500E3 = 48 = 3x16; brp=3; 16x.75=12, tseg1=12; 16-12=4; tseg2=4;
-	  // Triggers error on first scanner frame CRC
-	  // sjw = 3; ts = 0; brp = 3, tseg1 = 12, tseg2 = 4;
-	  
-	  // 12 Mhz = 12E6/500E3 = 24 = 1x24; brp=1; 24*.75=18; tseg1=18; 24-18=6; tseg2=6; 
-      // Triggers CAN error after first scanner tx bit
-	  // sjw = 3; ts = 0; brp = 1, tseg1 = 18, tseg2 = 6;
-	  
-	  // 40 Mhz = 40E6/500E3 = 80 = 4x20; brp=4; 20x.75=15 (75% sample point); tseg1=15; 20-15=5; tseg2=5;
-	  // Triggers error after first scanner tx data bit
-	  // sjw = 3; ts = 0; brp = 4, tseg1 = 15, tseg2 = 5;
-
-	  // 80 Mhz = 80E6/500E3 = 160 = 8x20; brp=8; 20x.75=15; tseg1=15; 20-15=5; tseg2=5;
-	  // Triggers error after first scanner tx data bit
-	  // sjw = 3; ts = 0; brp = 8, tseg1 = 15, tseg2 = 5;
-
-      modifyRegister(REG_BTR0, 0xc0, sjw -1 << 6);   // SJW (bits 6-7) -1 because final value is regval+1
-      modifyRegister(REG_BTR0, 0x3f, brp -1);        // BRP (bits 0-5) -1 because final value is regval+1
-      modifyRegister(REG_BTR1, 0x80, ts << 7);       // Triple Sampling (bit 7)
-      modifyRegister(REG_BTR1, 0x70, tseg2 -1 << 4); // TSEG2 (bits 4-6) -1 because final value is regval+1
-      modifyRegister(REG_BTR1, 0x0f, tseg1 -2);      // TSEG1 (bits 0-3) -2 to account for regval+1 + SYNC bit
-      break;
-
-    default:
-      return 0;
-      break;
+  // The controller is clocked from the 80 MHz APB clock
+  CANBitTiming timing = findBitTiming(SJA1000_BIT_TIMING_LIMITS, APB_CLK_FREQ, baudRate, _samplePoint);
+  if (!timing.valid) {
+    return 0;
   }
 
+  // Register fields hold value - 1, triple sampling stays off
+  writeRegister(REG_BTR0, ((timing.sjw - 1) << 6) | (timing.brp - 1));
+  writeRegister(REG_BTR1, ((timing.tseg2 - 1) << 4) | (timing.tseg1 - 1));
+
   writeRegister(REG_IER, 0xff); // enable all interrupts
 
   // set filters to allow anything
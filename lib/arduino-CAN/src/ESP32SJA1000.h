@@ -3,6 +3,11 @@
 #ifdef ESPSJA1000
 
 #include "CANController.h"
+#include "CANBitTiming.h"
+
+// SYNC + TSEG1 (1-16) + TSEG2 (1-8), BRP 1-64, SJW 1-4
+constexpr CANBitTimingLimits SJA1000_BIT_TIMING_LIMITS = { 1, 64, 3, 25, 1, 16, 1, 8, 4 };
+#define SJA1000_DEFAULT_SAMPLE_POINT 750
 
 struct SJA1000Status {
     uint32_t apb_freq;
@@ -28,6 +33,7 @@ public:
   virtual int filterExtended(long id, long mask);
   
   void setPins(int rx, int tx);
+  void setSamplePoint(int samplePoint);
 
   void dumpRegisters(Stream& out);
   uint8_t readRegister(uint8_t address);
@@ -43,6 +49,7 @@ protected:
 private:
   gpio_num_t _rxPin;
   gpio_num_t _txPin;
+  int _samplePoint;
   bool _loopback;
   intr_handle_t _intrHandle;
   bool _transmitting;
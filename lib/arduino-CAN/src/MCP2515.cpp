@@ -2,6 +2,7 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 
 #include "MCP2515.h"
+#include <driver/pcnt.h>
 
 #define REG_BFPCTRL                0x0c
 #define REG_TXRTSCTRL              0x0d
@@ -19,11 +20,14 @@
 #define FLAG_RXnIE(n)              (0x01 << n)
 #define FLAG_RXnIF(n)              (0x01 << n)
 #define FLAG_TXnIF(n)              (0x04 << n)
+#define FLAG_TXnIE(n)              (0x04 << n)
 
-#define REG_RXFnSIDH(n)            (0x00 + (n * 4))
-#define REG_RXFnSIDL(n)            (0x01 + (n * 4))
-#define REG_RXFnEID8(n)            (0x02 + (n * 4))
-#define REG_RXFnEID0(n)            (0x03 + (n * 4))
+// RXF0-2 start at 0x00, RXF3-5 start at 0x10
+#define REG_RXFn(n)                ((n) < 3 ? ((n) * 4) : (0x10 + ((n) - 3) * 4))
+#define REG_RXFnSIDH(n)            (REG_RXFn(n) + 0)
+#define REG_RXFnSIDL(n)            (REG_RXFn(n) + 1)
+#define REG_RXFnEID8(n)            (REG_RXFn(n) + 2)
+#define REG_RXFnEID0(n)            (REG_RXFn(n) + 3)
 
 #define REG_RXMnSIDH(n)            (0x20 + (n * 0x04))
 #define REG_RXMnSIDL(n)            (0x21 + (n * 0x04))
@@ -31,6 +35,13 @@
 #define REG_RXMnEID0(n)            (0x23 + (n * 0x04))
 
 #define REG_TXBnCTRL(n)            (0x30 + (n * 0x10))
+#define FLAG_TXP_MASK              0x03
+#define TXP_LEVELS                 4
+#define FLAG_TXREQ                 0x08
+#define FLAG_TXERR                 0x10
+#define FLAG_MLOA                  0x20
+#define FLAG_ABTF                  0x40
+
 #define REG_TXBnSIDH(n)            (0x31 + (n * 0x10))
 #define REG_TXBnSIDL(n)            (0x32 + (n * 0x10))
 #define REG_TXBnEID8(n)            (0x33 + (n * 0x10))
@@ -54,23 +65,70 @@
 #define FLAG_RXM0                  0x20
 #define FLAG_RXM1                  0x40
 
+#define FLAG_BTLMODE               0x80 // CNF2, PS2 length comes from CNF3
+#define FLAG_CLKEN                 0x04 // CANCTRL, drive CLKOUT
+#define FLAG_SOF                   0x80 // CNF3, CLKOUT carries start-of-frame instead of the clock
+
+// SOF pulses are accumulated in software every time the counter hits this
+#define SOF_COUNTER_LIMIT          30000
+
 #define CMD_WRITE				   0x02
 #define CMD_READ				   0x03
 #define CMD_UPDATE				   0x05
 #define CMD_RESET				   0xC0
+#define CMD_READ_RX_BUFFER(n)      (0x90 | (n << 2)) // Starts at RXBnSIDH, clears RXnIF on CS high
+#define CMD_READ_STATUS            0xA0
+#define CMD_LOAD_TX_BUFFER(n)      (0x40 | (n << 1)) // Starts at TXBnSIDH
+#define CMD_RTS(n)                 (0x80 | (0x01 << n))
+
+// READ STATUS response bits
+#define STATUS_RXnIF(n)            (0x01 << n)
+#define STATUS_TXnREQ(n)           (0x04 << (n * 2))
+
+// SIDH, SIDL, EID8, EID0, DLC and D0-D7 as returned by READ RX BUFFER
+#define RX_BUFFER_IMAGE_LEN        13
+
+// Arduino numbers its buses one above the IDF hosts, HSPI_HOST -> HSPI
+#define ARDUINO_SPI_BUS(host)      ((host) + 1)
+// MCP2515 SO is valid up to 45 ns after SCK falls
+#define SPI_INPUT_DELAY_NS         45
+// DMA receives whole 32-bit words, anything else goes through a bounce buffer
+#define SPI_DMA_LENGTH(n)          (((n) + 3) & ~3)
 
 #define CANSTAT_NORMAL 			   0x00
 #define CANSTAT_CONFIG 			   0x80
+#define CANSTAT_MODE_MASK          0xE0
 
 #define FLAG_TX0IF 0x04  // Bit 2
 #define FLAG_TX1IF 0x08  // Bit 3
 #define FLAG_TX2IF 0x10  // Bit 4
 
 #define FLAG_ERRIF  0x20 // bit 5 of REG_CANINTF (0x2C) 
+#define FLAG_ERRIE  0x20 // bit 5 of REG_CANINTE (0x2B)
 #define REG_EFLG    0x2D // Error Flag Register
+#define FLAG_RX0OVR 0x40
+#define FLAG_RX1OVR 0x80
+#define FLAG_BUKT   0x04 // RXB0CTRL, roll over into RXB1 when RXB0 is full
+
+#define FLAG_TXIF_ANY (FLAG_TX0IF | FLAG_TX1IF | FLAG_TX2IF)
+#define FLAG_RXIF_ANY (FLAG_RXnIF(0) | FLAG_RXnIF(1))
+
+// Upper bound on flag servicing passes per interrupt, in case a flag won't clear
+#define MAX_INTERRUPT_PASSES 8
 #define REG_TEC     0x1C // Transmit Error Counter
 #define REG_REC     0x1D // Receive Error Counter
 
+// The crystal/bitrate pairs of the old CNF lookup table still solve. 8 MHz at
+// 1 Mbps is gone, it only fits in 4 TQ with PS2 = 1, below the datasheet minimum.
+static_assert(!mcp2515BitTiming(8000000, 1000000, MCP2515_DEFAULT_SAMPLE_POINT).valid, "8 MHz, 1 Mbps");
+static_assert(mcp2515BitTiming(16000000, 1000000, MCP2515_DEFAULT_SAMPLE_POINT).valid, "16 MHz, 1 Mbps");
+static_assert(mcp2515BitTiming(8000000, 666666, MCP2515_DEFAULT_SAMPLE_POINT).valid, "8 MHz, 666 kbps");
+static_assert(mcp2515BitTiming(8000000, 500000, MCP2515_DEFAULT_SAMPLE_POINT).sample_point == 750, "8 MHz, 500 kbps");
+static_assert(mcp2515BitTiming(8000000, 5000, MCP2515_DEFAULT_SAMPLE_POINT).valid, "8 MHz, 5 kbps");
+static_assert(mcp2515BitTiming(16000000, 500000, 875).sample_point == 875, "16 MHz, 500 kbps");
+static_assert(mcp2515BitTiming(16000000, 5000, MCP2515_DEFAULT_SAMPLE_POINT).valid, "16 MHz, 5 kbps");
+static_assert(!mcp2515BitTiming(8000000, 3000000, MCP2515_DEFAULT_SAMPLE_POINT).valid, "8 MHz can't do 3 Mbps");
+
 // Constructor
 MCP2515Class::MCP2515Class(const int instance_id, Stream* debug): 
     CANControllerClass(instance_id, debug)
@@ -84,7 +142,28 @@ MCP2515Class::MCP2515Class(const int instance_id, Stream* debug):
   _spiMisoPin = -1;
   _spiMosiPin = -1;
   _clockFrequency = 8E6;
+  _samplePoint = MCP2515_DEFAULT_SAMPLE_POINT;
   _spiInitialized = false;
+  _spiFrequency = 1000000;
+  _spiBitOrder = MSBFIRST;
+  _spiMode = SPI_MODE0;
+  _spiBackend = MCP2515_SPI_ARDUINO;
+  _spiHost = VSPI_HOST;
+  _spi = &SPI;
+  _spiDevice = nullptr;
+  _spiLock = nullptr;
+  memset(&_stats, 0, sizeof(_stats));
+  _rxTimestamp = 0;
+
+  _txHead = 0;
+  _txTail = 0;
+  _txQueued = 0;
+  memset(_txMailboxes, 0, sizeof(_txMailboxes));
+  _txDeadline = 0;
+  _onTransmit = nullptr;
+
+  _sofPin = -1;
+  _sofOverflows = 0;
 }
 
 void MCP2515Class::setSPIPins(int sck, int miso, int mosi, int cs, int irq)
@@ -98,22 +177,79 @@ void MCP2515Class::setSPIPins(int sck, int miso, int mosi, int cs, int irq)
 
 void MCP2515Class::setSPISettings(uint32_t frequency, uint8_t bitOrder, uint8_t mode)
 {
+  if (frequency > MCP2515_MAX_SPI_FREQUENCY) {
+    frequency = MCP2515_MAX_SPI_FREQUENCY;
+  }
+
+  _spiFrequency = frequency;
+  _spiBitOrder = bitOrder;
+  _spiMode = mode;
   _spiSettings = SPISettings(frequency, bitOrder, mode);
 }
 
+// Must be picked before begin()
+void MCP2515Class::setSPIBackend(MCP2515SPIBackend backend)
+{
+  _spiBackend = backend;
+}
+
+// Controllers on different hosts transfer in parallel, controllers sharing a
+// host take turns. The global Arduino SPI object is VSPI.
+void MCP2515Class::setSPIHost(spi_host_device_t host)
+{
+  static SPIClass* buses[3] = { nullptr };
+
+  _spiHost = host;
+  if (host == VSPI_HOST) {
+    _spi = &SPI;
+    return;
+  }
+
+  if (!buses[host]) {
+    buses[host] = new SPIClass(ARDUINO_SPI_BUS(host));
+  }
+  _spi = buses[host];
+}
+
 void MCP2515Class::setClockFrequency(long clockFrequency)
 {
   _clockFrequency = clockFrequency;
 }
 
+// Permille of the bit, e.g. 750 or 875. The closest the oscillator allows is used.
+void MCP2515Class::setSamplePoint(int samplePoint)
+{
+  _samplePoint = samplePoint;
+}
+
+// CLKOUT of the MCP2515 wired to this pin lets us count every frame on the bus
+void MCP2515Class::setSOFPin(int sof)
+{
+  _sofPin = sof;
+}
+
 int MCP2515Class::begin(long baudRate, bool initializeSPI)
 {
-  pinMode(_csPin, OUTPUT);
   pinMode(_intPin, INPUT_PULLUP);
 
+  if (_spiBackend == MCP2515_SPI_ESP_IDF) {
+    // Polling transactions block on a mutex, they can't run inside the ISR
+    if (!hasInterruptTask()) {
+      return -8;
+    }
+  } else {
+    pinMode(_csPin, OUTPUT);
+  }
+
   // Initialize SPI only if requested and not already initialized
   if (initializeSPI && !_spiInitialized) {
-    SPI.begin(_spiSckPin, _spiMisoPin, _spiMosiPin, _csPin);
+    if (_spiBackend == MCP2515_SPI_ESP_IDF) {
+      if (_beginSPIDevice() != 1) {
+        return -1;
+      }
+    } else {
+      _spi->begin(_spiSckPin, _spiMisoPin, _spiMosiPin, _csPin);
+    }
     _spiInitialized = true;
     delay(500);
   }
@@ -123,70 +259,50 @@ int MCP2515Class::begin(long baudRate, bool initializeSPI)
 	return -4;
   }
 
-  const struct {
-    long clockFrequency;
-    long baudRate;
-    uint8_t cnf[3];
-  } CNF_MAPPER[] = {
-    {  (long)8E6, (long)1000E3, { 0x00, 0x80, 0x00 } },
-    {  (long)8E6, (long)666666, { 0xC0, 0xB8, 0x01 } },
-    {  (long)8E6,  (long)500E3, { 0x00, 0x90, 0x02 } },
-    {  (long)8E6,  (long)250E3, { 0x00, 0xb1, 0x05 } },
-    {  (long)8E6,  (long)200E3, { 0x00, 0xb4, 0x06 } },
-    {  (long)8E6,  (long)125E3, { 0x01, 0xb1, 0x05 } },
-    {  (long)8E6,  (long)100E3, { 0x01, 0xb4, 0x06 } },
-    {  (long)8E6,   (long)80E3, { 0x01, 0xbf, 0x07 } },
-    {  (long)8E6,   (long)50E3, { 0x03, 0xb4, 0x06 } },
-    {  (long)8E6,   (long)40E3, { 0x03, 0xbf, 0x07 } },
-    {  (long)8E6,   (long)20E3, { 0x07, 0xbf, 0x07 } },
-    {  (long)8E6,   (long)10E3, { 0x0f, 0xbf, 0x07 } },
-    {  (long)8E6,    (long)5E3, { 0x1f, 0xbf, 0x07 } },
-
-    { (long)16E6, (long)1000E3, { 0x00, 0xd0, 0x82 } },
-    { (long)16E6, (long)666666, { 0xC0, 0xF8, 0x81 } },
-    { (long)16E6,  (long)500E3, { 0x00, 0xf0, 0x86 } },
-    { (long)16E6,  (long)250E3, { 0x41, 0xf1, 0x85 } },
-    { (long)16E6,  (long)200E3, { 0x01, 0xfa, 0x87 } },
-    { (long)16E6,  (long)125E3, { 0x03, 0xf0, 0x86 } },
-    { (long)16E6,  (long)100E3, { 0x03, 0xfa, 0x87 } },
-    { (long)16E6,   (long)80E3, { 0x03, 0xff, 0x87 } },
-    { (long)16E6,   (long)50E3, { 0x07, 0xfa, 0x87 } },
-    { (long)16E6,   (long)40E3, { 0x07, 0xff, 0x87 } },
-    { (long)16E6,   (long)20E3, { 0x0f, 0xff, 0x87 } },
-    { (long)16E6,   (long)10E3, { 0x1f, 0xff, 0x87 } },
-    { (long)16E6,    (long)5E3, { 0x3f, 0xff, 0x87 } },
-  };
+  CANBitTiming timing = findBitTiming(MCP2515_BIT_TIMING_LIMITS, _clockFrequency, baudRate, _samplePoint);
+  if (!timing.valid) {
+	return -2;
+  }
 
-  const uint8_t* cnf = NULL;
+  if (_debug) _debug->printf("MCP2515Class bit timing: BRP %ld, %d TQ, sample point %d.%d%%, error %ld ppm\n",
+      timing.brp, timing.tq, timing.sample_point / 10, timing.sample_point % 10, timing.error_ppm);
 
-  for (unsigned int i = 0; i < (sizeof(CNF_MAPPER) / sizeof(CNF_MAPPER[0])); i++) {
-	if (CNF_MAPPER[i].clockFrequency == _clockFrequency && CNF_MAPPER[i].baudRate == baudRate) {
-	  cnf = CNF_MAPPER[i].cnf;
-	  break;
-	}
+  // TSEG1 is split between PropSeg and PS1, PS1 gets the larger half
+  int ps1 = (timing.tseg1 + 1) / 2;
+  if (ps1 > 8) {
+    ps1 = 8;
   }
+  int prop = timing.tseg1 - ps1;
 
-  if (cnf == NULL) {
-	return -2;
-  }
+  const uint8_t cnf[3] = {
+    (uint8_t)(((timing.sjw - 1) << 6) | (timing.brp - 1)),
+    (uint8_t)(FLAG_BTLMODE | ((ps1 - 1) << 3) | (prop - 1)),
+    (uint8_t)(timing.tseg2 - 1)
+  };
 
   writeRegister(REG_CNF1, cnf[0]);
   if (readRegister(REG_CNF1) != cnf[0]) { return -5; }
   writeRegister(REG_CNF2, cnf[1]);
   if (readRegister(REG_CNF2) != cnf[1]) { return -6; }
-  writeRegister(REG_CNF3, cnf[2]);
-  if (readRegister(REG_CNF3) != cnf[2]) { return -7; }
+  uint8_t cnf3 = cnf[2] | (_sofPin >= 0 ? FLAG_SOF : 0x00);
+  writeRegister(REG_CNF3, cnf3);
+  if (readRegister(REG_CNF3) != cnf3) { return -7; }
 
-  writeRegister(REG_CANINTE, FLAG_RXnIE(1) | FLAG_RXnIE(0));
+  writeRegister(REG_CANINTE, FLAG_RXnIE(1) | FLAG_RXnIE(0) |
+                FLAG_TXnIE(0) | FLAG_TXnIE(1) | FLAG_TXnIE(2) | FLAG_ERRIE);
   writeRegister(REG_BFPCTRL, 0x00);
   writeRegister(REG_TXRTSCTRL, 0x00);
-  writeRegister(REG_RXBnCTRL(0), FLAG_RXM1 | FLAG_RXM0);
+  writeRegister(REG_RXBnCTRL(0), FLAG_RXM1 | FLAG_RXM0 | FLAG_BUKT);
   writeRegister(REG_RXBnCTRL(1), FLAG_RXM1 | FLAG_RXM0);
 
+  if (_sofPin >= 0) {
+    _beginSOFCounter();
+  }
+
   // 0x00 = Normal mode
-  writeRegister(REG_CANCTRL, CANSTAT_NORMAL);
+  writeRegister(REG_CANCTRL, CANSTAT_NORMAL | (_sofPin >= 0 ? FLAG_CLKEN : 0x00));
 
-  if ((readRegister(REG_CANSTAT) & 0xE0) != CANSTAT_NORMAL) {
+  if ((readRegister(REG_CANSTAT) & CANSTAT_MODE_MASK) != CANSTAT_NORMAL) {
     return -3;
   }
   
@@ -194,6 +310,62 @@ int MCP2515Class::begin(long baudRate, bool initializeSPI)
   return 1;
 }
 
+// Programs the six acceptance filters and two masks, the chip then drops
+// everything else without raising an interrupt
+int MCP2515Class::setFilters(const CANAcceptanceFilter& filter)
+{
+  if (setMode(CANSTAT_CONFIG) != 1) {
+    return -1;
+  }
+
+  for (int n = 0; n < 2; n++) {
+    writeIdRegisters(REG_RXMnSIDH(n), filter.masks[n], filter.extended, false);
+  }
+
+  for (int n = 0; n < 6; n++) {
+    writeIdRegisters(REG_RXFnSIDH(n), filter.filters[n], filter.extended, true);
+  }
+
+  // RXM = 00, receive only frames that match a filter
+  modifyRegister(REG_RXBnCTRL(0), FLAG_RXM1 | FLAG_RXM0, 0x00);
+  modifyRegister(REG_RXBnCTRL(1), FLAG_RXM1 | FLAG_RXM0, 0x00);
+
+  if (setMode(CANSTAT_NORMAL) != 1) {
+    return -2;
+  }
+
+  return 1;
+}
+
+// Back to receiving everything on the bus
+int MCP2515Class::clearFilters()
+{
+  if (setMode(CANSTAT_CONFIG) != 1) {
+    return -1;
+  }
+
+  modifyRegister(REG_RXBnCTRL(0), FLAG_RXM1 | FLAG_RXM0, FLAG_RXM1 | FLAG_RXM0);
+  modifyRegister(REG_RXBnCTRL(1), FLAG_RXM1 | FLAG_RXM0, FLAG_RXM1 | FLAG_RXM0);
+
+  if (setMode(CANSTAT_NORMAL) != 1) {
+    return -2;
+  }
+
+  return 1;
+}
+
+// Frames seen on the bus (ours included) since begin(), -1 without a SOF pin
+long MCP2515Class::busFrameCount()
+{
+  if (_sofPin < 0) {
+    return -1;
+  }
+
+  int16_t count = 0;
+  pcnt_get_counter_value((pcnt_unit_t)getInstanceId(), &count);
+  return (long)_sofOverflows * SOF_COUNTER_LIMIT + count;
+}
+
 void MCP2515Class::configureHardwareInterrupt(void (*interruptHandler)())
 {
     if (_debug) _debug->printf("MCP2515Class attaching hardware interrupt to pin %d\n", _intPin);
@@ -213,24 +385,92 @@ void MCP2515Class::configureHardwareInterrupt(void (*interruptHandler)())
 
 void MCP2515Class::handleInterrupt()
 {
-  // if (_debug) _debug->printf("MCP2515Class handleInterrupt called\n");
-  if (!(readRegister(REG_CANINTF) & (FLAG_RXnIF(0) | FLAG_RXnIF(1)))) {
-    return; // no frame in RXB0 or RXB1
+  // INT is edge triggered. If a flag is left set the line stays low and no
+  // further edge arrives, so keep servicing until CANINTF is clear. The task
+  // hands over after MAX_INTERRUPT_PASSES and comes back, see below. Inside
+  // the ISR nothing would bring us back, so it keeps going.
+  bool capped = hasInterruptTask();
+  for (int pass = 0; !capped || pass < MAX_INTERRUPT_PASSES; pass++) {
+    if (pass == MAX_INTERRUPT_PASSES) {
+      _stats.interrupt_pass_limit++;
+    }
+    // if (_debug) _debug->printf("MCP2515Class handleInterrupt called\n");
+    // Later passes pick up flags that were raised without a new edge, the
+    // best we know for those is that they were set before this read
+    int64_t stamp = pass == 0 ? edgeTime() : esp_timer_get_time();
+    unsigned long intf_transactions = _stats.spi_transactions;
+    unsigned long intf_bytes = _stats.spi_bytes;
+    uint8_t intf = readRegister(REG_CANINTF);
+    intf_transactions = _stats.spi_transactions - intf_transactions;
+    intf_bytes = _stats.spi_bytes - intf_bytes;
+
+    if (!(intf & (FLAG_RXIF_ANY | FLAG_TXIF_ANY | FLAG_ERRIF))) {
+      return;
+    }
+
+    if (intf & FLAG_ERRIF) {
+      handleErrorInterrupt();
+    }
+
+    if (intf & FLAG_TXIF_ANY) {
+      for (int n = 0; n < 3; n++) {
+        if (intf & FLAG_TXnIF(n)) {
+          uint8_t ctrl = readRegister(REG_TXBnCTRL(n));
+          modifyRegister(REG_CANINTF, FLAG_TXnIF(n), 0x00);
+          finishTransmit(n, TX_STATUS_COMPLETE, ctrl, stamp);
+        }
+      }
+
+      // Refill the mailboxes that just freed up
+      serviceTransmitQueue();
+    }
+
+    if (intf & FLAG_RXIF_ANY) {
+      unsigned long spi_transactions = _stats.spi_transactions;
+      unsigned long spi_bytes = _stats.spi_bytes;
+
+      _rxTimestamp = stamp;
+      doCallback();
+
+      // Receiving is charged with this pass's CANINTF read and the whole
+      // drain, including the READ STATUS that finds both buffers empty
+      _stats.rx_spi_transactions += _stats.spi_transactions - spi_transactions + intf_transactions;
+      _stats.rx_spi_bytes += _stats.spi_bytes - spi_bytes + intf_bytes;
+    }
   }
 
-  doCallback();
+  // Out of passes with INT still low. No new edge is coming, so queue another
+  // round on the task behind whatever else is waiting.
+  if (digitalRead(_intPin) == LOW) {
+    _stats.interrupt_pass_limit++;
+    retriggerInterrupt();
+  }
+}
+
+// RXnOVR means a frame arrived with both buffers full and was lost in the chip
+void MCP2515Class::handleErrorInterrupt()
+{
+  uint8_t eflg = readRegister(REG_EFLG);
+
+  _stats.error_interrupts++;
+  if (eflg & FLAG_RX0OVR) {
+    _stats.rx_overflow_rxb0++;
+  }
+  if (eflg & FLAG_RX1OVR) {
+    _stats.rx_overflow_rxb1++;
+  }
+
+  // Only the overflow bits are latched, the rest follow the error counters
+  if (eflg & (FLAG_RX0OVR | FLAG_RX1OVR)) {
+    modifyRegister(REG_EFLG, FLAG_RX0OVR | FLAG_RX1OVR, 0x00);
+  }
+  modifyRegister(REG_CANINTF, FLAG_ERRIF, 0x00);
 }
 
 int MCP2515Class::transmitFrame(const CANFrame frame)
 {
   // 1) pick a free mailbox
-  int n = -1;
-  for (int i = 0; i < 3; i++) {
-	  if (!(readRegister(REG_TXBnCTRL(i)) & 0x08)) {  // TXREQ==0?
-		  n = i;
-		  break;
-	  }
-  }
+  int n = claimMailbox(true);
 
   if (n < 0) {
 	  // all three mailboxes busy!
@@ -238,101 +478,366 @@ int MCP2515Class::transmitFrame(const CANFrame frame)
   }
 
   // 2) load ID/DLC/data
-  if (frame.is_extended) {
-    writeRegister(REG_TXBnSIDH(n), frame.id >> 21);
-    writeRegister(REG_TXBnSIDL(n), (((frame.id >> 18) & 0x07) << 5) | FLAG_EXIDE | ((frame.id >> 16) & 0x03));
-    writeRegister(REG_TXBnEID8(n), (frame.id >> 8) & 0xff);
-    writeRegister(REG_TXBnEID0(n), frame.id & 0xff);
-  } else {
-    writeRegister(REG_TXBnSIDH(n), frame.id >> 3);
-    writeRegister(REG_TXBnSIDL(n), frame.id << 5);
-    writeRegister(REG_TXBnEID8(n), 0x00);
-    writeRegister(REG_TXBnEID0(n), 0x00);
-  }
-
-  if (frame.is_retransmit) {
-    writeRegister(REG_TXBnDLC(n), 0x40 | frame.data_len);
-  } else {
-    writeRegister(REG_TXBnDLC(n), frame.data_len);
-
-    for (int i = 0; i < frame.data_len; i++) {
-      writeRegister(REG_TXBnD0(n) + i, frame.data[i]);
-    }
-  }
+  loadTxBuffer(n, frame);
 
   // 3) request transmit
-  writeRegister(REG_TXBnCTRL(n), 0x08);
+  requestToSend(n);
 
-  // 4) wait for TXREQ to clear, or abort on MLOA/ABTF/timeout
+  // 4) wait for TXREQ to clear, or abort on timeout. The chip retries lost
+  // arbitration and errors by itself, MLOA/TXERR don't mean the frame is dead.
   unsigned long start = millis();
   bool aborted = false;
-  while (readRegister(REG_TXBnCTRL(n)) & 0x08) {
-    uint8_t s = readRegister(REG_TXBnCTRL(n));
-    if (s & (0x10 /*ABTF*/ | 0x20 /*MLOA*/)) {
-      aborted = true;
-      break;
-    }
+  uint8_t s;
+  while ((s = readRegister(REG_TXBnCTRL(n))) & FLAG_TXREQ) {
     if (millis() - start > 10) {
-      // force‐abort if no ACK
-      modifyRegister(REG_CANCTRL, 0x10, 0x10); // ABAT=1
-      while (readRegister(REG_TXBnCTRL(n)) & 0x08) // yield();
-      modifyRegister(REG_CANCTRL, 0x10, 0x00); // ABAT=0
+      // Abort only our own mailbox if no ACK, ABAT would take the queued frames
+      // down too and nothing would finish them
+      modifyRegister(REG_TXBnCTRL(n), FLAG_TXREQ, 0x00);
+      while (readRegister(REG_TXBnCTRL(n)) & FLAG_TXREQ) { }
       aborted = true;
       break;
     }
-    // yield();
   }
 
-  // Print the status
-  uint8_t s = readRegister(REG_TXBnCTRL(n));
-  if (_debug) _debug->printf("TXB%d CTRL=0x%02X  TXREQ=%d  ABTF=%d  MLOA=%d\n",
+  if (aborted && _debug) {
+    s = readRegister(REG_TXBnCTRL(n));
+    _debug->printf("TXB%d CTRL=0x%02X  TXREQ=%d  ABTF=%d  MLOA=%d  TXERR=%d\n",
           n, s,
-          !!(s & 0x08),
-          !!(s & 0x10),
-          !!(s & 0x20));
+          !!(s & FLAG_TXREQ),
+          !!(s & FLAG_ABTF),
+          !!(s & FLAG_MLOA),
+          !!(s & FLAG_TXERR));
+  }
 
   // 5) clear interrupts & return
   modifyRegister(REG_CANINTF, FLAG_TXnIF(n), 0x00);
+  releaseMailbox(n);
+
+  if (!aborted) {
+    _stats.tx_direct++;
+  }
+
+  // Anything queued while we held the mailbox can go now
+  serviceTransmitQueue();
+
   return aborted ? 0 : 1;
 }
 
+void MCP2515Class::setTransmitDeadline(unsigned long deadline_us)
+{
+  _txDeadline = deadline_us;
+}
+
+void MCP2515Class::configureTransmitCallback(TTransmitCallback callback)
+{
+  _onTransmit = callback;
+}
+
+// Returns immediately. 1 if the frame was queued, 0 if the queue is full.
+int MCP2515Class::queueFrame(const CANFrame& frame)
+{
+  int64_t now = esp_timer_get_time();
+  bool queued = false;
+
+  portENTER_CRITICAL_SAFE(&_txMux);
+  if (_txQueued < MCP2515_TX_QUEUE_SIZE) {
+    TransmitEntry& entry = _txQueue[_txHead];
+    entry.frame = frame;
+    entry.queued_at = now;
+    // Never let a real deadline land on 0, that means "none"
+    entry.deadline = _txDeadline ? (((unsigned long)now + _txDeadline) | 1) : 0;
+    _txHead = (_txHead + 1) % MCP2515_TX_QUEUE_SIZE;
+    _txQueued++;
+    queued = true;
+  }
+  portEXIT_CRITICAL_SAFE(&_txMux);
+
+  if (!queued) {
+    _stats.tx_queue_full++;
+    return 0;
+  }
+
+  _stats.tx_queued++;
+  serviceTransmitQueue();
+  return 1;
+}
+
+// Feeds queued frames into free mailboxes and aborts frames that have been
+// waiting in a mailbox past their deadline. Called on every queueFrame() and
+// TX interrupt; call it periodically as well so deadlines fire on a dead bus.
+void MCP2515Class::serviceTransmitQueue()
+{
+  int64_t stamp = esp_timer_get_time();
+  // Deadlines are 32-bit and compared with wraparound
+  unsigned long now = (unsigned long)stamp;
+
+  for (int n = 0; n < 3; n++) {
+    portENTER_CRITICAL_SAFE(&_txMux);
+    TransmitMailbox& mailbox = _txMailboxes[n];
+    bool check = mailbox.busy && !mailbox.blocking && mailbox.entry.deadline;
+    bool expired = check && (long)(now - mailbox.entry.deadline) > 0;
+    bool abort_requested = mailbox.abort_requested;
+    if (expired) {
+      mailbox.abort_requested = true;
+    }
+    portEXIT_CRITICAL_SAFE(&_txMux);
+
+    if (!check || !expired) {
+      continue;
+    }
+
+    if (!abort_requested) {
+      // Clearing TXREQ aborts the frame unless it is already on the wire
+      modifyRegister(REG_TXBnCTRL(n), FLAG_TXREQ, 0x00);
+    }
+
+    // A successful send is finished by the TXnIF interrupt, an abort raises no
+    // flag at all (ABTF is only set by ABAT), so TXREQ clear without TXnIF is ours.
+    // CANINTF is read second, TXnIF is already set by the time TXREQ clears.
+    uint8_t ctrl = readRegister(REG_TXBnCTRL(n));
+    if (ctrl & FLAG_TXREQ) {
+      continue; // Still on the wire, look again on the next call
+    }
+    if (!(readRegister(REG_CANINTF) & FLAG_TXnIF(n))) {
+      finishTransmit(n, TX_STATUS_ABORTED, ctrl, esp_timer_get_time());
+    }
+  }
+
+  // A mailbox the chip still has pending is never reloaded, whatever the
+  // software state says
+  uint8_t status = _txQueued > 0 ? readStatus() : 0;
+
+  while (true) {
+    int n = -1;
+    uint8_t priority = 0;
+    bool stale = false;
+    TransmitEntry entry;
+
+    portENTER_CRITICAL_SAFE(&_txMux);
+    if (_txQueued > 0) {
+      entry = _txQueue[_txTail];
+      stale = entry.deadline && (long)(now - entry.deadline) > 0;
+
+      if (!stale) {
+        // With equal TXP the chip sends the highest numbered buffer first. Each
+        // frame gets a TXP below every queued frame still pending, so they go
+        // out in queue order. Once TXP 0 is in use the rest wait for it.
+        int lowest = TXP_LEVELS;
+        for (int i = 0; i < 3; i++) {
+          if (_txMailboxes[i].busy && !_txMailboxes[i].blocking && _txMailboxes[i].priority < lowest) {
+            lowest = _txMailboxes[i].priority;
+          }
+        }
+
+        for (int i = 0; lowest > 0 && i < 3; i++) {
+          if (!_txMailboxes[i].busy && !(status & STATUS_TXnREQ(i))) {
+            n = i;
+            priority = lowest - 1;
+            _txMailboxes[i].busy = true;
+            _txMailboxes[i].blocking = false;
+            _txMailboxes[i].abort_requested = false;
+            _txMailboxes[i].priority = priority;
+            _txMailboxes[i].entry = entry;
+            break;
+          }
+        }
+      }
+
+      if (stale || n >= 0) {
+        _txTail = (_txTail + 1) % MCP2515_TX_QUEUE_SIZE;
+        _txQueued--;
+      }
+    }
+    portEXIT_CRITICAL_SAFE(&_txMux);
+
+    if (stale) {
+      // Drop it, a late frame is worse than no frame
+      _stats.tx_stale++;
+      if (_onTransmit) {
+        CANTransmitResult result = {
+          .status = TX_STATUS_STALE,
+          .mailbox = -1,
+          .id = entry.frame.id,
+          .lost_arbitration = false,
+          .queued_at = entry.queued_at,
+          .completed_at = stamp
+        };
+        _onTransmit(getInstanceId(), result);
+      }
+      continue;
+    }
+
+    if (n < 0) {
+      break; // Queue empty, all mailboxes busy or out of priorities
+    }
+
+    modifyRegister(REG_TXBnCTRL(n), FLAG_TXP_MASK, priority);
+    loadTxBuffer(n, entry.frame);
+    requestToSend(n);
+  }
+}
+
+// Reserves a mailbox that is idle in software and in hardware
+int MCP2515Class::claimMailbox(bool blocking)
+{
+  int n = -1;
+  uint8_t status = readStatus();
+
+  portENTER_CRITICAL_SAFE(&_txMux);
+  for (int i = 0; i < 3; i++) {
+    if (!_txMailboxes[i].busy && !(status & STATUS_TXnREQ(i))) {
+      n = i;
+      _txMailboxes[i].busy = true;
+      _txMailboxes[i].blocking = blocking;
+      _txMailboxes[i].abort_requested = false;
+      break;
+    }
+  }
+  portEXIT_CRITICAL_SAFE(&_txMux);
+
+  return n;
+}
+
+void MCP2515Class::releaseMailbox(int n)
+{
+  portENTER_CRITICAL_SAFE(&_txMux);
+  _txMailboxes[n].busy = false;
+  portEXIT_CRITICAL_SAFE(&_txMux);
+}
+
+// Completes a queued frame exactly once, whether from the interrupt or an abort
+void MCP2515Class::finishTransmit(int n, CANTransmitStatus status, uint8_t ctrl, int64_t completedAt)
+{
+  bool owned = false;
+  TransmitEntry entry;
+
+  portENTER_CRITICAL_SAFE(&_txMux);
+  if (_txMailboxes[n].busy && !_txMailboxes[n].blocking) {
+    entry = _txMailboxes[n].entry;
+    _txMailboxes[n].busy = false;
+    owned = true;
+  }
+  portEXIT_CRITICAL_SAFE(&_txMux);
+
+  if (!owned) {
+    return; // transmitFrame() owns it, or it was already finished
+  }
+
+  // MLOA stays set after a retry wins, so it tells us arbitration was lost
+  bool lost_arbitration = (ctrl & FLAG_MLOA) ? true : false;
+  if (lost_arbitration) {
+    _stats.tx_arbitration_lost++;
+  }
+
+  if (status == TX_STATUS_COMPLETE) {
+    _stats.tx_completed++;
+  } else {
+    _stats.tx_aborted++;
+  }
+
+  if (_onTransmit) {
+    CANTransmitResult result = {
+      .status = status,
+      .mailbox = n,
+      .id = entry.frame.id,
+      .lost_arbitration = lost_arbitration,
+      .queued_at = entry.queued_at,
+      .completed_at = completedAt
+    };
+    _onTransmit(getInstanceId(), result);
+  }
+}
+
+// Times the SPI side of moving one frame through the chip. Runs in config mode
+// so nothing goes on the bus, anything waiting in the RX buffers is lost.
+MCP2515SPIBenchmark MCP2515Class::benchmarkSPI(int iterations)
+{
+  MCP2515SPIBenchmark result = {0.0f, 0.0f};
+
+  if (iterations <= 0 || setMode(CANSTAT_CONFIG) != 1) {
+    return result;
+  }
+
+  int n = claimMailbox(true);
+  if (n >= 0) {
+    CANFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.id = 0x7E8;
+    frame.data_len = 8;
+
+    uint8_t image[RX_BUFFER_IMAGE_LEN];
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++) {
+      readStatus();
+      readRxBuffer(0, image, sizeof(image));
+    }
+    result.rx_us = (float)(esp_timer_get_time() - start) / iterations;
+
+    // RTS is left out, a TXREQ set now would go out on the switch to normal mode
+    start = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++) {
+      readStatus();
+      loadTxBuffer(n, frame);
+    }
+    result.tx_us = (float)(esp_timer_get_time() - start) / iterations;
+
+    releaseMailbox(n);
+  }
+
+  setMode(CANSTAT_NORMAL);
+  return result;
+}
+
 int MCP2515Class::receiveFrame(CANFrame* frame)
 {
   int n; // which rx buffer
-  uint8_t intf = readRegister(REG_CANINTF);
+  uint8_t status = readStatus();
 
-  if (intf & FLAG_RXnIF(0)) { // CAN message is available in RX buffer 0
+  if (status & STATUS_RXnIF(0)) { // CAN message is available in RX buffer 0
     n = 0;
-  } else if (intf & FLAG_RXnIF(1)) { // CAN message is available in RX buffer 1
+  } else if (status & STATUS_RXnIF(1)) { // CAN message is available in RX buffer 1
     n = 1;
   } else {
     return 0;
   }
-  
-  frame->is_extended = (readRegister(REG_RXBnSIDL(n)) & FLAG_IDE) ? true : false;
 
-  uint32_t idA = ((readRegister(REG_RXBnSIDH(n)) << 3) & 0x07f8) | ((readRegister(REG_RXBnSIDL(n)) >> 5) & 0x07);
+  // Pull the whole buffer in one transaction, this also releases it
+  uint8_t image[RX_BUFFER_IMAGE_LEN];
+  readRxBuffer(n, image, sizeof(image));
+
+  uint8_t sidh = image[0];
+  uint8_t sidl = image[1];
+  uint8_t eid8 = image[2];
+  uint8_t eid0 = image[3];
+  uint8_t dlc = image[4];
+
+  frame->is_extended = (sidl & FLAG_IDE) ? true : false;
+
+  uint32_t idA = ((sidh << 3) & 0x07f8) | ((sidl >> 5) & 0x07);
   if (frame->is_extended) {
-    uint32_t idB = (((uint32_t)(readRegister(REG_RXBnSIDL(n)) & 0x03) << 16) & 0x30000) | ((readRegister(REG_RXBnEID8(n)) << 8) & 0xff00) | readRegister(REG_RXBnEID0(n));
+    uint32_t idB = (((uint32_t)(sidl & 0x03) << 16) & 0x30000) | ((eid8 << 8) & 0xff00) | eid0;
 
     frame->id = (idA << 18) | idB;
-    frame->is_retransmit = (readRegister(REG_RXBnDLC(n)) & FLAG_RTR) ? true : false;
+    frame->is_retransmit = (dlc & FLAG_RTR) ? true : false;
   } else {
     frame->id = idA;
-    frame->is_retransmit = (readRegister(REG_RXBnSIDL(n)) & FLAG_SRR) ? true : false;
+    frame->is_retransmit = (sidl & FLAG_SRR) ? true : false;
   }
 
-  frame->data_len = readRegister(REG_RXBnDLC(n)) & 0x0f;
+  // DLC values 9-15 are legal on the wire but still only carry 8 bytes
+  frame->data_len = dlc & 0x0f;
+  if (frame->data_len > 8) {
+    frame->data_len = 8;
+  }
 
   if (!frame->is_retransmit) {
-    for (int i = 0; i < frame->data_len; i++) {
-      frame->data[i] = readRegister(REG_RXBnD0(n) + i);
-    }
+    memcpy(frame->data, &image[5], frame->data_len);
   }
 
-  // Release RX buffer
-  modifyRegister(REG_CANINTF, FLAG_RXnIF(n), 0x00);
-  return frame->data_len;
+  frame->timestamp = _rxTimestamp;
+
+  _stats.rx_frames++;
+  return 1;
 }
 
 void MCP2515Class::dumpErrors()
@@ -372,60 +877,268 @@ void MCP2515Class::dumpRegisters()
 
 int MCP2515Class::_sendReset()
 {
-  SPI.beginTransaction(_spiSettings);
-  digitalWrite(_csPin, LOW);
-  SPI.transfer(CMD_RESET);
-  digitalWrite(_csPin, HIGH);
+  uint8_t reset[1] = { CMD_RESET };
+  _spiTransfer(SPI_SHAPE_COMMAND, reset, sizeof(reset));
   delay(10);
-  
-  // Read CANSTAT (cmd 0x03, address 0x0E)
-  digitalWrite(_csPin, LOW);
-  SPI.transfer(CMD_READ);     // READ command
-  SPI.transfer(REG_CANSTAT);     // CANSTAT address
-  uint8_t canstat = SPI.transfer(0x00);  // read value
-  digitalWrite(_csPin, HIGH);
-  SPI.endTransaction();
 
   // CANSTAT 0x80 == config mode
-  if (canstat != CANSTAT_CONFIG) {
+  if (readRegister(REG_CANSTAT) != CANSTAT_CONFIG) {
 	return -1;
   }
 
   return 1;
 }
 
+// Mode changes wait for the bus to go idle, so give it a few frame times
+int MCP2515Class::setMode(uint8_t mode)
+{
+  modifyRegister(REG_CANCTRL, CANSTAT_MODE_MASK, mode);
+
+  for (int i = 0; i < 10; i++) {
+    if ((readRegister(REG_CANSTAT) & CANSTAT_MODE_MASK) == mode) {
+      return 1;
+    }
+    delayMicroseconds(100);
+  }
+
+  return 0;
+}
+
+// Writes SIDH/SIDL/EID8/EID0 of a filter or mask
+void MCP2515Class::writeIdRegisters(uint8_t address, uint32_t id, bool extended, bool isFilter)
+{
+  if (extended) {
+    writeRegister(address, id >> 21);
+    writeRegister(address + 1, (((id >> 18) & 0x07) << 5) | (isFilter ? FLAG_EXIDE : 0x00) | ((id >> 16) & 0x03));
+    writeRegister(address + 2, (id >> 8) & 0xff);
+    writeRegister(address + 3, id & 0xff);
+  } else {
+    // For standard frames the EID bytes would match against data bytes 0 and 1
+    writeRegister(address, id >> 3);
+    writeRegister(address + 1, (id & 0x07) << 5);
+    writeRegister(address + 2, 0x00);
+    writeRegister(address + 3, 0x00);
+  }
+}
+
+void MCP2515Class::onSOFCounterLimit(void* arg)
+{
+  MCP2515Class* can = (MCP2515Class*)arg;
+  can->_sofOverflows++;
+}
+
+// Counts SOF pulses from CLKOUT in the ESP32 pulse counter so no CPU time is
+// spent per frame. The PCNT unit is picked by instance id.
+void MCP2515Class::_beginSOFCounter()
+{
+  static bool isr_service_installed = false;
+  pcnt_unit_t unit = (pcnt_unit_t)getInstanceId();
+
+  pcnt_config_t config = {
+    .pulse_gpio_num = _sofPin,
+    .ctrl_gpio_num = PCNT_PIN_NOT_USED,
+    .lctrl_mode = PCNT_MODE_KEEP,
+    .hctrl_mode = PCNT_MODE_KEEP,
+    .pos_mode = PCNT_COUNT_INC,
+    .neg_mode = PCNT_COUNT_DIS,
+    .counter_h_lim = SOF_COUNTER_LIMIT,
+    .counter_l_lim = 0,
+    .unit = unit,
+    .channel = PCNT_CHANNEL_0
+  };
+  pcnt_unit_config(&config);
+
+  // Ignore glitches shorter than ~1 us (APB clock cycles)
+  pcnt_set_filter_value(unit, 80);
+  pcnt_filter_enable(unit);
+
+  pcnt_event_enable(unit, PCNT_EVT_H_LIM);
+  if (!isr_service_installed) {
+    pcnt_isr_service_install(0);
+    isr_service_installed = true;
+  }
+  pcnt_isr_handler_add(unit, onSOFCounterLimit, this);
+
+  pcnt_counter_pause(unit);
+  pcnt_counter_clear(unit);
+  _sofOverflows = 0;
+  pcnt_counter_resume(unit);
+}
+
+// Adds the MCP2515 as a device on its IDF host and builds one transaction per
+// transfer shape, so a transfer only copies bytes and starts the hardware
+int MCP2515Class::_beginSPIDevice()
+{
+  static bool bus_initialized[3] = { false };
+
+  if (!bus_initialized[_spiHost]) {
+    spi_bus_config_t bus;
+    memset(&bus, 0, sizeof(bus));
+    bus.sclk_io_num = _spiSckPin;
+    bus.miso_io_num = _spiMisoPin;
+    bus.mosi_io_num = _spiMosiPin;
+    bus.quadwp_io_num = -1;
+    bus.quadhd_io_num = -1;
+    bus.max_transfer_sz = sizeof(_spiTxBuffer);
+
+    // Buffer reads go through DMA so the task sleeps instead of spinning on the
+    // bus, which leaves the CPU to the other controller's task
+    if (spi_bus_initialize(_spiHost, &bus, SPI_DMA_CH_AUTO) != ESP_OK) {
+      return -1;
+    }
+    bus_initialized[_spiHost] = true;
+  }
+
+  spi_device_interface_config_t device;
+  memset(&device, 0, sizeof(device));
+  device.mode = _spiMode;
+  device.clock_speed_hz = _spiFrequency;
+  device.input_delay_ns = SPI_INPUT_DELAY_NS;
+  device.spics_io_num = _csPin;
+  device.flags = _spiBitOrder == LSBFIRST ? SPI_DEVICE_BIT_LSBFIRST : 0;
+  device.queue_size = 1;
+
+  if (spi_bus_add_device(_spiHost, &device, &_spiDevice) != ESP_OK) {
+    return -2;
+  }
+
+  _spiLock = xSemaphoreCreateMutex();
+  if (!_spiLock) {
+    return -3;
+  }
+
+  const size_t lengths[SPI_SHAPE_COUNT] = { 1, 2, 3, 4, SPI_DMA_LENGTH(1 + RX_BUFFER_IMAGE_LEN), 1 + RX_BUFFER_IMAGE_LEN };
+  memset(_spiTransactions, 0, sizeof(_spiTransactions));
+  for (int shape = 0; shape < SPI_SHAPE_COUNT; shape++) {
+    spi_transaction_t& t = _spiTransactions[shape];
+    t.length = lengths[shape] * 8;
+    if (lengths[shape] <= 4) {
+      // Short transfers live inside the descriptor
+      t.flags = SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA;
+    } else {
+      t.tx_buffer = _spiTxBuffer;
+      t.rx_buffer = shape == SPI_SHAPE_TX_BUFFER ? nullptr : _spiRxBuffer;
+    }
+  }
+
+  return 1;
+}
+
+// One CS-framed full duplex transfer, the response replaces the buffer contents
+void MCP2515Class::_spiTransfer(SPIShape shape, uint8_t* buffer, size_t length)
+{
+  if (_spiBackend == MCP2515_SPI_ESP_IDF) {
+    spi_transaction_t* t = &_spiTransactions[shape];
+
+    xSemaphoreTake(_spiLock, portMAX_DELAY);
+    if (t->flags & SPI_TRANS_USE_TXDATA) {
+      // A few bytes finish sooner than an interrupt could be taken
+      memcpy(t->tx_data, buffer, length);
+      spi_device_polling_transmit(_spiDevice, t);
+    } else {
+      // Reads are padded to whole words, the extra bytes run past D7 and are
+      // dropped. Writes can't be, the padding would land in the next registers,
+      // and sending from DMA only needs the aligned buffer.
+      size_t transfer_length = t->rx_buffer ? SPI_DMA_LENGTH(length) : length;
+      memcpy(_spiTxBuffer, buffer, length);
+      memset(_spiTxBuffer + length, 0x00, transfer_length - length);
+      t->length = transfer_length * 8;
+      spi_device_transmit(_spiDevice, t);
+    }
+
+    if (t->flags & SPI_TRANS_USE_RXDATA) {
+      memcpy(buffer, t->rx_data, length);
+    } else if (t->rx_buffer) {
+      memcpy(buffer, _spiRxBuffer, length);
+    }
+    xSemaphoreGive(_spiLock);
+  } else {
+    _spi->beginTransaction(_spiSettings);
+    digitalWrite(_csPin, LOW);
+    _spi->transfer(buffer, length);
+    digitalWrite(_csPin, HIGH);
+    _spi->endTransaction();
+  }
+
+  _stats.spi_transactions++;
+  _stats.spi_bytes += length;
+}
+
 uint8_t MCP2515Class::readRegister(uint8_t address)
 {
-  uint8_t value;
-  SPI.beginTransaction(_spiSettings);
-  digitalWrite(_csPin, LOW);
-  SPI.transfer(CMD_READ);
-  SPI.transfer(address);
-  value = SPI.transfer(0x00);
-  digitalWrite(_csPin, HIGH);
-  SPI.endTransaction();
-  return value;
+  uint8_t buffer[3] = { CMD_READ, address, 0x00 };
+  _spiTransfer(SPI_SHAPE_REGISTER, buffer, sizeof(buffer));
+  return buffer[2];
+}
+
+uint8_t MCP2515Class::readStatus()
+{
+  uint8_t buffer[2] = { CMD_READ_STATUS, 0x00 };
+  _spiTransfer(SPI_SHAPE_STATUS, buffer, sizeof(buffer));
+  return buffer[1];
+}
+
+void MCP2515Class::readRxBuffer(int n, uint8_t* buffer, size_t length)
+{
+  uint8_t transfer[1 + RX_BUFFER_IMAGE_LEN];
+  if (length > RX_BUFFER_IMAGE_LEN) {
+    length = RX_BUFFER_IMAGE_LEN;
+  }
+
+  memset(transfer, 0x00, sizeof(transfer));
+  transfer[0] = CMD_READ_RX_BUFFER(n);
+  _spiTransfer(SPI_SHAPE_RX_BUFFER, transfer, 1 + length);
+  memcpy(buffer, &transfer[1], length);
+}
+
+// Writes the ID, DLC and data of a frame into TXBn with one LOAD TX BUFFER burst
+void MCP2515Class::loadTxBuffer(int n, const CANFrame& frame)
+{
+  // Command, then SIDH, SIDL, EID8, EID0, DLC and up to 8 data bytes
+  uint8_t image[1 + 13];
+  uint8_t length = 6;
+
+  image[0] = CMD_LOAD_TX_BUFFER(n);
+
+  if (frame.is_extended) {
+    image[1] = frame.id >> 21;
+    image[2] = (((frame.id >> 18) & 0x07) << 5) | FLAG_EXIDE | ((frame.id >> 16) & 0x03);
+    image[3] = (frame.id >> 8) & 0xff;
+    image[4] = frame.id & 0xff;
+  } else {
+    image[1] = frame.id >> 3;
+    image[2] = frame.id << 5;
+    image[3] = 0x00;
+    image[4] = 0x00;
+  }
+
+  int data_len = frame.data_len > 8 ? 8 : frame.data_len;
+
+  if (frame.is_retransmit) {
+    image[5] = FLAG_RTR | data_len;
+  } else {
+    image[5] = data_len;
+    memcpy(&image[6], frame.data, data_len);
+    length += data_len;
+  }
+
+  _spiTransfer(SPI_SHAPE_TX_BUFFER, image, length);
+}
+
+void MCP2515Class::requestToSend(int n)
+{
+  uint8_t buffer[1] = { (uint8_t)CMD_RTS(n) };
+  _spiTransfer(SPI_SHAPE_COMMAND, buffer, sizeof(buffer));
 }
 
 void MCP2515Class::modifyRegister(uint8_t address, uint8_t mask, uint8_t value)
 {
-  SPI.beginTransaction(_spiSettings);
-  digitalWrite(_csPin, LOW);
-  SPI.transfer(CMD_UPDATE);
-  SPI.transfer(address);
-  SPI.transfer(mask);
-  SPI.transfer(value);
-  digitalWrite(_csPin, HIGH);
-  SPI.endTransaction();
+  uint8_t buffer[4] = { CMD_UPDATE, address, mask, value };
+  _spiTransfer(SPI_SHAPE_MODIFY, buffer, sizeof(buffer));
 }
 
 void MCP2515Class::writeRegister(uint8_t address, uint8_t value)
 {
-  SPI.beginTransaction(_spiSettings);
-  digitalWrite(_csPin, LOW);
-  SPI.transfer(CMD_WRITE);
-  SPI.transfer(address);
-  SPI.transfer(value);
-  digitalWrite(_csPin, HIGH);
-  SPI.endTransaction();
+  uint8_t buffer[3] = { CMD_WRITE, address, value };
+  _spiTransfer(SPI_SHAPE_REGISTER, buffer, sizeof(buffer));
 }
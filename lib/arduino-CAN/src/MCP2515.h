@@ -2,7 +2,85 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 
 #include <SPI.h>
+#include <driver/spi_master.h>
+#include <freertos/semphr.h>
 #include "CANController.h"
+#include "CANBitTiming.h"
+
+// SPI accounting, used to see what each received frame costs on the bus
+struct MCP2515Stats {
+    unsigned long spi_transactions;
+    unsigned long spi_bytes;
+    unsigned long rx_frames;
+    unsigned long rx_spi_transactions; // CANINTF reads that found RX flags, plus the drains
+    unsigned long rx_spi_bytes;
+    unsigned long tx_queued;
+    unsigned long tx_completed;
+    unsigned long tx_aborted;           // Still in a mailbox when the deadline passed
+    unsigned long tx_stale;             // Deadline passed before reaching a mailbox
+    unsigned long tx_arbitration_lost;  // Completed, but lost arbitration at least once
+    unsigned long tx_queue_full;
+    unsigned long tx_direct;            // Sent through the blocking transmitFrame()
+    unsigned long rx_overflow_rxb0;     // EFLG.RX0OVR, frame lost in the chip
+    unsigned long rx_overflow_rxb1;     // EFLG.RX1OVR
+    unsigned long error_interrupts;
+    unsigned long interrupt_pass_limit; // Flags still set after MAX_INTERRUPT_PASSES, kept servicing
+};
+
+// Hardware acceptance filtering. Mask 0 applies to filters 0-1 (RXB0), mask 1 to
+// filters 2-5 (RXB1). A frame is accepted when (id & mask) == (filter & mask).
+// Unused filters should repeat a used one, a zero filter with a zero mask accepts everything.
+struct CANAcceptanceFilter {
+    bool extended; // Masks and filters are 29-bit IDs and match extended frames only
+    uint32_t masks[2];
+    uint32_t filters[6];
+};
+
+// Which driver moves the bytes. The ESP-IDF backend owns the bus and the CS pin
+// and runs pre-built polling transactions, it needs the interrupt task.
+typedef enum {
+    MCP2515_SPI_ARDUINO = 0,
+    MCP2515_SPI_ESP_IDF = 1,
+} MCP2515SPIBackend;
+
+// SCK limit from the MCP2515 datasheet, faster settings are clamped to this
+#define MCP2515_MAX_SPI_FREQUENCY 10000000
+
+// SPI time spent per frame, see benchmarkSPI()
+struct MCP2515SPIBenchmark {
+    float rx_us; // READ STATUS + READ RX BUFFER
+    float tx_us; // READ STATUS + LOAD TX BUFFER, RTS adds one more byte
+};
+
+// SYNC + PropSeg (1-8) + PS1 (1-8) + PS2 (2-8), BRP 1-64, SJW 1-4
+constexpr CANBitTimingLimits MCP2515_BIT_TIMING_LIMITS = { 1, 64, 5, 25, 2, 16, 2, 8, 4 };
+#define MCP2515_DEFAULT_SAMPLE_POINT 750
+
+// Constant arguments can be checked with static_assert(...valid)
+constexpr CANBitTiming mcp2515BitTiming(long clockFrequency, long baudRate, int samplePoint) {
+  return solveBitTiming(MCP2515_BIT_TIMING_LIMITS, clockFrequency, baudRate, samplePoint);
+}
+
+// Depth of the software queue that feeds the three TX mailboxes
+#define MCP2515_TX_QUEUE_SIZE 16
+
+typedef enum {
+    TX_STATUS_COMPLETE = 1,
+    TX_STATUS_ABORTED = -1,
+    TX_STATUS_STALE = -2,
+} CANTransmitStatus;
+
+// Reported through the transmit callback once a queued frame is finished with
+struct CANTransmitResult {
+    CANTransmitStatus status;
+    int mailbox;                // -1 if the frame never reached a mailbox
+    unsigned long id;
+    bool lost_arbitration;
+    int64_t queued_at;          // esp_timer_get_time()
+    int64_t completed_at;       // INT edge of the TXnIF, or when it was dropped/aborted
+};
+
+typedef void (*TTransmitCallback)(int, const CANTransmitResult&);
 
 class MCP2515Class : public CANControllerClass {
 
@@ -12,32 +90,117 @@ public:
   void setSPIPins(int sck, int miso, int mosi, int cs, int irq);
   void setSPISettings(uint32_t frequency, uint8_t bitOrder, uint8_t mode);
   void setClockFrequency(long clockFrequency);
+  void setSamplePoint(int samplePoint);
+  void setSOFPin(int sof);
+  void setSPIBackend(MCP2515SPIBackend backend);
+  void setSPIHost(spi_host_device_t host);
   
   int begin(long baudRate, bool initializeSPI = true);
 
+  // Returns 1 if a frame was read, 0 if both RX buffers are empty. The frame
+  // is stamped with the INT edge that handleInterrupt() is servicing.
   int receiveFrame(CANFrame* frame);
   int transmitFrame(const CANFrame frame);
+
+  // Non-blocking transmit. Frames are queued and fed to all three mailboxes,
+  // completion is reported from the TXnIF interrupt through the callback.
+  int queueFrame(const CANFrame& frame);
+  void serviceTransmitQueue();
+  void setTransmitDeadline(unsigned long deadline_us);
+  void configureTransmitCallback(TTransmitCallback callback);
+
+  int setFilters(const CANAcceptanceFilter& filter);
+  int clearFilters();
+  long busFrameCount();
  
   void dumpRegisters();
   void dumpErrors();
 
+  MCP2515Stats getStats() const { return _stats; }
+  MCP2515SPIBenchmark benchmarkSPI(int iterations);
+
 protected:
   // These are called by CanContrøllerClass
   void configureHardwareInterrupt(void (*interruptHandler)());
   void handleInterrupt();
 
 private:
+  // Fixed transfer shapes, each has its own pre-built IDF transaction
+  enum SPIShape {
+    SPI_SHAPE_COMMAND,   // RESET, RTS
+    SPI_SHAPE_STATUS,    // READ STATUS
+    SPI_SHAPE_REGISTER,  // READ, WRITE
+    SPI_SHAPE_MODIFY,    // BIT MODIFY
+    SPI_SHAPE_RX_BUFFER, // READ RX BUFFER
+    SPI_SHAPE_TX_BUFFER, // LOAD TX BUFFER, length varies with the DLC
+    SPI_SHAPE_COUNT
+  };
+
   SPISettings _spiSettings;
+  uint32_t _spiFrequency;
+  uint8_t _spiBitOrder;
+  uint8_t _spiMode;
+  MCP2515SPIBackend _spiBackend;
+  spi_host_device_t _spiHost;
+  SPIClass* _spi;
+  spi_device_handle_t _spiDevice;
+  SemaphoreHandle_t _spiLock;
+  spi_transaction_t _spiTransactions[SPI_SHAPE_COUNT];
+  // The longest transfer, 14 bytes, padded to whole words for DMA
+  uint8_t _spiTxBuffer[16] __attribute__((aligned(4)));
+  uint8_t _spiRxBuffer[16] __attribute__((aligned(4)));
   int _csPin;
   int _intPin;
   int _spiSckPin;
   int _spiMisoPin;
   int _spiMosiPin;
   long _clockFrequency;
+  int _samplePoint;
+  int _sofPin;
+  volatile unsigned long _sofOverflows;
   bool _spiInitialized = false;
+  MCP2515Stats _stats;
+  int64_t _rxTimestamp;
+
+  struct TransmitEntry {
+    CANFrame frame;
+    int64_t queued_at;
+    unsigned long deadline; // 0 = no deadline
+  };
+
+  struct TransmitMailbox {
+    bool busy;
+    bool blocking;          // Owned by transmitFrame(), not the queue
+    bool abort_requested;
+    uint8_t priority;       // TXP it was loaded with, queued frames only
+    TransmitEntry entry;
+  };
+
+  TransmitEntry _txQueue[MCP2515_TX_QUEUE_SIZE];
+  unsigned int _txHead;
+  unsigned int _txTail;
+  unsigned int _txQueued;
+  TransmitMailbox _txMailboxes[3];
+  unsigned long _txDeadline;
+  TTransmitCallback _onTransmit;
+  portMUX_TYPE _txMux = portMUX_INITIALIZER_UNLOCKED;
   
   int _sendReset();
+  int _beginSPIDevice();
+  void _spiTransfer(SPIShape shape, uint8_t* buffer, size_t length);
+  void _beginSOFCounter();
+  static void onSOFCounterLimit(void* arg);
+  int setMode(uint8_t mode);
+  void writeIdRegisters(uint8_t address, uint32_t id, bool extended, bool isFilter);
   uint8_t readRegister(uint8_t address);
+  uint8_t readStatus();
+  void readRxBuffer(int n, uint8_t* buffer, size_t length);
+  void loadTxBuffer(int n, const CANFrame& frame);
+  void requestToSend(int n);
+  int claimMailbox(bool blocking);
+  void releaseMailbox(int n);
+  void finishTransmit(int n, CANTransmitStatus status, uint8_t ctrl, int64_t completedAt);
+  void handleErrorInterrupt();
   void modifyRegister(uint8_t address, uint8_t mask, uint8_t value);
   void writeRegister(uint8_t address, uint8_t value);
 };
@@ -0,0 +1,194 @@
+#include "FakeMCP2515.h"
+#include <Arduino.h>
+#include <SPI.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#include <driver/pcnt.h>
+
+#define REG_CANSTAT       0x0e
+#define REG_CANCTRL       0x0f
+#define REG_CANINTE       0x2b
+#define REG_CANINTF       0x2c
+#define REG_TXBnCTRL(n)   (0x30 + (n) * 0x10)
+#define REG_RXBnSIDH(n)   (0x61 + (n) * 0x10)
+#define FLAG_TXP_MASK     0x03
+#define FLAG_TXREQ        0x08
+#define FLAG_MLOA         0x20
+#define FLAG_ABAT         0x10
+
+FakeMCP2515 fakeChip;
+int64_t fakeNow = 1000000;
+SPIClass SPI;
+
+void FakeMCP2515::reset()
+{
+  memset(regs, 0, sizeof(regs));
+  regs[REG_CANSTAT] = 0x80;
+  regs[REG_CANCTRL] = 0x87;
+  stuck_intf = 0;
+  stuck_clears = 0;
+  abat_seen = false;
+  notifications = 0;
+  lose_arbitration = false;
+  send_after = 0;
+  sent_count = 0;
+}
+
+void FakeMCP2515::write(uint8_t address, uint8_t value)
+{
+  address &= 0x7f;
+  regs[address] = value;
+
+  if (address == REG_CANCTRL) {
+    // Mode changes take effect at once, there is no bus to wait for
+    regs[REG_CANSTAT] = (regs[REG_CANSTAT] & 0x1f) | (value & 0xe0);
+    if (value & FLAG_ABAT) {
+      abat_seen = true;
+    }
+  } else if (address == REG_CANINTF) {
+    if (stuck_clears > 0 && --stuck_clears == 0) {
+      stuck_intf = 0;
+    }
+    regs[REG_CANINTF] |= stuck_intf;
+  }
+}
+
+void FakeMCP2515::transfer(uint8_t* buffer, uint32_t length)
+{
+  fakeNow += FAKE_SPI_TRANSFER_US;
+  if (send_after > 0 && --send_after == 0) {
+    sendNext();
+  }
+  uint8_t command = buffer[0];
+
+  if (command == 0xC0) {
+    reset();
+  } else if (command == 0x03) {
+    for (uint32_t i = 2; i < length; i++) {
+      buffer[i] = regs[(buffer[1] + i - 2) & 0x7f];
+    }
+  } else if (command == 0x02) {
+    for (uint32_t i = 2; i < length; i++) {
+      write(buffer[1] + i - 2, buffer[i]);
+    }
+  } else if (command == 0x05) {
+    uint8_t address = buffer[1] & 0x7f;
+    write(address, (regs[address] & ~buffer[2]) | (buffer[3] & buffer[2]));
+  } else if (command == 0xA0) {
+    uint8_t intf = regs[REG_CANINTF];
+    uint8_t status = intf & 0x03;
+    for (int n = 0; n < 3; n++) {
+      if (regs[REG_TXBnCTRL(n)] & FLAG_TXREQ) {
+        status |= 0x04 << (n * 2);
+      }
+      if (intf & (0x04 << n)) {
+        status |= 0x08 << (n * 2);
+      }
+    }
+    buffer[1] = status;
+  } else if ((command & 0xF8) == 0x40) {
+    int n = (command >> 1) & 0x03;
+    for (uint32_t i = 1; i < length; i++) {
+      regs[REG_TXBnCTRL(n) + i] = buffer[i];
+    }
+  } else if ((command & 0xF8) == 0x80) {
+    for (int n = 0; n < 3; n++) {
+      if (command & (0x01 << n)) {
+        regs[REG_TXBnCTRL(n)] |= FLAG_TXREQ | (lose_arbitration ? FLAG_MLOA : 0);
+      }
+    }
+  } else if ((command & 0xF9) == 0x90) {
+    int n = (command >> 2) & 0x01;
+    for (uint32_t i = 1; i < length; i++) {
+      buffer[i] = regs[REG_RXBnSIDH(n) + i - 1];
+    }
+    write(REG_CANINTF, regs[REG_CANINTF] & ~(0x01 << n));
+  }
+}
+
+// The frame went out and was acknowledged
+void FakeMCP2515::completeTransmit(int n)
+{
+  regs[REG_TXBnCTRL(n)] &= ~FLAG_TXREQ;
+  regs[REG_CANINTF] |= 0x04 << n;
+}
+
+// Highest TXP goes first, the highest numbered buffer on a tie
+int FakeMCP2515::sendNext()
+{
+  int next = -1;
+  for (int n = 0; n < 3; n++) {
+    if (transmitPending(n) && (next < 0 ||
+        (regs[REG_TXBnCTRL(n)] & FLAG_TXP_MASK) >= (regs[REG_TXBnCTRL(next)] & FLAG_TXP_MASK))) {
+      next = n;
+    }
+  }
+
+  if (next >= 0) {
+    uint8_t sidh = regs[REG_TXBnCTRL(next) + 1];
+    uint8_t sidl = regs[REG_TXBnCTRL(next) + 2];
+    if (sent_count < 32) {
+      sent[sent_count++] = ((uint32_t)sidh << 3) | (sidl >> 5);
+    }
+    completeTransmit(next);
+  }
+  return next;
+}
+
+bool FakeMCP2515::transmitPending(int n) const
+{
+  return (regs[REG_TXBnCTRL(n)] & FLAG_TXREQ) ? true : false;
+}
+
+void SPIClass::transfer(void* data, uint32_t size)
+{
+  fakeChip.transfer((uint8_t*)data, size);
+}
+
+int Stream::printf(const char* format, ...)
+{
+  return 0;
+}
+
+int64_t esp_timer_get_time() { return fakeNow; }
+unsigned long micros() { return (unsigned long)fakeNow; }
+unsigned long millis() { return (unsigned long)(fakeNow / 1000); }
+void delay(uint32_t ms) { fakeNow += (int64_t)ms * 1000; }
+void delayMicroseconds(uint32_t us) { fakeNow += us; }
+void pinMode(int pin, int mode) {}
+// INT is low while an enabled flag is set
+int digitalRead(int pin) { return (fakeChip.regs[REG_CANINTF] & fakeChip.regs[REG_CANINTE]) ? LOW : HIGH; }
+void digitalWrite(int pin, int value) {}
+int digitalPinToInterrupt(int pin) { return pin; }
+void attachInterrupt(int interrupt, void (*handler)(), int mode) {}
+
+// The interrupt task is never run, handleInterrupt() is called directly
+BaseType_t xTaskCreatePinnedToCore(void (*task)(void*), const char* name, uint32_t stack,
+    void* arg, UBaseType_t priority, TaskHandle_t* handle, BaseType_t core)
+{
+  *handle = (TaskHandle_t)&fakeChip;
+  return pdPASS;
+}
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait) { return 0; }
+BaseType_t xTaskNotifyGive(TaskHandle_t task) { fakeChip.notifications++; return pdPASS; }
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* woken) { fakeChip.notifications++; }
+
+SemaphoreHandle_t xSemaphoreCreateMutex() { return (SemaphoreHandle_t)&fakeChip; }
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t wait) { return pdTRUE; }
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) { return pdTRUE; }
+
+esp_err_t spi_bus_initialize(spi_host_device_t host, const spi_bus_config_t* bus, int dma) { return ESP_OK; }
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t* device, spi_device_handle_t* handle) { return ESP_OK; }
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t* transaction) { return ESP_OK; }
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t* transaction) { return ESP_OK; }
+
+esp_err_t pcnt_unit_config(const pcnt_config_t* config) { return ESP_OK; }
+esp_err_t pcnt_set_filter_value(pcnt_unit_t unit, uint16_t value) { return ESP_OK; }
+esp_err_t pcnt_filter_enable(pcnt_unit_t unit) { return ESP_OK; }
+esp_err_t pcnt_event_enable(pcnt_unit_t unit, pcnt_evt_type_t event) { return ESP_OK; }
+esp_err_t pcnt_isr_service_install(int flags) { return ESP_OK; }
+esp_err_t pcnt_isr_handler_add(pcnt_unit_t unit, void (*handler)(void*), void* arg) { return ESP_OK; }
+esp_err_t pcnt_counter_pause(pcnt_unit_t unit) { return ESP_OK; }
+esp_err_t pcnt_counter_clear(pcnt_unit_t unit) { return ESP_OK; }
+esp_err_t pcnt_counter_resume(pcnt_unit_t unit) { return ESP_OK; }
+esp_err_t pcnt_get_counter_value(pcnt_unit_t unit, int16_t* count) { *count = 0; return ESP_OK; }
@@ -0,0 +1,32 @@
+// Register level model of an MCP2515 behind the SPI stub. The bus never
+// acknowledges anything on its own, a test finishes a transmission with
+// completeTransmit() or sendNext(), or lets send_after count down.
+// Every SPI transfer advances the clock by a few us.
+#pragma once
+#include <stdint.h>
+
+#define FAKE_SPI_TRANSFER_US 5
+
+struct FakeMCP2515 {
+  uint8_t regs[128];
+  uint8_t stuck_intf;    // CANINTF bits that set themselves again once cleared
+  int stuck_clears;      // stuck_intf gives up on this clear, 0 = never
+  bool abat_seen;        // CANCTRL.ABAT was ever set
+  unsigned long notifications; // xTaskNotifyGive() calls
+  bool lose_arbitration; // RTS sets MLOA, the frame stays pending
+  int send_after;        // Transfers until sendNext() runs by itself, 0 = never
+  uint32_t sent[32];     // Standard ids in the order they left
+  int sent_count;
+
+  void reset();
+  void transfer(uint8_t* buffer, uint32_t length);
+  void completeTransmit(int n);
+  int sendNext();        // Sends the buffer the chip would pick, -1 if none
+  bool transmitPending(int n) const;
+
+private:
+  void write(uint8_t address, uint8_t value);
+};
+
+extern FakeMCP2515 fakeChip;
+extern int64_t fakeNow;
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <assert.h>
+#include <MCP2515.h>
+#include "FakeMCP2515.h"
+
+#define DEADLINE_US 10000
+
+// handleInterrupt() is normally reached through the INT edge
+class TestMCP2515 : public MCP2515Class {
+public:
+  using MCP2515Class::handleInterrupt;
+};
+
+static CANTransmitResult results[16];
+static int resultCount = 0;
+
+static void onTransmit(int instance, const CANTransmitResult& result) {
+  assert(resultCount < 16);
+  results[resultCount++] = result;
+}
+
+static void begin(TestMCP2515& can) {
+  fakeChip.reset();
+  resultCount = 0;
+  can.setSPIPins(18, 19, 23, 5, 4);
+  assert(can.begin(500000) == 1);
+  can.configureTransmitCallback(onTransmit);
+}
+
+static CANFrame frame(unsigned long id) {
+  CANFrame f;
+  memset(&f, 0, sizeof(f));
+  f.id = id;
+  f.data_len = 8;
+  return f;
+}
+
+// Nobody acknowledges, so the queued frames sit in their mailboxes until the
+// deadline takes them out again
+void testExpiredFrameFreesMailbox() {
+  TestMCP2515 can;
+  begin(can);
+  can.setTransmitDeadline(DEADLINE_US);
+
+  for (int i = 0; i < 3; i++) {
+    assert(can.queueFrame(frame(0x7E0 + i)) == 1);
+    assert(fakeChip.transmitPending(i));
+  }
+
+  fakeNow += DEADLINE_US * 2;
+  can.serviceTransmitQueue();
+
+  assert(resultCount == 3);
+  for (int i = 0; i < 3; i++) {
+    assert(results[i].status == TX_STATUS_ABORTED);
+    assert(results[i].mailbox == i);
+    assert(results[i].id == 0x7E0 + (unsigned long)i);
+    assert(!fakeChip.transmitPending(i));
+  }
+  assert(can.getStats().tx_aborted == 3);
+
+  // All three mailboxes take frames again
+  for (int i = 0; i < 3; i++) {
+    assert(can.queueFrame(frame(0x7E8 + i)) == 1);
+    assert(fakeChip.transmitPending(i));
+  }
+
+  for (int i = 0; i < 3; i++) {
+    fakeChip.completeTransmit(i);
+  }
+  can.handleInterrupt();
+  assert(resultCount == 6);
+  for (int i = 3; i < 6; i++) {
+    assert(results[i].status == TX_STATUS_COMPLETE);
+  }
+  assert(can.getStats().tx_completed == 3);
+}
+
+// A frame that made it out just before its deadline belongs to the interrupt
+void testSentFrameIsNotAborted() {
+  TestMCP2515 can;
+  begin(can);
+  can.setTransmitDeadline(DEADLINE_US);
+
+  assert(can.queueFrame(frame(0x7E0)) == 1);
+  fakeChip.completeTransmit(0);
+  fakeNow += DEADLINE_US * 2;
+  can.serviceTransmitQueue();
+  assert(resultCount == 0);
+
+  can.handleInterrupt();
+  assert(resultCount == 1);
+  assert(results[0].status == TX_STATUS_COMPLETE);
+  assert(can.getStats().tx_aborted == 0);
+}
+
+// A blocking send that times out leaves the queued frames alone
+void testBlockingTimeout() {
+  TestMCP2515 can;
+  begin(can);
+
+  assert(can.queueFrame(frame(0x7E0)) == 1);
+  assert(can.queueFrame(frame(0x7E1)) == 1);
+  assert(can.transmitFrame(frame(0x7E2)) == 0);
+
+  assert(!fakeChip.abat_seen);
+  assert(fakeChip.transmitPending(0));
+  assert(fakeChip.transmitPending(1));
+  assert(!fakeChip.transmitPending(2));
+  assert(resultCount == 0);
+
+  // Its mailbox is free for the queue again
+  assert(can.queueFrame(frame(0x7E3)) == 1);
+  assert(fakeChip.transmitPending(2));
+}
+
+// Three mailboxes are in flight at once, the frames still leave in queue order
+void testQueueOrder() {
+  TestMCP2515 can;
+  begin(can);
+
+  for (int i = 0; i < 10; i++) {
+    assert(can.queueFrame(frame(0x100 + i)) == 1);
+  }
+
+  for (int guard = 0; fakeChip.sent_count < 10 && guard < 100; guard++) {
+    assert(fakeChip.sendNext() >= 0);
+    can.handleInterrupt();
+
+    // More arrive while the first ones are still going out
+    if (fakeChip.sent_count == 4) {
+      for (int i = 10; i < 14; i++) {
+        assert(can.queueFrame(frame(0x100 + i)) == 1);
+      }
+    }
+  }
+  while (fakeChip.sendNext() >= 0) {
+    can.handleInterrupt();
+  }
+
+  assert(fakeChip.sent_count == 14);
+  for (int i = 0; i < 14; i++) {
+    assert(fakeChip.sent[i] == 0x100 + (uint32_t)i);
+  }
+  assert(resultCount == 14);
+  assert(can.getStats().tx_completed == 14);
+}
+
+// Lost arbitration is retried by the chip, the blocking send waits it out
+void testBlockingArbitrationLoss() {
+  TestMCP2515 can;
+  begin(can);
+
+  fakeChip.lose_arbitration = true;
+  fakeChip.send_after = 100;
+  assert(can.transmitFrame(frame(0x7E8)) == 1);
+  assert(fakeChip.sent_count == 1);
+  assert(can.getStats().tx_direct == 1);
+}
+
+// A buffer the chip still has pending isn't reloaded from the queue
+void testQueueSkipsPendingBuffer() {
+  TestMCP2515 can;
+  begin(can);
+
+  fakeChip.regs[0x30] |= 0x08; // TXB0CTRL.TXREQ left over
+  fakeChip.regs[0x31] = 0x55;
+  assert(can.queueFrame(frame(0x7E0)) == 1);
+  assert(fakeChip.regs[0x31] == 0x55);
+  assert(fakeChip.transmitPending(1) || fakeChip.transmitPending(2));
+}
+
+// A flag that won't clear keeps INT low, the task has to come back by itself
+void testInterruptPassLimit() {
+  TestMCP2515 can;
+  begin(can);
+  assert(can.startInterruptTask(1, 1) == 1);
+
+  fakeChip.completeTransmit(0);
+  can.handleInterrupt();
+  assert(fakeChip.notifications == 0);
+
+  fakeChip.stuck_intf = 0x20; // ERRIF
+  fakeChip.regs[0x2c] |= 0x20;
+  can.handleInterrupt();
+  assert(can.getStats().error_interrupts == 8);
+  assert(can.getStats().interrupt_pass_limit == 1);
+  assert(fakeChip.notifications == 1);
+
+  fakeChip.stuck_intf = 0;
+  can.handleInterrupt();
+  assert(can.getStats().interrupt_pass_limit == 1);
+  assert(fakeChip.notifications == 1);
+}
+
+// Inside the ISR there is no task to come back, so it keeps going until INT is high
+void testInterruptPassLimitInISR() {
+  TestMCP2515 can;
+  begin(can);
+
+  // Clears on the 12th try, more passes than the task takes at once
+  fakeChip.stuck_intf = 0x20; // ERRIF
+  fakeChip.stuck_clears = 12;
+  fakeChip.regs[0x2c] |= 0x20;
+  can.handleInterrupt();
+  assert(can.getStats().error_interrupts == 12);
+  assert(can.getStats().interrupt_pass_limit == 1);
+  assert(fakeChip.notifications == 0);
+  assert(!(fakeChip.regs[0x2c] & 0x20));
+}
+
+int main() {
+  printf("Running testExpiredFrameFreesMailbox()... ");
+  testExpiredFrameFreesMailbox();
+  printf("Passed\n");
+  printf("Running testSentFrameIsNotAborted()... ");
+  testSentFrameIsNotAborted();
+  printf("Passed\n");
+  printf("Running testBlockingTimeout()... ");
+  testBlockingTimeout();
+  printf("Passed\n");
+  printf("Running testQueueOrder()... ");
+  testQueueOrder();
+  printf("Passed\n");
+  printf("Running testBlockingArbitrationLoss()... ");
+  testBlockingArbitrationLoss();
+  printf("Passed\n");
+  printf("Running testQueueSkipsPendingBuffer()... ");
+  testQueueSkipsPendingBuffer();
+  printf("Passed\n");
+  printf("Running testInterruptPassLimit()... ");
+  testInterruptPassLimit();
+  printf("Passed\n");
+  printf("Running testInterruptPassLimitInISR()... ");
+  testInterruptPassLimitInISR();
+  printf("Passed\n");
+}
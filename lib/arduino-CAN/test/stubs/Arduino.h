@@ -0,0 +1,39 @@
+// Just enough of the Arduino core to build the controllers on the host
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+
+#define HEX 16
+#define MSBFIRST 1
+#define LSBFIRST 0
+#define SPI_MODE0 0
+#define INPUT_PULLUP 5
+#define OUTPUT 3
+#define LOW 0
+#define HIGH 1
+#define FALLING 2
+#define IRAM_ATTR
+
+typedef uint8_t byte;
+
+class Stream {
+public:
+  int printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+  void print(const char*) {}
+  void print(char) {}
+  void print(int, int = 10) {}
+  void println() {}
+};
+
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+unsigned long millis();
+unsigned long micros();
+void pinMode(int pin, int mode);
+int digitalRead(int pin);
+void digitalWrite(int pin, int value);
+int digitalPinToInterrupt(int pin);
+void attachInterrupt(int interrupt, void (*handler)(), int mode);
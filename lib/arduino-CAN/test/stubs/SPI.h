@@ -0,0 +1,19 @@
+#pragma once
+#include <Arduino.h>
+
+class SPISettings {
+public:
+  SPISettings(uint32_t = 1000000, uint8_t = MSBFIRST, uint8_t = SPI_MODE0) {}
+};
+
+// Transfers go to the fake MCP2515, see FakeMCP2515.h
+class SPIClass {
+public:
+  SPIClass(uint8_t bus = 0) {}
+  void begin(int8_t sck = -1, int8_t miso = -1, int8_t mosi = -1, int8_t ss = -1) {}
+  void beginTransaction(SPISettings settings) {}
+  void endTransaction() {}
+  void transfer(void* data, uint32_t size);
+};
+
+extern SPIClass SPI;
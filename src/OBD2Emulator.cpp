@@ -9,6 +9,7 @@
 #include <CANStream.h>
 #include <OBD2Responder.h>
 #include <WiFi.h>
+#include <DebugQueue.h>
 
 const char* ota_version = "0.2.128";
 const char* ota_url = "http://192.168.101.1:23001/emulator.json";
@@ -18,8 +19,21 @@ const uint broadcast_port = 23000;
 
 Broadcast broadcast = Broadcast(broadcast_address, broadcast_port);
 
+// Everything prints to the queue, only its task on core 0 touches the network
+DebugQueue debug(broadcast);
+const UBaseType_t debug_task_priority = 1;
+const BaseType_t debug_task_core = 0;
+
+// Only let diagnostic traffic through to the CPU: the functional request
+// 0x7DF on RXB0 and the physical request/response range 0x7E0-0x7EF on RXB1
+const CANAcceptanceFilter diagnostic_filter = {
+    .extended = false,
+    .masks = { 0x7FF, 0x7F0 },
+    .filters = { 0x7DF, 0x7DF, 0x7E0, 0x7E0, 0x7E0, 0x7E0 }
+};
+
 // CAN Configuration for OBD-II interface
-CANConfig can_config = {
+constexpr CANConfig can_config = {
     .instance_id = 0,
     .cs_pin = 5,
     .irq_pin = 4,
@@ -29,19 +43,39 @@ CANConfig can_config = {
     .spi_sck_pin = 18,
     .spi_miso_pin = 19,
     .spi_mosi_pin = 23,
-    .spi_frequency = 1000000,
+    .spi_frequency = 10000000,
     .spi_bit_order = MSBFIRST,
-    .spi_mode = SPI_MODE0
+    .spi_mode = SPI_MODE0,
+    .tx_deadline_us = 10000,
+    .acceptance_filter = &diagnostic_filter,
+    .sof_pin = -1,
+    .rx_task_priority = 20,
+    .rx_task_core = 1,
+    .spi_backend = MCP2515_SPI_ESP_IDF,
+    .spi_host = VSPI_HOST,
+    .sample_point = 750,
+    .classifier = nullptr
 };
 
-// CAN Stream - using Broadcast as Stream* for debug output
-CANStream can_stream = CANStream(can_config, &broadcast);
+static_assert(mcp2515BitTiming(can_config.clock_frequency, can_config.baud_rate,
+    can_config.sample_point).valid, "CAN bit timing out of tolerance");
 
-// OBD-II Responder - using Broadcast as Stream* for debug output
+// CAN Stream - using the debug queue as Stream* for debug output
+// Only the newest request is answered, a few frames of slack is plenty
+BufferedCANStream<8, CANPackedFrame> can_stream(can_config, &debug);
+
+// OBD-II Responder - using the debug queue as Stream* for debug output
 OBD2Responder obd2_responder = OBD2Responder(
-    can_stream, &broadcast
+    can_stream, &debug
 );
 
+// Answers requests on core 1 next to the receive task (priority 20), woken by
+// the stream as frames arrive
+const UBaseType_t responder_task_priority = 19;
+const BaseType_t responder_task_core = 1;
+const unsigned long responder_task_stack = 4096;
+TaskHandle_t responder_task = nullptr;
+
 void connectWifi() {
     Serial.print("Connecting to WiFi\n");
     WiFi.mode(WIFI_STA);
@@ -61,7 +95,7 @@ void checkForOtaUpdate() {
     char debug_message[128];
     memset(debug_message, 0x0, 128);
     sprintf(debug_message, "Current version: %s, checking for update\n", ota_version);
-    broadcast.send(debug_message, strlen(debug_message));
+    debug.print(debug_message);
 
     ESP32OTAPull ota;
     int ret = ota.CheckForOTAUpdate(ota_url, ota_version);
@@ -69,17 +103,17 @@ void checkForOtaUpdate() {
 
     memset(debug_message, 0x0, 128);
     sprintf(debug_message, "Update version: %s\n", otaVersion.c_str());
-    broadcast.send(debug_message, strlen(debug_message));
+    debug.print(debug_message);
 
     if (ret == ESP32OTAPull::UPDATE_AVAILABLE) {
-        broadcast.send("Installing OTA update\n");
-        broadcast.flush();
+        debug.print("Installing OTA update\n");
+        debug.flush();
         delay(2000);
 
         ota.CheckForOTAUpdate(ota_url, ota_version, ESP32OTAPull::UPDATE_AND_BOOT);
     } else {
-        broadcast.send("Already up-to-date.\n");
-        broadcast.flush();
+        debug.print("Already up-to-date.\n");
+        debug.flush();
     }
 }
 
@@ -94,6 +128,30 @@ void printOdb2Status() {
     }
 }
 
+void handleRequests() {
+    while (can_stream.available()) {
+        FrameResultCode result = obd2_responder.handleNextFrame();
+        if (result == PACKET_RESULT_TX_QUEUE_FULL) {
+            // Woken again when a transmit completes
+            break;
+        } else if (result > 0) {
+            can_stream.printStats();
+        } else {
+            // A negative status code means the frame wasn't processed
+            // Since we're not doing anything else with it, drop it
+            can_stream.consume();
+        }
+    }
+}
+
+void responderTaskLoop(void* arg) {
+    while (true) {
+        // The timeout only matters if a notification is ever missed
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(5));
+        handleRequests();
+    }
+}
+
 void runTests() {
     test_byte_to_bits();
     test_byte_array_to_bits();
@@ -103,41 +161,49 @@ void setup() {
     setCpuFrequencyMhz(160);
     Serial.begin (115200);
     runTests();
+    debug.startTask(debug_task_priority, debug_task_core);
     connectWifi();
     delay(2000);
-    broadcast.send("Starting up OBD-II Emulator...\n");
+    debug.print("Starting up OBD-II Emulator...\n");
     
     checkForOtaUpdate();
     
     // Initialize CAN Stream
     int can_init_status = can_stream.begin();
     if (can_init_status == 1) {
-        broadcast.send("CAN Stream Ready.\n");
+        debug.print("CAN Stream Ready.\n");
+        can_stream.benchmarkSPI(1000);
     } else {
         char msg[50];
         snprintf(msg, 50, "Failed to initialize CAN Stream with status %i.\n", can_init_status);
-        broadcast.send(msg);
+        debug.print(msg);
     }
     
     // Initialize OBD-II Responder
     int obd2_init_status = obd2_responder.init();
     if (obd2_init_status == 1) {
-        broadcast.send("OBD-II Responder Ready.\n");
+        debug.print("OBD-II Responder Ready.\n");
+        if (xTaskCreatePinnedToCore(responderTaskLoop, "obd2_responder", responder_task_stack,
+                nullptr, responder_task_priority, &responder_task, responder_task_core) == pdPASS) {
+            can_stream.setNotifyTask(responder_task);
+        } else {
+            debug.print("Failed to start OBD-II Responder task, responding from loop().\n");
+            responder_task = nullptr;
+        }
     } else {
         char msg[50];
         snprintf(msg, 50, "Failed to initialize OBD-II Responder with status %i.\n", obd2_init_status);
-        broadcast.send(msg);
+        debug.print(msg);
     }
 }
 
 void loop() {
-    broadcast.flush();
-    if (obd2_responder.handleNextFrame() > 0) {
-        can_stream.printStats();
-    } else {
-        // A negative status code means the frame wasn't processed
-        // Since we're not doing anything else with it, clear it out
-        can_stream.clearBuffer();
+    // The responder task normally does this, polling is only the fallback
+    if (!responder_task) {
+        handleRequests();
+    }
+    debug.flush();
+    if (responder_task) {
+        delay(10); // Only housekeeping is left here
     }
-    broadcast.flush();
 }
@@ -7,23 +7,41 @@
 #include <Update.h>
 #include <ESP32OTAPull.h>
 #include <CANProxy.h>
+#include <CANRouter.h>
 #include <DebugWebserver.h>
+#include <DebugQueue.h>
+#include <TaskMonitor.h>
 
 const bool wifi_enabled = true;
 const char* ota_version = "0.2.97";
 const char* ota_url = "http://192.168.101.1:23001/proxy.json";
+const char* routes_url = "http://192.168.101.1:23001/routes.json";
 
 const char* broadcast_address = "192.168.101.255";
 const uint broadcast_port = 23000;
-Broadcast debug = Broadcast(broadcast_address, broadcast_port);
+Broadcast broadcast = Broadcast(broadcast_address, broadcast_port);
+
+// Everything prints to the queue, only its task on core 0 touches the network
+DebugQueue debug(broadcast);
+const UBaseType_t debug_task_priority = 1;
+const BaseType_t debug_task_core = 0;
 
 const uint webserver_port = 23002;
 DebugWebserver webserver = DebugWebserver(webserver_port);
 
+// Only let diagnostic traffic through to the CPU: the functional request
+// 0x7DF on RXB0 and the physical request/response range 0x7E0-0x7EF on RXB1
+const CANAcceptanceFilter diagnostic_filter = {
+    .extended = false,
+    .masks = { 0x7FF, 0x7F0 },
+    .filters = { 0x7DF, 0x7DF, 0x7E0, 0x7E0, 0x7E0, 0x7E0 }
+};
+
 // CAN Configuration
-// CAN1: Scanner interface (CS=GPIO5, IRQ=GPIO4)
-// CAN2: ECU interface (CS=GPIO14, IRQ=GPIO13)
-CANConfig can1_config = {
+// CAN1: Scanner interface (CS=GPIO5, IRQ=GPIO4) on VSPI (SCK=18, MISO=19, MOSI=23)
+// CAN2: ECU interface (CS=GPIO14, IRQ=GPIO13) sharing VSPI. Rewired to
+// SCK=25, MISO=26, MOSI=27 it can have HSPI to itself, see the README.
+constexpr CANConfig can1_config = {
     .instance_id = 0,
     .cs_pin = 5,
     .irq_pin = 4,
@@ -33,12 +51,21 @@ CANConfig can1_config = {
     .spi_sck_pin = 18,
     .spi_miso_pin = 19,
     .spi_mosi_pin = 23,
-    .spi_frequency = 1000000,
+    .spi_frequency = 10000000,
     .spi_bit_order = MSBFIRST,
-    .spi_mode = SPI_MODE0
+    .spi_mode = SPI_MODE0,
+    .tx_deadline_us = 10000,
+    .acceptance_filter = &diagnostic_filter,
+    .sof_pin = -1,
+    .rx_task_priority = 20,
+    .rx_task_core = 1,
+    .spi_backend = MCP2515_SPI_ESP_IDF,
+    .spi_host = VSPI_HOST,
+    .sample_point = 750,
+    .classifier = nullptr
 };
 
-CANConfig can2_config = {
+constexpr CANConfig can2_config = {
     .instance_id = 1,
     .cs_pin = 14,
     .irq_pin = 13,
@@ -48,13 +75,43 @@ CANConfig can2_config = {
     .spi_sck_pin = 18,
     .spi_miso_pin = 19,
     .spi_mosi_pin = 23,
-    .spi_frequency = 1000000,
+    .spi_frequency = 10000000,
     .spi_bit_order = MSBFIRST,
-    .spi_mode = SPI_MODE0
+    .spi_mode = SPI_MODE0,
+    .tx_deadline_us = 10000,
+    .acceptance_filter = nullptr,
+    .sof_pin = -1,
+    .rx_task_priority = 20,
+    .rx_task_core = 1,
+    .spi_backend = MCP2515_SPI_ESP_IDF,
+    .spi_host = VSPI_HOST,
+    .sample_point = 750,
+    .classifier = nullptr
 };
 
-// CAN Proxy - using Broadcast as Stream* for debug output
-CANProxy can_proxy = CANProxy(can1_config, can2_config, &debug);
+static_assert(mcp2515BitTiming(can1_config.clock_frequency, can1_config.baud_rate,
+    can1_config.sample_point).valid, "CAN1 bit timing out of tolerance");
+static_assert(mcp2515BitTiming(can2_config.clock_frequency, can2_config.baud_rate,
+    can2_config.sample_point).valid, "CAN2 bit timing out of tolerance");
+
+// The scanner side is filtered down to diagnostic requests, the ECU side
+// sees the whole bus and needs room for bursts. Frames are read well inside
+// the 16.7 s packed timestamp window, so both store 16 byte packed frames.
+BufferedCANStream<16, CANPackedFrame> can1_stream(can1_config, &debug);
+BufferedCANStream<64, CANPackedFrame> can2_stream(can2_config, &debug);
+
+// CAN Proxy - using the debug queue as Stream* for debug output
+CANProxy can_proxy(can1_stream, can2_stream, &debug);
+
+// Per-id routing rules, everything is forwarded unchanged until routes.json loads
+CANRouter can_router;
+
+// Forwarding runs next to the receive tasks (priority 20) on core 1, just below them
+const UBaseType_t can_proxy_task_priority = 19;
+const BaseType_t can_proxy_task_core = 1;
+
+// Core 1: CAN receive, forwarding and loop(). Core 0: WiFi, HTTP, OTA, debug output.
+TaskMonitor task_monitor;
 
 // System state flags
 bool can_proxy_initialized = false;
@@ -113,6 +170,30 @@ void checkForOtaUpdate() {
     }
 }
 
+// Routing rules sit next to the OTA image. They're compiled and swapped in
+// whole, so this can run again at any time without stopping forwarding.
+void loadRoutes() {
+    if (!wifi_connected) {
+        return;
+    }
+
+    HTTPClient http;
+    http.begin(routes_url);
+    int status = http.GET();
+    if (status == HTTP_CODE_OK) {
+        int result = can_router.load(http.getStream());
+        if (result == 1) {
+            debug.printf("Loaded %u routes from %s\n", (unsigned int)can_router.size(), routes_url);
+        } else {
+            debug.printf("Failed to load routes from %s with status %i, keeping %u routes\n",
+                routes_url, result, (unsigned int)can_router.size());
+        }
+    } else {
+        debug.printf("No routes at %s (HTTP %i), forwarding everything\n", routes_url, status);
+    }
+    http.end();
+}
+
 unsigned long last_status_print = 0;
 unsigned long status_print_interval = 10000; // 10 seconds
 
@@ -125,6 +206,7 @@ void printStatus() {
         if (can_proxy_initialized) {
             // Only call these methods if CAN proxy is initialized
             can_proxy.printStats();
+            task_monitor.print(&debug);
         } else {
             debug.print("CAN Proxy: NOT INITIALIZED\n");
         }
@@ -166,6 +248,12 @@ void setup() {
     }
     
     runTests();
+
+    if (debug.startTask(debug_task_priority, debug_task_core) != 1) {
+        Serial2.println("Failed to start debug queue task, printing from the caller");
+    }
+    task_monitor.watch(xTaskGetCurrentTaskHandle()); // loop()
+    task_monitor.watch(debug.getTask());
     
     // Initialize broadcast first for error reporting
     Serial2.print("Starting up OBD-II CAN Proxy...\n");
@@ -182,6 +270,7 @@ void setup() {
 
         // Check for OTA updates
         checkForOtaUpdate();
+        loadRoutes();
 
         if (wifi_connected) {
             debug.print("\nStarting up OBD-II CAN Proxy...\n");
@@ -201,11 +290,20 @@ void setup() {
     }
     
     // Initialize CAN Proxy
+    can_proxy.setRouter(&can_router);
     int can_proxy_status = can_proxy.begin();
     
     if (can_proxy_status == 1) {
         can_proxy_initialized = true;
         can_proxy.activateOBD2Responder(34); // GPIO34 for OBD2 responder enable/disable
+        can_proxy.benchmarkSPI(1000);
+        // Started last, the benchmark empties the RX buffers while it runs
+        if (can_proxy.startForwardingTask(can_proxy_task_priority, can_proxy_task_core) != 1) {
+            reportError("Failed to start CAN Proxy forwarding task, forwarding from loop()");
+        }
+        task_monitor.watch(can1_stream.getCANController()->getInterruptTask());
+        task_monitor.watch(can2_stream.getCANController()->getInterruptTask());
+        task_monitor.watch(can_proxy.getForwardingTask());
         debug.print("CAN Proxy initialized successfully.\n");
     } else {
         char error_msg[100];
@@ -219,8 +317,8 @@ void setup() {
 }
 
 void loop() {
-    // Handle CAN proxy frames (forwarding between CAN1 and CAN2)
-    if (can_proxy_initialized) {
+    // The forwarding task normally does this, polling is only the fallback
+    if (can_proxy_initialized && !can_proxy.hasForwardingTask()) {
         can_proxy.handleFrames();
     }
     
@@ -231,6 +329,6 @@ void loop() {
         last_flush = millis();
     }
     
-    // Small delay to prevent overwhelming the system
-    delay(1);
+    // Only housekeeping is left here when the forwarding task runs
+    delay(can_proxy.hasForwardingTask() ? 10 : 1);
 } 